@@ -2,43 +2,250 @@
 #define BUFFER_CL_H
 
 #include "Storage.h"
+#include "MemoryBudgetCL.h"
 
 namespace GPU {
 	namespace CL {
 
+	/*
+		Buffers can be views over part of another buffer (Slice, View), sharing its storage and device
+		memory. Count, Size, Data and the offset helpers then describe the view: DeviceBytesOffset is
+		where it starts in Get(), HostBytesOffset where it starts in the storage.
+	*/
 	template <typename T>
 	class BufferCL {
 	public:
 		typedef std::shared_ptr<BufferCL> Ptr;
 
-		const cl::Buffer& Get() const { return _buffer; }
+		// Budgeted buffers (see MemoryBudgetCL) are restored here if they were evicted. Pin() first when
+		// the returned buffer must stay resident, QueueCL does so for its operands.
+		cl::Buffer Get() const { return _alloc && !_pin ? _alloc->Get() : _buffer; }
 
-		size_t Size() const { return _impl->RawSize(); }
+		size_t Size() const { return Count() * sizeof(T); }
 
 		size_t DeviceBytesOffset() const { return _deviceOffset * sizeof(T); }
-		size_t DeviceSizeFromOffset() const { return _impl->RawSize() - (_deviceOffset * sizeof(T)); }
+		size_t DeviceSizeFromOffset() const { return Size(); }
 
 		size_t HostBytesOffset() const { return _hostOffset * sizeof(T); }
-		size_t HostSizeFromOffset() const { return _impl->RawSize() - (_hostOffset * sizeof(T)); }
+		size_t HostSizeFromOffset() const { return Size(); }
 
-		size_t Count() const { return _impl->Size(); }
+		size_t Count() const { return _view ? _count : _impl->Size(); }
 		cl_mem_flags Flags() const { return _flags; }
-		T* Data() const { return _impl->Data(); }
+		T* Data() const { return _impl->Data() + _hostOffset; }
+
+		const typename Storage<T>::Ptr& Host() const { return _impl; }
+
+		bool IsZeroCopy() const { return (_flags & CL_MEM_USE_HOST_PTR) != 0; }
+		bool IsHostAllocated() const { return (_flags & CL_MEM_ALLOC_HOST_PTR) != 0; }
+
+		bool IsView() const { return _view; }
+
+		bool IsBudgeted() const { return _alloc != nullptr; }
+
+		// Get() may return a new buffer after an eviction; false for sub-buffers, which pin their parent.
+		bool IsEvictable() const { return _alloc && !_pin; }
+		const AllocationCL::Ptr& Allocation() const { return _alloc; }
+
+		// Keeps a budgeted buffer resident while the token lives (e.g. during work on another queue).
+		std::shared_ptr<void> Pin() const { return _alloc ? _alloc->Pin() : nullptr; }
+
+		// Offset views address their first element at a device offset; kernels would see the start of Get().
+		bool IsKernelArgument() const { return _deviceOffset == 0; }
+
+		// Count elements from offset. A sub-buffer when the offset is a multiple of every device's
+		// CL_DEVICE_MEM_BASE_ADDR_ALIGN (so it can be a kernel argument), an offset view otherwise.
+		Ptr Slice(size_t offset, size_t count) const;
+
+		// Offset view, never allocates. Usable in every QueueCL transfer, fill and copy.
+		Ptr View(size_t offset, size_t count) const;
+
+		/*
+			Residency tracking: once enabled QueueCL moves only dirty ranges, kernels upload what the host
+			changed before they run and mark writable arguments dirty on the device. Writes through At()
+			are recorded, writes through Data() or the storage need MarkHostDirty(). Value() reads without
+			marking anything. Both throw for elements the device changed since the last ReadBuffer.
+			Views share the tracking of the buffer they were taken from.
+		*/
+		void Track() {
+			if (_view) {
+				throw std::runtime_error("BufferCL, track the whole buffer before taking views.");
+			}
+			if (!_residency) {
+				_residency = ResidencyCL::New(Get(), reinterpret_cast<char*>(_impl->Data()), _impl->RawSize(), IsZeroCopy());
+				if (!(_flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR))) {
+					_residency->MarkHostDirty();
+				}
+				if (_alloc) {
+					_alloc->SetResidency(_residency);
+				}
+			}
+		}
+
+		bool IsTracked() const { return _residency != nullptr; }
+		const ResidencyCL::Ptr& Residency() const { return _residency; }
+
+		T& At(size_t i) {
+			if (_residency) {
+				_CheckHostCurrent(i);
+				_residency->MarkHostDirty(HostBytesOffset() + i * sizeof(T), sizeof(T));
+			}
+			return _impl->At(_hostOffset + i);
+		}
+
+		const T& At(size_t i) const { return Value(i); }
+
+		const T& Value(size_t i) const {
+			if (_residency) {
+				_CheckHostCurrent(i);
+			}
+			return _impl->At(_hostOffset + i);
+		}
+
+		void MarkHostDirty(size_t offset = 0, size_t count = ~size_t(0)) const {
+			if (_residency) {
+				_residency->MarkHostDirty(HostBytesOffset() + offset * sizeof(T), _Bytes(offset, count));
+			}
+		}
+
+		// Untracked budgeted buffers only remember that the device holds something newer, which keeps
+		// them from being evicted over unwritten host edits (see AllocationCL).
+		void MarkDeviceDirty(size_t offset = 0, size_t count = ~size_t(0)) const {
+			if (_residency) {
+				_residency->MarkDeviceDirty(HostBytesOffset() + offset * sizeof(T), _Bytes(offset, count));
+			} else if (_alloc && _Bytes(offset, count)) {
+				_alloc->MarkDeviceNewer();
+			}
+		}
+
+		// After a read or write of the whole buffer host and device hold the same bytes.
+		void MarkHostCurrent() const {
+			if (!_residency && _alloc && !_view) {
+				_alloc->MarkHostCurrent();
+			}
+		}
 
 		BufferCL(const cl::Context& c, typename Storage<T>::Ptr i, const cl_mem_flags& f)
-			: _impl(i), _flags(f), _deviceOffset(0), _hostOffset(0) {
-			_buffer = cl::Buffer(c, f, i->RawSize(), i->Data());
+			: _impl(i), _flags(f), _deviceOffset(0), _hostOffset(0), _count(0), _view(false), _alignment(0) {
+			const bool hostPtr = (f & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) != 0;
+			_buffer = cl::Buffer(c, f, i->RawSize(), hostPtr ? i->Data() : nullptr);
+		}
+
+		BufferCL(const cl::Buffer& b, typename Storage<T>::Ptr i, const cl_mem_flags& f)
+			: _buffer(b), _impl(i), _flags(f), _deviceOffset(0), _hostOffset(0), _count(0), _view(false), _alignment(0) {}
+
+		// Budgeted when the storage has host memory to evict to; zero-copy and host allocated buffers never are.
+		BufferCL(const cl::Context& c, typename Storage<T>::Ptr i, const cl_mem_flags& f, const MemoryBudgetCL::Ptr& budget)
+			: _impl(i), _flags(f), _deviceOffset(0), _hostOffset(0), _count(0), _view(false), _alignment(0) {
+			const bool hostPtr = (f & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) != 0;
+			if (budget && i->Data() && i->RawSize() && !(f & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR))) {
+				_alloc = AllocationCL::New(budget, c, f, i->Data(), i->RawSize());
+			} else {
+				_buffer = cl::Buffer(c, f, i->RawSize(), hostPtr ? i->Data() : nullptr);
+			}
 		}
 
 	private:
+		BufferCL(const BufferCL& parent, const cl::Buffer& b, const std::shared_ptr<void>& pin, size_t deviceOffset, size_t hostOffset, size_t count)
+			: _buffer(b), _impl(parent._impl), _residency(parent._residency), _alloc(parent._alloc), _pin(pin), _live(parent._live), _flags(parent._flags),
+			_deviceOffset(deviceOffset), _hostOffset(hostOffset), _count(count), _view(true), _alignment(parent._alignment) {}
+
+		// Clamped to the view, so the default count means "to the end".
+		size_t _Bytes(size_t offset, size_t count) const {
+			return offset >= Count() ? 0 : std::min(count, Count() - offset) * sizeof(T);
+		}
+
+		// The host copy of element i is stale, marking it host dirty would also drop the device's bytes.
+		void _CheckHostCurrent(size_t i) const {
+			if (_residency->IsDeviceDirty(HostBytesOffset() + i * sizeof(T), sizeof(T))) {
+				throw std::runtime_error("BufferCL, element changed on the device, read the buffer first.");
+			}
+		}
+
+		void _Check(size_t offset, size_t count) const {
+			if (offset > Count() || count > Count() - offset) {
+				throw std::runtime_error("BufferCL, view out of range.");
+			}
+		}
+
+		size_t _BaseAlignment() const;
 
 		cl::Buffer _buffer;
 		typename Storage<T>::Ptr _impl;
+		ResidencyCL::Ptr _residency;
+
+		// Sub-buffers of a budgeted buffer pin it, so it is never evicted under them.
+		AllocationCL::Ptr _alloc;
+		std::shared_ptr<void> _pin;
+
+		// DeviceCL::Live token, shared with the views.
+		std::shared_ptr<void> _live;
 
 		cl_mem_flags _flags;
 		size_t _deviceOffset, _hostOffset;
+		size_t _count;
+		bool _view;
+		mutable size_t _alignment;
+
+		friend class ContextCL;
 	};
 
+	template <typename T>
+	typename BufferCL<T>::Ptr BufferCL<T>::View(size_t offset, size_t count) const {
+		_Check(offset, count);
+		return Ptr(new BufferCL(*this, _buffer, _pin, _deviceOffset + offset, _hostOffset + offset, count));
+	}
+
+	template <typename T>
+	typename BufferCL<T>::Ptr BufferCL<T>::Slice(size_t offset, size_t count) const {
+		_Check(offset, count);
+
+		// Sub-buffers cannot be nested (pooled buffers are sub-buffers too) and must not be empty.
+		const std::shared_ptr<void> pin = _pin ? _pin : Pin();
+		cl::Buffer buffer = Get();
+		cl_mem parent = nullptr;
+		clGetMemObjectInfo(buffer(), CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(parent), &parent, nullptr);
+
+		const size_t origin = (_deviceOffset + offset) * sizeof(T);
+		if (parent || !count || origin % _BaseAlignment()) {
+			return View(offset, count);
+		}
+
+		cl_buffer_region region;
+		region.origin = origin;
+		region.size = count * sizeof(T);
+		const cl_mem_flags access = _flags & (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY | CL_MEM_WRITE_ONLY);
+		cl::Buffer sub = buffer.createSubBuffer(access, CL_BUFFER_CREATE_TYPE_REGION, &region);
+		return Ptr(new BufferCL(*this, sub, pin, 0, _hostOffset + offset, count));
+	}
+
+	// In bytes, the largest CL_DEVICE_MEM_BASE_ADDR_ALIGN of the buffer's context.
+	template <typename T>
+	size_t BufferCL<T>::_BaseAlignment() const {
+		if (_alignment) {
+			return _alignment;
+		}
+
+		cl_context c = nullptr;
+		size_t bytes = 0;
+		cl_int err = clGetMemObjectInfo(Get()(), CL_MEM_CONTEXT, sizeof(c), &c, nullptr);
+		err = err == CL_SUCCESS ? clGetContextInfo(c, CL_CONTEXT_DEVICES, 0, nullptr, &bytes) : err;
+
+		std::vector<cl_device_id> devices(bytes / sizeof(cl_device_id));
+		err = err == CL_SUCCESS ? clGetContextInfo(c, CL_CONTEXT_DEVICES, bytes, devices.data(), nullptr) : err;
+		if (err != CL_SUCCESS) {
+			throw cl::Error(err, "BufferCL, base address alignment");
+		}
+
+		cl_uint bits = 8;
+		for (cl_device_id d : devices) {
+			cl_uint a = 0;
+			clGetDeviceInfo(d, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(a), &a, nullptr);
+			bits = std::max(bits, a);
+		}
+		_alignment = bits / 8;
+		return _alignment;
+	}
+
 	/*
 		Device Origin :	buffer_origin[2] * buffer_slice_pitch + buffer_origin[1] * buffer_row_pitch + buffer_origin[0]
 		Host Origin	  :	host_origin[2] * host_slice_pitch + host_origin[1] * host_row_pitch + host_origin[0];
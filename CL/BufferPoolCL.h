@@ -0,0 +1,182 @@
+#ifndef BUFFER_POOL_CL_H
+#define BUFFER_POOL_CL_H
+
+#include "BufferCL.h"
+#include "DeviceCL.h"
+
+#include <mutex>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Sub-allocates BufferCL views out of large device slabs. Blocks are rounded up to power of two
+		size classes starting at the device alignment, so every sub-buffer origin honours 
+		CL_DEVICE_MEM_BASE_ADDR_ALIGN. Blocks go back to their class free list when the last Ptr drops.
+	*/
+	class BufferPoolCL : public std::enable_shared_from_this<BufferPoolCL> {
+	public:
+		typedef std::shared_ptr<BufferPoolCL> Ptr;
+
+		struct Stats {
+			size_t Slabs;
+			size_t ReservedBytes;
+			size_t InUseBytes;
+			size_t RequestedBytes;
+			size_t FreeListBytes;
+			size_t HighWaterBytes;
+			size_t Allocations;
+			size_t Reuses;
+			double Fragmentation;
+		};
+
+		BufferPoolCL(const cl::Context& c, const DeviceCL& d, size_t slabSize = 64 * 1024 * 1024, const cl_mem_flags& f = CL_MEM_READ_WRITE)
+			: _context(c), _flags(f), _alignment(std::max<size_t>(d.GetInfo().BaseAddressAlign / 8, sizeof(cl_ulong))) {
+			// Rounded down when clamped, an aligned CL_DEVICE_MAX_MEM_ALLOC_SIZE could not be allocated.
+			_slabSize = std::min(AlignedSize(slabSize, _alignment), d.GetInfo().MaxBufferSize / _alignment * _alignment);
+			_top = _slabSize;
+			_inUse = _requested = _highWater = _allocations = _reuses = 0;
+		}
+
+		template <typename T>
+		typename BufferCL<T>::Ptr Acquire(typename Storage<T>::Ptr host);
+
+		template <typename T>
+		typename BufferCL<T>::Ptr Acquire(size_t count) {
+			return Acquire<T>(AlignedStorage<T>::New(count, std::max<size_t>(_alignment, U_PAGE_SIZE)));
+		}
+
+		size_t SlabSize() const { return _slabSize; }
+		size_t Alignment() const { return _alignment; }
+
+		Stats GetStats() const;
+
+	private:
+		struct Block {
+			size_t Slab;
+			size_t Offset;
+		};
+
+		size_t _Class(size_t bytes) const;
+		size_t _ClassSize(size_t c) const { return _alignment << c; }
+
+		Block _Allocate(size_t c, size_t bytes);
+		void _Release(const Block& b, size_t c, size_t bytes);
+
+		cl::Context _context;
+		cl_mem_flags _flags;
+		size_t _alignment, _slabSize;
+
+		mutable std::mutex _mutex;
+		std::vector<cl::Buffer> _slabs;
+		std::vector<std::vector<Block>> _free;
+		size_t _top;
+
+		size_t _inUse, _requested, _highWater, _allocations, _reuses;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(BufferPoolCL);
+	};
+
+	template <typename T>
+	typename BufferCL<T>::Ptr BufferPoolCL::Acquire(typename Storage<T>::Ptr host) {
+		const size_t bytes = host->RawSize();
+		const size_t c = _Class(bytes);
+		if (_ClassSize(c) > _slabSize) {
+			return std::make_shared<BufferCL<T>>(_context, host, _flags);
+		}
+
+		const Block b = _Allocate(c, bytes);
+
+		cl_buffer_region region;
+		region.origin = b.Offset;
+		region.size = bytes;
+
+		cl::Buffer sub;
+		try {
+			std::lock_guard<std::mutex> lock(_mutex);
+			sub = _slabs[b.Slab].createSubBuffer(_flags, CL_BUFFER_CREATE_TYPE_REGION, &region);
+		} catch (const cl::Error&) {
+			_Release(b, c, bytes);
+			throw;
+		}
+
+		std::weak_ptr<BufferPoolCL> pool = shared_from_this();
+		return typename BufferCL<T>::Ptr(new BufferCL<T>(sub, host, _flags), [pool, b, c, bytes](BufferCL<T>* p) {
+			delete p;
+			if (auto owner = pool.lock()) {
+				owner->_Release(b, c, bytes);
+			}
+		});
+	}
+
+	inline size_t BufferPoolCL::_Class(size_t bytes) const {
+		size_t c = 0;
+		while (_ClassSize(c) < bytes) {
+			c++;
+		}
+		return c;
+	}
+
+	inline BufferPoolCL::Block BufferPoolCL::_Allocate(size_t c, size_t bytes) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		const size_t size = _ClassSize(c);
+		Block b;
+		if (c < _free.size() && !_free[c].empty()) {
+			b = _free[c].back();
+			_free[c].pop_back();
+			_reuses++;
+		} else {
+			if (_top + size > _slabSize) {
+				_slabs.push_back(cl::Buffer(_context, _flags, _slabSize));
+				_top = 0;
+			}
+			b.Slab = _slabs.size() - 1;
+			b.Offset = _top;
+			_top += size;
+		}
+
+		_allocations++;
+		_inUse += size;
+		_requested += bytes;
+		_highWater = std::max(_highWater, _inUse);
+		return b;
+	}
+
+	inline void BufferPoolCL::_Release(const Block& b, size_t c, size_t bytes) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (c >= _free.size()) {
+			_free.resize(c + 1);
+		}
+		_free[c].push_back(b);
+
+		_inUse -= _ClassSize(c);
+		_requested -= bytes;
+	}
+
+	inline BufferPoolCL::Stats BufferPoolCL::GetStats() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		Stats s;
+		s.Slabs = _slabs.size();
+		s.ReservedBytes = _slabs.size() * _slabSize;
+		s.InUseBytes = _inUse;
+		s.RequestedBytes = _requested;
+		s.HighWaterBytes = _highWater;
+		s.Allocations = _allocations;
+		s.Reuses = _reuses;
+
+		s.FreeListBytes = 0;
+		for (size_t c = 0; c < _free.size(); c++) {
+			s.FreeListBytes += _free[c].size() * _ClassSize(c);
+		}
+
+		// Share of the reserved memory that does not hold live, requested bytes.
+		s.Fragmentation = s.ReservedBytes ? 1.0 - double(_requested) / double(s.ReservedBytes) : 0.0;
+		return s;
+	}
+
+}}
+
+#endif
@@ -11,12 +11,31 @@ OTHER_FILES += \
 
 HEADERS += \
     BufferCL.h \
+    BufferPoolCL.h \
+    CommandBatchCL.h \
     CommonCL.h \
     ContextCL.h \
     DeviceCL.h \
+    ImageCL.h \
     KernelCL.h \
+    KernelPoolCL.h \
+    MappedFile.h \
+    MemoryBudgetCL.h \
+    MetricsCL.h \
+    MultiDeviceCL.h \
+    PackConvert.h \
+    PackedBufferCL.h \
+    PixelConvert.h \
+    PrimitivesCL.h \
+    ProfilerCL.h \
     ProgramCL.h \
+    ProgramCacheCL.h \
     QueueCL.h \
-    Storage.h
+    ResidencyCL.h \
+    SortCL.h \
+    Storage.h \
+    StreamCL.h \
+    TunerCL.h \
+    TypedKernelCL.h
 
 
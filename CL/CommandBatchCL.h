@@ -0,0 +1,195 @@
+#ifndef COMMAND_BATCH_CL_H
+#define COMMAND_BATCH_CL_H
+
+#include "QueueCL.h"
+
+#include <functional>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Records a fixed sequence of kernels, transfers and fills once and replays it with non-blocking 
+		commands only. Buffers and kernels are held by reference and must outlive the batch; kernel 
+		arguments are captured at record time and set again on every Submit, so the same kernel may 
+		appear several times with different arguments.
+	*/
+	class CommandBatchCL {
+	public:
+		typedef std::shared_ptr<CommandBatchCL> Ptr;
+
+		// The queue is flushed once First commands are pending, then after every 2x as many up to Max. 
+		// Early flushes get the device started, later ones amortise the driver call. First = 0 flushes only at the end.
+		struct FlushPolicy {
+			FlushPolicy(size_t first = 4, size_t max = 64) : First(first), Max(max) {}
+
+			size_t First;
+			size_t Max;
+		};
+
+		struct Stats {
+			size_t Commands;
+			size_t Flushes;
+		};
+
+		CommandBatchCL(const FlushPolicy& p = FlushPolicy()) : _policy(p) {}
+
+		template <typename... A>
+		CommandBatchCL& Enqueue(KernelCL& k, const KernelCL::Range& r, const A& ... args) {
+			auto bind = _Bind(k, args...);
+			_commands.push_back([&k, r, bind](QueueCL& q, const FutureCL& after) {
+				bind();
+				return q.Enqueue(k, r, after);
+			});
+			return *this;
+		}
+
+		template <typename... A>
+		CommandBatchCL& Task(KernelCL& k, const A& ... args) {
+			auto bind = _Bind(k, args...);
+			_commands.push_back([&k, bind](QueueCL& q, const FutureCL& after) {
+				bind();
+				return q.Enqueue(k, after);
+			});
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& WriteBuffer(const BufferCL<T>& b) {
+			_commands.push_back([&b](QueueCL& q, const FutureCL& after) { return q.WriteBuffer(b, after); });
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& WriteBufferRect(const BufferCL<T>& b, const BufferRectCL<T>& r) {
+			_commands.push_back([&b, r](QueueCL& q, const FutureCL& after) { return q.WriteBufferRect(b, r, after); });
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& ReadBuffer(const BufferCL<T>& b) {
+			_commands.push_back([&b](QueueCL& q, const FutureCL& after) { return q.ReadBuffer(b, after); });
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& ReadBufferRect(const BufferCL<T>& b, const BufferRectCL<T>& r) {
+			_commands.push_back([&b, r](QueueCL& q, const FutureCL& after) { return q.ReadBufferRect(b, r, after); });
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& CopyBuffer(const BufferCL<T>& src, BufferCL<T>& dest, size_t s = 0) {
+			_commands.push_back([&src, &dest, s](QueueCL& q, const FutureCL& after) { return q.CopyBuffer(src, dest, after, s); });
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& CopyBufferRect(const BufferCL<T>& src, BufferCL<T>& dest, const BufferRectCL<T>& r) {
+			_commands.push_back([&src, &dest, r](QueueCL& q, const FutureCL& after) { return q.CopyBufferRect(src, dest, r, after); });
+			return *this;
+		}
+
+		template <typename T>
+		CommandBatchCL& FillBuffer(const BufferCL<T>& b, const T& val) {
+			_commands.push_back([&b, val](QueueCL& q, const FutureCL& after) { return q.FillBuffer(b, val, after); });
+			return *this;
+		}
+
+		// Enqueues the whole batch without blocking; the returned future completes with the last command.
+		FutureCL Submit(QueueCL& q, const FutureCL& after = FutureCL());
+
+		size_t Size() const { return _commands.size(); }
+		bool Empty() const { return _commands.empty(); }
+		void Clear() { _commands.clear(); }
+
+		const FlushPolicy& Policy() const { return _policy; }
+		void SetPolicy(const FlushPolicy& p) { _policy = p; }
+
+		// Counters of the last Submit.
+		const Stats& LastStats() const { return _stats; }
+
+		static Ptr New(const FlushPolicy& p = FlushPolicy()) {
+			return std::make_shared<CommandBatchCL>(p);
+		}
+
+	private:
+		typedef std::function<FutureCL (QueueCL&, const FutureCL&)> _Command;
+		typedef std::function<void ()> _Setter;
+
+		static _Setter _Bind(KernelCL&) { return [](){}; }
+
+		template <typename... A>
+		static _Setter _Bind(KernelCL& k, const A& ... args) {
+			std::vector<_Setter> setters;
+			_Setters(k, 0, setters, args...);
+			return [setters]() {
+				for (const auto& s : setters) {
+					s();
+				}
+			};
+		}
+
+		template <typename T, typename... P>
+		static void _Setters(KernelCL& k, cl_uint i, std::vector<_Setter>& s, const T& t, const P& ... args) {
+			s.push_back(_Setter1(k, i, t));
+			_Setters(k, i + 1, s, args...);
+		}
+
+		static void _Setters(KernelCL&, cl_uint, std::vector<_Setter>&) {}
+
+		// Buffers, images and samplers are not copyable, keep a reference; everything else is captured by value.
+		template <typename T>
+		static _Setter _Setter1(KernelCL& k, cl_uint i, const BufferCL<T>& b) {
+			return [&k, i, &b]() { k.Arg(i, b); };
+		}
+
+		static _Setter _Setter1(KernelCL& k, cl_uint i, const ImageCL& img) {
+			return [&k, i, &img]() { k.Arg(i, img); };
+		}
+
+		static _Setter _Setter1(KernelCL& k, cl_uint i, const SamplerCL& s) {
+			return [&k, i, &s]() { k.Arg(i, s); };
+		}
+
+		template <typename T>
+		static _Setter _Setter1(KernelCL& k, cl_uint i, const T& t) {
+			return [&k, i, t]() { k.Arg(i, t); };
+		}
+
+		std::vector<_Command> _commands;
+		FlushPolicy _policy;
+		Stats _stats;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(CommandBatchCL);
+	};
+
+	inline FutureCL CommandBatchCL::Submit(QueueCL& q, const FutureCL& after) {
+		_stats.Commands = _stats.Flushes = 0;
+
+		// In-order queues already serialise the batch, out-of-order ones chain every command on the previous.
+		const bool chain = q.IsOutOfOrder();
+
+		FutureCL last = after;
+		size_t threshold = _policy.First, pending = 0;
+
+		for (size_t i = 0; i < _commands.size(); i++) {
+			last = _commands[i](q, chain || i == 0 ? last : FutureCL());
+			_stats.Commands++;
+
+			if (threshold && ++pending >= threshold && i + 1 < _commands.size()) {
+				q.Flush();
+				_stats.Flushes++;
+				pending = 0;
+				threshold = std::min(threshold * 2, std::max(_policy.Max, _policy.First));
+			}
+		}
+
+		q.Flush();
+		_stats.Flushes++;
+		return last;
+	}
+
+}}
+
+#endif
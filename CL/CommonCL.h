@@ -21,6 +21,12 @@
 #include <algorithm>
 #include <assert.h>
 
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
 #define U_KERNEL_CL(arg) #arg
 
 #define U_READ CL_MEM_READ_ONLY
@@ -29,6 +35,12 @@
 #define U_COPY_READ U_READ | CL_MEM_COPY_HOST_PTR
 #define U_COPY_READ_WRITE CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR
 
+#define U_ZERO_COPY_READ U_READ | CL_MEM_USE_HOST_PTR
+#define U_ZERO_COPY_READ_WRITE CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR
+#define U_HOST_ALLOC_READ_WRITE CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR
+
+#define U_PAGE_SIZE 4096
+
 #define U_ARGB_8888 cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8)
 
 #define CASE(s)			\
@@ -43,6 +55,20 @@
 
 #define TRACE(err, msg) std::cout << "Status -> " << ::HelperCL::Err(err) << ": " << msg << " [" << __FILE__ << ", "<< __LINE__  << "]" << std::endl		
 
+namespace GPU {
+namespace CL {
+
+	// Part of temporary file names, so processes sharing a cache directory never write the same file.
+	inline long ProcessId() {
+#ifdef _WIN32
+		return _getpid();
+#else
+		return getpid();
+#endif
+	}
+
+}}
+
 namespace {
 
 	class HelperCL {
@@ -4,6 +4,11 @@
 #include "DeviceCL.h"
 #include "BufferCL.h"
 #include "ProgramCL.h"
+#include "BufferPoolCL.h"
+
+#ifndef _WIN32
+#include "MappedFile.h"
+#endif
 
 namespace GPU {
 namespace CL {
@@ -13,22 +18,24 @@ namespace CL {
 		typedef std::shared_ptr<ContextCL> Ptr;
 		typedef std::unique_ptr<ContextCL> UPtr;
 
-		typedef std::vector<DeviceCL>::iterator DeviceIterator;
-		typedef std::vector<DeviceCL>::const_iterator ConstDeviceIterator;
+		typedef std::vector<DeviceCL::Ptr>::iterator DeviceIterator;
+		typedef std::vector<DeviceCL::Ptr>::const_iterator ConstDeviceIterator;
 
-		ContextCL() : _context(nullptr) {
+		ContextCL() : _context(nullptr), _metrics(MetricsCL::New()) {
 			std::vector<cl::Device> c;
 			c.push_back(cl::Device::getDefault());
 			_context.reset(new cl::Context(c));
 
-			_device.emplace_back(*_context, cl::Device::getDefault());
+			_device.emplace_back(new DeviceCL(*_context, cl::Device::getDefault()));
+			_pool = std::make_shared<BufferPoolCL>(*_context, Device());
 		}
 
-		ContextCL(const std::vector<cl::Device> & d) : _context(nullptr) {
+		ContextCL(const std::vector<cl::Device> & d, cl_command_queue_properties p = 0) : _context(nullptr), _metrics(MetricsCL::New()) {
 			_context.reset(new cl::Context(d));
 			for (const auto& dev : d) {
-				_device.emplace_back(new DeviceCL(*_context, dev));
+				_device.emplace_back(new DeviceCL(*_context, dev, p));
 			}
+			_pool = std::make_shared<BufferPoolCL>(*_context, Device());
 		}
 
 		const cl::Context& Get() const { return *_context; }
@@ -39,8 +46,8 @@ namespace CL {
 		const std::vector<DeviceCL::Ptr>& Devices() const { return _device; }
 		std::vector<DeviceCL::Ptr>& DeviceList() { return _device; }
 
-		std::vector<DeviceCL> GPUs();
-		std::vector<DeviceCL> CPUs();
+		std::vector<DeviceCL::Ptr> GPUs() const;
+		std::vector<DeviceCL::Ptr> CPUs() const;
 
 		const DeviceCL& GPU() const;
 		const DeviceCL& CPU() const;
@@ -52,18 +59,106 @@ namespace CL {
 		ConstDeviceIterator ConstEnd() const { return _device.cend(); }
 		
 		template <typename T>
+		typename Storage<T>::Ptr NewStorage(size_t count) const {
+			return AlignedStorage<T>::New(count, Device().Alignment());
+		}
+
+		// Buffers over host storage count against the budget of Device() (the default device only) and may be
+		// evicted to it, see MemoryBudgetCL.
+		template <typename T>
         typename BufferCL<T>::Ptr NewBuffer(typename Storage<T>::Ptr buf, const cl_mem_flags& f = U_COPY_READ_WRITE) const {
-			return std::make_shared<BufferCL<T>>(*_context, buf, f);
+			return _Live<T>(std::make_shared<BufferCL<T>>(*_context, buf, f, Device().Budget()));
+		}
+
+		template <typename T>
+		typename BufferCL<T>::Ptr NewBuffer(size_t count, const cl_mem_flags& f = U_COPY_READ_WRITE) const {
+			return NewBuffer<T>(NewStorage<T>(count), f);
+		}
+
+		// Residency tracked, QueueCL only moves what changed (see BufferCL::Track).
+		template <typename T>
+		typename BufferCL<T>::Ptr NewTrackedBuffer(typename Storage<T>::Ptr buf, const cl_mem_flags& f = U_COPY_READ_WRITE) const {
+			auto b = NewBuffer<T>(buf, f);
+			b->Track();
+			return b;
+		}
+
+		template <typename T>
+		typename BufferCL<T>::Ptr NewTrackedBuffer(size_t count, const cl_mem_flags& f = U_COPY_READ_WRITE) const {
+			return NewTrackedBuffer<T>(NewStorage<T>(count), f);
 		}
 
 		template <typename T>
 		typename BufferCL<T>::Ptr NewReadOnlyBuffer(typename Storage<T>::Ptr buf) const {
-			return std::make_shared<BufferCL<T>>(*_context, buf, U_COPY_READ);
+			return _Live<T>(std::make_shared<BufferCL<T>>(*_context, buf, U_COPY_READ, Device().Budget()));
 		}
 
 		template <typename T>
 		typename BufferCL<T>::Ptr NewWriteOnlyBuffer(typename Storage<T>::Ptr buf) const {
-			return std::make_shared<BufferCL<T>>(*_context, buf, U_WRITE);
+			return _Live<T>(std::make_shared<BufferCL<T>>(*_context, buf, U_WRITE, Device().Budget()));
+		}
+
+		template <typename T>
+		typename BufferCL<T>::Ptr NewZeroCopyBuffer(typename Storage<T>::Ptr buf, const cl_mem_flags& f = U_ZERO_COPY_READ_WRITE) const {
+			return _Live<T>(std::make_shared<BufferCL<T>>(*_context, buf, f));
+		}
+
+#ifndef _WIN32
+		// File contents are used in place (zero-copy) or copied straight from the page cache, never staged on the heap.
+		template <typename T>
+		typename BufferCL<T>::Ptr NewMappedBuffer(const std::string& path, typename MappedFile<T>::Mode m = MappedFile<T>::ReadOnly, bool zeroCopy = true) const {
+			auto file = MappedFile<T>::New(path, m);
+			const bool ro = m == MappedFile<T>::ReadOnly;
+			if (zeroCopy) {
+				return NewZeroCopyBuffer<T>(file, ro ? U_ZERO_COPY_READ : U_ZERO_COPY_READ_WRITE);
+			}
+			return NewBuffer<T>(file, ro ? U_COPY_READ : U_COPY_READ_WRITE);
+		}
+#endif
+
+		// Per-request temporaries: sub-buffers carved from the context pool, recycled when released.
+		// Like NewBuffer the contents of buf are on the device on return (a blocking write on Device()).
+		template <typename T>
+		typename BufferCL<T>::Ptr NewPooledBuffer(typename Storage<T>::Ptr buf) {
+			auto b = _pool->Acquire<T>(buf);
+			Device().Queue().WriteBuffer(*b, QueueCL::Blocking);
+			return b;
+		}
+
+		template <typename T>
+		typename BufferCL<T>::Ptr NewPooledBuffer(size_t count) {
+			return _pool->Acquire<T>(count);
+		}
+
+		// Float storage transferred as half, bfloat16 or scaled int8, see PackedBufferCL.
+		PackedBufferCL::Ptr NewPackedBuffer(Storage<float>::Ptr buf, PackedBufferCL::Format fmt, float scale = 1.0f) const {
+			return PackedBufferCL::New(*_context, buf, fmt, CL_MEM_READ_WRITE, scale);
+		}
+
+		PackedBufferCL::Ptr NewPackedBuffer(size_t count, PackedBufferCL::Format fmt, float scale = 1.0f) const {
+			return NewPackedBuffer(NewStorage<float>(count), fmt, scale);
+		}
+
+		BufferPoolCL& Pool() { return *_pool; }
+		const BufferPoolCL& Pool() const { return *_pool; }
+
+		// hostPixel is the size of a host pixel when it differs from fmt, see ImageCL.
+		ImageCL::Ptr NewImage(const ImageCL::HostPtr& img, const cl_mem_flags& f = U_COPY_READ_WRITE, const cl::ImageFormat& fmt = U_ARGB_8888, size_t hostPixel = 0) const {
+			return ImageCL::New(*_context, img, f, fmt, hostPixel);
+		}
+
+		ImageCL::Ptr NewZeroCopyImage(const ImageCL::HostPtr& img, const cl_mem_flags& f = U_ZERO_COPY_READ_WRITE, const cl::ImageFormat& fmt = U_ARGB_8888) const {
+			return ImageCL::New(*_context, img, f, fmt);
+		}
+
+		SamplerCL::Ptr NewSampler(bool normalized = false, cl_addressing_mode a = CL_ADDRESS_CLAMP_TO_EDGE, cl_filter_mode f = CL_FILTER_NEAREST) const {
+			return SamplerCL::New(*_context, normalized, a, f);
+		}
+
+		// Driver allocated, host visible memory. Data() is null: access it through QueueCL::Map.
+		template <typename T>
+		typename BufferCL<T>::Ptr NewHostBuffer(size_t count, const cl_mem_flags& f = U_HOST_ALLOC_READ_WRITE) const {
+			return _Live<T>(std::make_shared<BufferCL<T>>(*_context, RawPointer<T>::New(nullptr, count), f));
 		}
 
 
@@ -71,27 +166,49 @@ namespace CL {
 		ProgramCL::Ptr NewProgramFromFile(const std::string& kernel);
 		ProgramCL::Ptr NewProgramFromSource(const std::string& kernel);
 
+		void SetProgramCache(const ProgramCacheCL::Ptr& c) { _cache = c; }
+		const ProgramCacheCL::Ptr& ProgramCache() const { return _cache; }
+
+		// Builds and launches of this context's programs, traffic of every device queue, live buffers.
+		MetricsCL::Snapshot Metrics() const;
+
 	private:
 		std::vector<DeviceCL::Ptr> _device;
 
 		std::unique_ptr<cl::Context> _context;
+		ProgramCacheCL::Ptr _cache;
+		BufferPoolCL::Ptr _pool;
+		MetricsCL::Ptr _metrics;
+
+		// Counts b as live on Device() until its last view goes.
+		template <typename T>
+		typename BufferCL<T>::Ptr _Live(const typename BufferCL<T>::Ptr& b) const {
+			b->_live = _device.at(0)->Live(b->Size());
+			return b;
+		}
 
 		U_DISABLE_COPY_AND_ASSIGNMENT(ContextCL);
 	};
 
 	ProgramCL::Ptr ContextCL::NewProgramFromFiles(const std::vector<std::string>& kernels) {
-		cl::Program::Sources source;
+		std::vector<std::string> programStrings;
 		for (const auto& str : kernels) {
 			std::ifstream programFile(str);
-			std::string programString(
+			programStrings.emplace_back(
 				std::istreambuf_iterator<char>(programFile),
 				(std::istreambuf_iterator<char>())
 				);
-			source.push_back(std::make_pair(programString.c_str(), programString.length()));
+		}
+
+		cl::Program::Sources source;
+		std::string all;
+		for (const auto& str : programStrings) {
+			source.push_back(std::make_pair(str.c_str(), str.length()));
+			all += str;
 		}
 
 		const cl::Context& c_ = Get();
-		return std::make_shared<ProgramCL>(cl::Program(c_, source));
+		return std::make_shared<ProgramCL>(cl::Program(c_, source), all, _cache, _metrics);
 	}
 
 	ProgramCL::Ptr ContextCL::NewProgramFromFile(const std::string& kernel) {
@@ -102,15 +219,31 @@ namespace CL {
 			);
 
 		const cl::Context& c_ = Get();
-		return std::make_shared<ProgramCL>(cl::Program(c_, source));
+		return std::make_shared<ProgramCL>(cl::Program(c_, source), source, _cache, _metrics);
 	}
 
 	ProgramCL::Ptr ContextCL::NewProgramFromSource(const std::string& kernel) {
 		const cl::Context& c_ = Get();
-		return std::make_shared<ProgramCL>(cl::Program(c_, kernel, false));
+		return std::make_shared<ProgramCL>(cl::Program(c_, kernel, false), kernel, _cache, _metrics);
+	}
+
+	inline MetricsCL::Snapshot ContextCL::Metrics() const {
+		MetricsCL::Snapshot s;
+		s.ProgramBuilds = _metrics->Builds();
+		s.Launches = _metrics->Launches();
+		for (const auto& d : _device) {
+			MetricsCL::Snapshot::Device dev;
+			dev.Name = d->GetInfo().Name;
+			dev.LiveBuffers = d->LiveBuffers();
+			dev.LiveBytes = d->LiveBytes();
+			dev.Queues = d->QueueStats();
+			dev.Budget = d->Budget()->GetStats();
+			s.Devices.push_back(dev);
+		}
+		return s;
 	}
 
-	std::vector<DeviceCL::Ptr> ContextCL::GPUs() {
+	std::vector<DeviceCL::Ptr> ContextCL::GPUs() const {
 		std::vector<DeviceCL::Ptr> t_;
 		for (const auto& d : Devices()) {
 			if (d->GetInfo().Type == CL_DEVICE_TYPE_GPU) {
@@ -120,7 +253,7 @@ namespace CL {
 		return std::move(t_);
 	}
 
-	const DeviceCL& ContextCL::GPU() {
+	const DeviceCL& ContextCL::GPU() const {
 		for (const auto& d : Devices()) {
 			if (d->GetInfo().Type == CL_DEVICE_TYPE_GPU) {
 				return *d;
@@ -129,7 +262,7 @@ namespace CL {
 		throw std::runtime_error("No gpu found");
 	}
 
-	std::vector<DeviceCL::Ptr> ContextCL::CPUs() {
+	std::vector<DeviceCL::Ptr> ContextCL::CPUs() const {
 		std::vector<DeviceCL::Ptr> t_;
 		for (const auto& d : Devices()) {
 			if (d->GetInfo().Type == CL_DEVICE_TYPE_CPU) {
@@ -139,7 +272,7 @@ namespace CL {
 		return std::move(t_);
 	}
 
-	const DeviceCL& ContextCL::CPU() {
+	const DeviceCL& ContextCL::CPU() const {
 		for (const auto& d : Devices()) {
 			if (d->GetInfo().Type == CL_DEVICE_TYPE_CPU) {
 				return *d;
@@ -3,6 +3,12 @@
 
 #include "CommonCL.h"
 #include "QueueCL.h"
+#include "MemoryBudgetCL.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace GPU {
 namespace CL {
@@ -18,14 +24,17 @@ namespace CL {
 			cl_uint DeviceVendorId;
 			cl_uint BaseAddressAlign;
 			size_t MaxBufferSize;
+			cl_ulong GlobalMemSize;
+			cl_command_queue_properties QueueProperties;
 
 			std::string Vendor;
+			std::string Name;
+			std::string DriverVersion;
 		};
 
-		DeviceCL(const cl::Context& c, const cl::Device& d) {
+		DeviceCL(const cl::Context& c, const cl::Device& d, cl_command_queue_properties p = 0) : _context(c), _transfer(0), _live(std::make_shared<_Live>()) {
 			_device = d;
 
-			_queue.reset(new QueueCL(c, d));
 			_info.reset(new Info);
 
 			_info->Type = d.getInfo<CL_DEVICE_TYPE>();
@@ -33,8 +42,15 @@ namespace CL {
 			_info->DeviceVendorId = d.getInfo<CL_DEVICE_VENDOR_ID>();
 			_info->MaxComputeUnit = d.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
 			_info->MaxBufferSize = d.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			_info->GlobalMemSize = d.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+			_info->QueueProperties = d.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
 
 			_info->Vendor = std::string(d.getInfo<CL_DEVICE_VENDOR>());
+			_info->Name = std::string(d.getInfo<CL_DEVICE_NAME>());
+			_info->DriverVersion = std::string(d.getInfo<CL_DRIVER_VERSION>());
+
+			AddQueue(p);
+			_budget = MemoryBudgetCL::New(_queue.at(0)->Get(), static_cast<size_t>(_info->GlobalMemSize));
 		}
 
 		const cl::Device& Get() const { return _device; }
@@ -42,7 +58,41 @@ namespace CL {
 
 		const Info& GetInfo() const { return *_info; }
 
-		QueueCL& Queue() { return *_queue; }
+		// CL_DEVICE_MEM_BASE_ADDR_ALIGN is in bits; never go below a page so zero-copy stays possible.
+		size_t Alignment() const { return std::max<size_t>(_info->BaseAddressAlign / 8, U_PAGE_SIZE); }
+
+		QueueCL& Queue() { return *_queue.at(0); }
+		QueueCL& Queue(size_t i) { return *_queue.at(i); }
+		size_t QueueCount() const { return _queue.size(); }
+
+		QueueCL& ComputeQueue() { return Queue(); }
+		QueueCL& TransferQueue();
+
+		// One queue per calling thread, created on first use with the default queue properties.
+		QueueCL& ThreadQueue();
+
+		// Properties the device does not support (e.g. out-of-order execution) are dropped.
+		QueueCL& AddQueue(cl_command_queue_properties p = 0);
+
+		// Budgeted buffers created by ContextCL, evicted to host storage when over budget.
+		const MemoryBudgetCL::Ptr& Budget() const { return _budget; }
+
+		// Buffers created by ContextCL and still referenced (by the buffer or any of its views), and their bytes.
+		size_t LiveBuffers() const { return _live->Buffers; }
+		size_t LiveBytes() const { return _live->Bytes; }
+
+		// Counts bytes as one live buffer until the token is released. Safe to outlive the device.
+		std::shared_ptr<void> Live(size_t bytes) {
+			const std::shared_ptr<_Live> live = _live;
+			live->Buffers++;
+			live->Bytes += bytes;
+			return std::shared_ptr<void>(live.get(), [live, bytes](void*) { live->Buffers--; live->Bytes -= bytes; });
+		}
+
+		// Queue(0) to Queue(QueueCount() - 1), then the thread queues.
+		std::vector<QueueCL::Stats> QueueStats() const;
+
+		bool SupportsOutOfOrder() const { return (_info->QueueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0; }
 
 		bool IsDefault() const {
 			cl::Device dev = cl::Device::getDefault();
@@ -50,12 +100,62 @@ namespace CL {
 		}
 
 	private:
+		struct _Live {
+			_Live() : Buffers(0), Bytes(0) {}
+			std::atomic<size_t> Buffers, Bytes;
+		};
+
 		cl::Device _device;
+		cl::Context _context;
 
 		std::shared_ptr<Info> _info;
-		QueueCL::Ptr _queue;
+		std::vector<QueueCL::Ptr> _queue;
+		size_t _transfer;
+		MemoryBudgetCL::Ptr _budget;
+		std::shared_ptr<_Live> _live;
+
+		mutable std::mutex _threadMutex;
+		std::map<std::thread::id, QueueCL::Ptr> _threadQueue;
 	};
 
+	inline QueueCL& DeviceCL::AddQueue(cl_command_queue_properties p) {
+		_queue.emplace_back(new QueueCL(_context, _device, p & _info->QueueProperties));
+		return *_queue.back();
+	}
+
+	inline std::vector<QueueCL::Stats> DeviceCL::QueueStats() const {
+		std::vector<QueueCL::Stats> list;
+		for (const auto& q : _queue) {
+			list.push_back(q->GetStats());
+		}
+		std::lock_guard<std::mutex> lock(_threadMutex);
+		for (const auto& q : _threadQueue) {
+			list.push_back(q.second->GetStats());
+		}
+		return list;
+	}
+
+	inline QueueCL& DeviceCL::ThreadQueue() {
+		const std::thread::id id = std::this_thread::get_id();
+
+		std::lock_guard<std::mutex> lock(_threadMutex);
+		auto q = _threadQueue.find(id);
+		if (q == _threadQueue.end()) {
+			QueueCL::Ptr queue(new QueueCL(_context, _device, _queue.at(0)->Properties()));
+			q = _threadQueue.insert(std::make_pair(id, queue)).first;
+		}
+		return *q->second;
+	}
+
+	// Separate in-order queue, so uploads and downloads can overlap kernels running on Queue().
+	inline QueueCL& DeviceCL::TransferQueue() {
+		if (!_transfer) {
+			AddQueue(_queue.at(0)->Properties() & ~static_cast<cl_command_queue_properties>(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+			_transfer = _queue.size() - 1;
+		}
+		return Queue(_transfer);
+	}
+
 }}
 
 #endif
\ No newline at end of file
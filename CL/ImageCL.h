@@ -0,0 +1,177 @@
+#ifndef IMAGE_CL_H
+#define IMAGE_CL_H
+
+#include "CommonCL.h"
+#include "Image.h"
+
+namespace GPU {
+namespace CL {
+
+	/*
+		2D image object over a GPU::Image. Host transfers use the image's row pitch (BytesPerLine),
+		falling back to tightly packed rows of host pixels when it reports 0.
+		The host image holds the device format unless hostPixel says otherwise (say an RGBA8 host behind
+		a CL_FLOAT image). Such converted images need a host pointer free image and move only through
+		PixelConvert transfers, plain transfers throw.
+	*/
+	class ImageCL {
+	public:
+		typedef std::shared_ptr<ImageCL> Ptr;
+		typedef std::shared_ptr<Image> HostPtr;
+
+		ImageCL(const cl::Context& c, const HostPtr& img, cl_mem_flags f = U_COPY_READ_WRITE, const cl::ImageFormat& fmt = U_ARGB_8888, size_t hostPixel = 0);
+
+		const cl::Image2D& Get() const { return _image; }
+		const cl::ImageFormat& Format() const { return _format; }
+
+		Image& Host() const { return *_host; }
+		const HostPtr& HostPointer() const { return _host; }
+		unsigned char* Bits() const { return _host->Bits(); }
+
+		size_t Width() const { return _host->Width(); }
+		size_t Height() const { return _host->Height(); }
+		size_t PixelSize() const { return _pixel; }
+		size_t HostPixelSize() const { return _hostPixel; }
+		size_t Pitch() const { return _pitch; }
+
+		bool IsConverted() const { return _hostPixel != _pixel; }
+
+		// Tightly packed size, as used by image <-> buffer copies.
+		size_t Bytes() const { return Width() * Height() * _pixel; }
+
+		cl::size_t<3> Origin() const { return Origin(0, 0); }
+		cl::size_t<3> Region() const { return Region(Width(), Height()); }
+
+		static cl::size_t<3> Origin(size_t x, size_t y) {
+			cl::size_t<3> o;
+			o[0] = x; o[1] = y; o[2] = 0;
+			return o;
+		}
+
+		static cl::size_t<3> Region(size_t w, size_t h) {
+			cl::size_t<3> r;
+			r[0] = w; r[1] = h; r[2] = 1;
+			return r;
+		}
+
+		cl_mem_flags Flags() const { return _flags; }
+		bool IsZeroCopy() const { return (_flags & CL_MEM_USE_HOST_PTR) != 0; }
+
+		static size_t PixelSize(const cl::ImageFormat& fmt);
+
+		static Ptr New(const cl::Context& c, const HostPtr& img, cl_mem_flags f = U_COPY_READ_WRITE, const cl::ImageFormat& fmt = U_ARGB_8888, size_t hostPixel = 0) {
+			return std::make_shared<ImageCL>(c, img, f, fmt, hostPixel);
+		}
+
+	private:
+		cl::Image2D _image;
+		cl::ImageFormat _format;
+		HostPtr _host;
+		cl_mem_flags _flags;
+		size_t _pixel, _hostPixel;
+		size_t _pitch;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(ImageCL);
+	};
+
+	inline ImageCL::ImageCL(const cl::Context& c, const HostPtr& img, cl_mem_flags f, const cl::ImageFormat& fmt, size_t hostPixel)
+		: _format(fmt), _host(img), _flags(f) {
+		if (!img || !img->Width() || !img->Height()) {
+			throw std::runtime_error("ImageCL, empty image.");
+		}
+
+		_pixel = PixelSize(fmt);
+		_hostPixel = hostPixel ? hostPixel : _pixel;
+		_pitch = img->BytesPerLine() ? img->BytesPerLine() : img->Width() * _hostPixel;
+		if (_pitch < img->Width() * _hostPixel) {
+			throw std::runtime_error("ImageCL, row pitch smaller than a row of pixels.");
+		}
+
+		// The row pitch may only be given together with a host pointer, which must hold the device format.
+		const bool host = (f & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) != 0;
+		if (host && IsConverted()) {
+			throw std::runtime_error("ImageCL, a host pointer must hold the device format.");
+		}
+		_image = cl::Image2D(c, f, fmt, img->Width(), img->Height(), host ? _pitch : 0, host ? img->Bits() : nullptr);
+	}
+
+	inline size_t ImageCL::PixelSize(const cl::ImageFormat& fmt) {
+		switch (fmt.image_channel_data_type) {
+		case CL_UNORM_SHORT_565:
+		case CL_UNORM_SHORT_555:
+			return 2;
+		case CL_UNORM_INT_101010:
+			return 4;
+		}
+
+		size_t channel = 0;
+		switch (fmt.image_channel_data_type) {
+		case CL_SNORM_INT8:
+		case CL_UNORM_INT8:
+		case CL_SIGNED_INT8:
+		case CL_UNSIGNED_INT8:
+			channel = 1; break;
+		case CL_SNORM_INT16:
+		case CL_UNORM_INT16:
+		case CL_SIGNED_INT16:
+		case CL_UNSIGNED_INT16:
+		case CL_HALF_FLOAT:
+			channel = 2; break;
+		case CL_SIGNED_INT32:
+		case CL_UNSIGNED_INT32:
+		case CL_FLOAT:
+			channel = 4; break;
+		default:
+			throw std::runtime_error("ImageCL, unsupported channel data type.");
+		}
+
+		switch (fmt.image_channel_order) {
+		case CL_R:
+		case CL_A:
+		case CL_INTENSITY:
+		case CL_LUMINANCE:
+			return channel;
+		case CL_RG:
+		case CL_RA:
+			return 2 * channel;
+		case CL_RGB:
+			return 3 * channel;
+		case CL_RGBA:
+		case CL_BGRA:
+		case CL_ARGB:
+			return 4 * channel;
+		}
+		throw std::runtime_error("ImageCL, unsupported channel order.");
+	}
+
+	class SamplerCL {
+	public:
+		typedef std::shared_ptr<SamplerCL> Ptr;
+
+		SamplerCL(const cl::Context& c, bool normalized = false, cl_addressing_mode a = CL_ADDRESS_CLAMP_TO_EDGE, cl_filter_mode f = CL_FILTER_NEAREST)
+			: _normalized(normalized), _addressing(a), _filter(f) {
+			_sampler = cl::Sampler(c, normalized ? CL_TRUE : CL_FALSE, a, f);
+		}
+
+		const cl::Sampler& Get() const { return _sampler; }
+
+		bool Normalized() const { return _normalized; }
+		cl_addressing_mode Addressing() const { return _addressing; }
+		cl_filter_mode Filter() const { return _filter; }
+
+		static Ptr New(const cl::Context& c, bool normalized = false, cl_addressing_mode a = CL_ADDRESS_CLAMP_TO_EDGE, cl_filter_mode f = CL_FILTER_NEAREST) {
+			return std::make_shared<SamplerCL>(c, normalized, a, f);
+		}
+
+	private:
+		cl::Sampler _sampler;
+		bool _normalized;
+		cl_addressing_mode _addressing;
+		cl_filter_mode _filter;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(SamplerCL);
+	};
+
+}}
+
+#endif
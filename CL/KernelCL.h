@@ -2,8 +2,13 @@
 #define KERNEL_CL_H
 
 #include "BufferCL.h"
+#include "ImageCL.h"
+#include "PackedBufferCL.h"
 
+#include <atomic>
 #include <fstream>
+#include <map>
+#include <sstream>
 
 namespace GPU {
 namespace CL {
@@ -20,15 +25,28 @@ namespace CL {
 		};
 
 		struct Range {
-			Range() : Offset(cl::NullRange), GlobalSize(cl::NullRange), LocalSize(cl::NullRange) { }
+			Range() : Offset(cl::NullRange), GlobalSize(cl::NullRange), LocalSize(cl::NullRange), AutoLocal(false) { }
+
+			// LocalSize is taken from the kernel's tuned value for GlobalSize (see TunerCL).
+			static Range Auto(const cl::NDRange& global) {
+				Range r;
+				r.GlobalSize = global;
+				r.AutoLocal = true;
+				return r;
+			}
 
 			cl::NDRange Offset;
 			cl::NDRange GlobalSize;
 			cl::NDRange LocalSize;
+			bool AutoLocal;
 		};
 
-		KernelCL(const cl::Program& p, const std::string& n) : _name(n) {
+		typedef std::shared_ptr<std::atomic<size_t>> Counter;
+
+		KernelCL(const cl::Program& p, const std::string& n) : _name(n), _launches(std::make_shared<std::atomic<size_t>>(0)) {
 			_kernel = cl::Kernel(p, _name.c_str());
+			_info.maxWorkGroupSize = _info.preferredWorkGroupSizeMultiple = 0;
+			_info.localMemSize = _info.privateMemSize = 0;
 		}
 
 		KernelCL(const cl::Device& dev, const cl::Program& p, const std::string& n) : KernelCL(p, n) {
@@ -39,6 +57,35 @@ namespace CL {
 		}
 
 		const cl::Kernel& Get() const { return _kernel; }
+		const std::string& Name() const { return _name; }
+		const Info& GetInfo() const { return _info; }
+
+		// Launches through any QueueCL. Kernels of a ContextCL share one counter per kernel name (see MetricsCL).
+		size_t Launches() const { return *_launches; }
+		void SetLaunchCounter(const Counter& c) { _launches = c; }
+
+		void TunedLocalSize(const cl::NDRange& global, const cl::NDRange& local) { _tuned[RangeKey(global)] = local; }
+
+		cl::NDRange TunedLocalSize(const cl::NDRange& global) const {
+			auto t = _tuned.find(RangeKey(global));
+			return t == _tuned.end() ? cl::NullRange : t->second;
+		}
+
+		const cl::NDRange& LocalSizeFor(const Range& r) const {
+			if (!r.AutoLocal) {
+				return r.LocalSize;
+			}
+			auto t = _tuned.find(RangeKey(r.GlobalSize));
+			return t == _tuned.end() ? cl::NullRange : t->second;
+		}
+
+		static std::string RangeKey(const cl::NDRange& r) {
+			std::ostringstream key;
+			for (size_t i = 0; i < r.dimensions(); i++) {
+				key << (i ? "x" : "") << r[i];
+			}
+			return key.str();
+		}
 
 		template <typename T, typename... P>
 		void Args(const T& t, const P& ... args) { _Args(0, t, args...); }
@@ -46,11 +93,65 @@ namespace CL {
 		template <typename T>
 		void Arg(cl_uint i, const T& t) {
 			_kernel.setArg(i, t);
+			_bindings.erase(i);
 		}
 
+		// Tracked buffers are remembered so QueueCL can sync them around the launch. Buffers created
+		// CL_MEM_READ_ONLY are never marked dirty on the device, see also ReadsOnly().
 		template <typename T>
 		void Arg(cl_uint i, const BufferCL<T>& b) {
+			if (!b.IsKernelArgument()) {
+				throw std::runtime_error("KernelCL, unaligned buffer views cannot be kernel arguments, use Slice at an aligned offset.");
+			}
 			_kernel.setArg(i, b.Get());
+			if (b.IsTracked() || b.IsBudgeted()) {
+				const AllocationCL::Ptr& alloc = b.Allocation();
+				_bindings[i] = Binding{ b.Residency(), (b.Flags() & CL_MEM_READ_ONLY) == 0, b.HostBytesOffset(), b.Size(),
+					alloc, b.IsEvictable(), alloc ? alloc->Generation() : 0 };
+			} else {
+				_bindings.erase(i);
+			}
+		}
+
+		void Arg(cl_uint i, const ImageCL& img) { _kernel.setArg(i, img.Get()); _bindings.erase(i); }
+		void Arg(cl_uint i, const SamplerCL& s) { _kernel.setArg(i, s.Get()); _bindings.erase(i); }
+		void Arg(cl_uint i, const PackedBufferCL& b) { _kernel.setArg(i, b.Get()); _bindings.erase(i); }
+
+		// Offset and Bytes locate the argument (possibly a slice) in the tracked storage. Allocation is set
+		// for budgeted buffers, Evictable unless the argument is a sub-buffer (which pins its parent), and
+		// Generation is that of the buffer last set.
+		struct Binding {
+			ResidencyCL::Ptr Residency;
+			bool Writes;
+			size_t Offset, Bytes;
+			AllocationCL::Ptr Allocation;
+			bool Evictable;
+			size_t Generation;
+		};
+
+		const std::map<cl_uint, Binding>& Bindings() const { return _bindings; }
+
+		// Restores evicted arguments and sets again those re-created since Arg(). The caller pins every
+		// Allocation first, so restoring one cannot evict another (QueueCL does).
+		void Restore() const {
+			for (auto& b : _bindings) {
+				if (b.second.Allocation && b.second.Evictable) {
+					const cl::Buffer buffer = b.second.Allocation->Get();
+					if (b.second.Allocation->Generation() != b.second.Generation) {
+						cl::Kernel k = _kernel;
+						k.setArg(b.first, buffer);
+						b.second.Generation = b.second.Allocation->Generation();
+					}
+				}
+			}
+		}
+
+		// For read-write buffers the kernel only reads through argument i, so launches leave it clean.
+		void ReadsOnly(cl_uint i) {
+			auto b = _bindings.find(i);
+			if (b != _bindings.end()) {
+				b->second.Writes = false;
+			}
 		}
 
 	private:
@@ -67,10 +168,17 @@ namespace CL {
 			Arg(i, t);
 		}
 
+		void _Launched() const { _launches->fetch_add(1, std::memory_order_relaxed); }
+
 		cl::Kernel _kernel;
 		const std::string _name;
 		Info _info;
+		Counter _launches;
+
+		std::map<std::string, cl::NDRange> _tuned;
+		mutable std::map<cl_uint, Binding> _bindings;
 
+		friend class QueueCL;
 		U_DISABLE_COPY_AND_ASSIGNMENT(KernelCL);
 	};
 
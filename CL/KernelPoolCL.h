@@ -0,0 +1,63 @@
+#ifndef KERNEL_POOL_CL_H
+#define KERNEL_POOL_CL_H
+
+#include "KernelCL.h"
+
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		A cl_kernel must not have its arguments set from several threads at once. The pool hands every 
+		calling thread its own KernelCL, re-created from the program (clCloneKernel needs OpenCL 2.1), 
+		so threads only share the lookup, not the Args + Enqueue sequence.
+	*/
+	class KernelPoolCL {
+	public:
+		typedef std::shared_ptr<KernelPoolCL> Ptr;
+
+		// Every thread's kernel adds to launches when given, see KernelCL::SetLaunchCounter.
+		KernelPoolCL(const cl::Program& p, const cl::Device& d, const std::string& name, const KernelCL::Counter& launches = nullptr)
+			: _program(p), _device(d), _name(name), _launches(launches) {}
+
+		KernelCL& Local();
+
+		const std::string& Name() const { return _name; }
+
+		size_t Size() const {
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _kernels.size();
+		}
+
+	private:
+		cl::Program _program;
+		cl::Device _device;
+		const std::string _name;
+		KernelCL::Counter _launches;
+
+		mutable std::mutex _mutex;
+		std::unordered_map<std::thread::id, KernelCL::Ptr> _kernels;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(KernelPoolCL);
+	};
+
+	inline KernelCL& KernelPoolCL::Local() {
+		const std::thread::id id = std::this_thread::get_id();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto k = _kernels.find(id);
+		if (k == _kernels.end()) {
+			k = _kernels.insert(std::make_pair(id, std::make_shared<KernelCL>(_device, _program, _name))).first;
+			if (_launches) {
+				k->second->SetLaunchCounter(_launches);
+			}
+		}
+		return *k->second;
+	}
+
+}}
+
+#endif
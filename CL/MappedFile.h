@@ -0,0 +1,157 @@
+#ifndef MAPPED_FILE_GPU_H
+#define MAPPED_FILE_GPU_H
+
+#include "Storage.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace GPU {
+	namespace CL {
+
+	/*
+		Storage backed by mmap, so buffers are created and transferred straight from the page cache. 
+		Mappings are page aligned and can be used with NewZeroCopyBuffer. ReadOnly maps are PROT_READ, 
+		reading device results back into one faults; ReadWrite maps are shared and written back by Sync().
+	*/
+	template <typename T>
+	class MappedFile : public Storage<T> {
+	public:
+		enum Mode { ReadOnly, ReadWrite };
+
+		enum Hint {
+			None = 0,
+			Sequential = 1 << 0,
+			WillNeed = 1 << 1,
+			HugePages = 1 << 2 // Transparent huge pages, only honoured on Linux for anonymous/tmpfs/some fs mappings.
+		};
+
+		// A non-zero count resizes (and creates) a ReadWrite file, otherwise the whole file is mapped.
+		MappedFile(const std::string& path, Mode m = ReadOnly, size_t count = 0, int hints = Sequential);
+
+		virtual ~MappedFile() {
+			Release();
+		}
+
+		virtual T* Data() { return _pointer; }
+		virtual const T* Data() const { return _pointer; }
+
+		virtual void Release();
+
+		virtual T& At(size_t i) { return _pointer[i]; }
+		virtual const T& At(size_t i) const { return _pointer[i]; }
+
+		void Sync(bool wait = true);
+		void Advise(int hints);
+
+		Mode GetMode() const { return _mode; }
+		bool IsReadOnly() const { return _mode == ReadOnly; }
+		size_t MappedSize() const { return _mapped; }
+		const std::string& Path() const { return _path; }
+
+		static typename Storage<T>::Ptr New(const std::string& path, Mode m = ReadOnly, size_t count = 0, int hints = Sequential) {
+			return std::make_shared<MappedFile>(path, m, count, hints);
+		}
+
+	private:
+		static void _Throw(const std::string& what, const std::string& path) {
+			throw std::runtime_error("MappedFile, " + what + " '" + path + "': " + std::strerror(errno));
+		}
+
+		const std::string _path;
+		const Mode _mode;
+		int _fd;
+		size_t _mapped;
+		T* _pointer;
+	};
+
+	template <typename T>
+	MappedFile<T>::MappedFile(const std::string& path, Mode m, size_t count, int hints) 
+		: _path(path), _mode(m), _fd(-1), _mapped(0), _pointer(nullptr) {
+		_fd = m == ReadOnly ? ::open(path.c_str(), O_RDONLY) : ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (_fd < 0) {
+			_Throw("open", path);
+		}
+
+		size_t bytes = count * sizeof(T);
+		if (m == ReadWrite && count) {
+			if (::ftruncate(_fd, static_cast<off_t>(bytes)) != 0) {
+				::close(_fd);
+				_Throw("resize", path);
+			}
+		} else {
+			struct stat st;
+			if (::fstat(_fd, &st) != 0) {
+				::close(_fd);
+				_Throw("stat", path);
+			}
+			bytes = static_cast<size_t>(st.st_size) / sizeof(T) * sizeof(T);
+		}
+
+		if (!bytes) {
+			::close(_fd);
+			throw std::runtime_error("MappedFile, empty file '" + path + "'.");
+		}
+
+		const int prot = m == ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+		void* p = ::mmap(nullptr, bytes, prot, MAP_SHARED, _fd, 0);
+		if (p == MAP_FAILED) {
+			::close(_fd);
+			_Throw("mmap", path);
+		}
+
+		_pointer = static_cast<T*>(p);
+		_mapped = bytes;
+		this->size(bytes / sizeof(T));
+
+		Advise(hints);
+	}
+
+	template <typename T>
+	void MappedFile<T>::Release() {
+		if (_pointer) {
+			::munmap(_pointer, _mapped);
+			_pointer = nullptr;
+			_mapped = 0;
+		}
+		if (_fd >= 0) {
+			::close(_fd);
+			_fd = -1;
+		}
+		this->size(0);
+	}
+
+	template <typename T>
+	void MappedFile<T>::Sync(bool wait) {
+		if (_pointer && _mode == ReadWrite && ::msync(_pointer, _mapped, wait ? MS_SYNC : MS_ASYNC) != 0) {
+			_Throw("msync", _path);
+		}
+	}
+
+	// Hints are advisory, failures are ignored.
+	template <typename T>
+	void MappedFile<T>::Advise(int hints) {
+		if (!_pointer) {
+			return;
+		}
+		if (hints & Sequential) {
+			::madvise(_pointer, _mapped, MADV_SEQUENTIAL);
+		}
+		if (hints & WillNeed) {
+			::madvise(_pointer, _mapped, MADV_WILLNEED);
+		}
+#ifdef MADV_HUGEPAGE
+		if (hints & HugePages) {
+			::madvise(_pointer, _mapped, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+}}
+#endif
@@ -0,0 +1,317 @@
+#ifndef MEMORY_BUDGET_CL_H
+#define MEMORY_BUDGET_CL_H
+
+#include "ResidencyCL.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+namespace GPU {
+	namespace CL {
+
+	class MemoryBudgetCL;
+
+	/*
+		Device memory of one budgeted buffer. When the device runs out of budget the least recently
+		used allocations are evicted: the device buffer is released and Get() re-creates it from the
+		host storage (CL_MEM_COPY_HOST_PTR) on next use. Get() waits while the allocation is being
+		evicted or restored by another thread.
+		Tracked buffers (see ResidencyCL) read their device dirty ranges back first, host dirty ranges are
+		never overwritten. Untracked buffers cannot tell host edits from stale host bytes, so they are
+		only evicted while the device holds nothing newer than the host: kernels, fills, copies and
+		range writes mark them (MarkDeviceNewer), a whole buffer read or write clears the mark.
+	*/
+	class AllocationCL : public std::enable_shared_from_this<AllocationCL> {
+	public:
+		typedef std::shared_ptr<AllocationCL> Ptr;
+
+		AllocationCL(const std::shared_ptr<MemoryBudgetCL>& b, const cl::Context& c, cl_mem_flags f, void* host, size_t bytes);
+		~AllocationCL();
+
+		// Device buffer, re-created if evicted. Counts as a use for the eviction order. Returned by value:
+		// pin the allocation first if the buffer must stay resident while it is used.
+		cl::Buffer Get();
+
+		bool IsResident() const { return _resident; }
+		size_t Bytes() const { return _bytes; }
+
+		// Changes every time the device buffer is re-created, kernels bound to an older one set it again.
+		size_t Generation() const { return _generation; }
+
+		// Not evicted while a returned token is alive.
+		std::shared_ptr<void> Pin();
+		bool IsPinned() const { return _pins > 0; }
+
+		void MarkDeviceNewer() { std::lock_guard<std::mutex> lock(_Mutex()); _deviceNewer = true; }
+		void MarkHostCurrent() { std::lock_guard<std::mutex> lock(_Mutex()); _deviceNewer = false; }
+
+		// Commands on q are ordered before evictions (see MemoryBudgetCL); commands on other queues
+		// have to keep their operands pinned until they complete.
+		bool IsOrderedOn(const cl::CommandQueue& q) const;
+
+		// Tracked buffers only read back the device dirty ranges when evicted.
+		void SetResidency(const ResidencyCL::Ptr& r) {
+			std::lock_guard<std::mutex> lock(_Mutex());
+			_residency = r;
+		}
+
+		// The budget only holds weak references, so allocations are registered once owned.
+		static Ptr New(const std::shared_ptr<MemoryBudgetCL>& b, const cl::Context& c, cl_mem_flags f, void* host, size_t bytes);
+
+	private:
+		std::mutex& _Mutex() const;
+
+		void _Create(std::unique_lock<std::mutex>& lock, cl_mem_flags f);
+
+		std::shared_ptr<MemoryBudgetCL> _budget;
+		cl::Context _context;
+		cl::Buffer _buffer;
+		ResidencyCL::Ptr _residency;
+
+		cl_mem_flags _flags;
+		void* _host;
+		size_t _bytes;
+
+		bool _resident, _deviceNewer, _busy;
+		size_t _generation;
+		size_t _lastUse;
+		std::atomic<size_t> _pins;
+
+		friend class MemoryBudgetCL;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(AllocationCL);
+	};
+
+	/*
+		Bytes of budgeted buffers resident on one device, checked against a budget that defaults to
+		CL_DEVICE_GLOBAL_MEM_SIZE. Only buffers created by ContextCL from host storage are budgeted, and
+		only against the context's default device (ContextCL::Device()); pools, images and scratch
+		buffers are not, so leave them some headroom with SetBudget().
+		Evictions read back on the given queue, blocking, after a barrier so that everything enqueued
+		on it before (even out of order) is done. QueueCL keeps the operands of commands on any other
+		queue pinned until they complete; code using Get() directly must pin (BufferCL::Pin).
+		The read back runs without the budget's lock held. Allocations can be released from completion
+		callbacks (the last pin going away), so they never take the lock when destroyed: the budget
+		drops expired allocations and their bytes on its next call.
+	*/
+	class MemoryBudgetCL {
+	public:
+		typedef std::shared_ptr<MemoryBudgetCL> Ptr;
+
+		// Read backs and restores move bytes outside any QueueCL, so QueueCL::Stats does not count them.
+		struct Stats {
+			size_t Used;
+			size_t Budget;
+			size_t Evictions;
+			size_t EvictedBytes;
+			size_t Restores;
+			size_t RestoredBytes;
+			size_t ReadBacks;
+			size_t ReadBackBytes;
+		};
+
+		MemoryBudgetCL(const cl::CommandQueue& q, size_t capacity)
+			: _queue(q), _capacity(capacity), _budget(capacity), _used(0), _clock(0), _evictions(0), _evictedBytes(0), _restores(0), _restoredBytes(0), _readBacks(0), _readBackBytes(0), _released(0) {}
+
+		size_t Capacity() const { return _capacity; }
+
+		size_t Budget() const { std::lock_guard<std::mutex> lock(_mutex); return _budget; }
+
+		// Lowering the budget evicts right away.
+		void SetBudget(size_t bytes) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_budget = bytes;
+			_Fit(lock, 0, nullptr);
+		}
+
+		size_t Used() const { std::lock_guard<std::mutex> lock(_mutex); return _Used(); }
+		size_t Available() const { std::lock_guard<std::mutex> lock(_mutex); return _Used() < _budget ? _budget - _Used() : 0; }
+
+		Stats GetStats() const {
+			std::lock_guard<std::mutex> lock(_mutex);
+			Stats s = { _Used(), _budget, _evictions, _evictedBytes, _restores, _restoredBytes, _readBacks, _readBackBytes };
+			return s;
+		}
+
+		// Evicts every unpinned allocation.
+		void EvictAll() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (_EvictOne(lock, nullptr)) {}
+		}
+
+		static Ptr New(const cl::CommandQueue& q, size_t capacity) { return std::make_shared<MemoryBudgetCL>(q, capacity); }
+
+	private:
+		// Called with _mutex held. Evictions release it while reading back.
+		void _Fit(std::unique_lock<std::mutex>& lock, size_t bytes, const AllocationCL* keep) {
+			while (_Used() + bytes > _budget && _EvictOne(lock, keep)) {}
+		}
+
+		bool _EvictOne(std::unique_lock<std::mutex>& lock, const AllocationCL* keep);
+
+		// Bytes of destroyed allocations are subtracted lazily, see ~AllocationCL.
+		size_t _Used() const { return _used - _released; }
+
+		void _Touch(AllocationCL& a) { a._lastUse = ++_clock; }
+
+		cl::CommandQueue _queue;
+		size_t _capacity, _budget, _used, _clock;
+		size_t _evictions, _evictedBytes, _restores, _restoredBytes, _readBacks, _readBackBytes;
+
+		std::vector<std::weak_ptr<AllocationCL>> _allocations;
+		std::atomic<size_t> _released;
+		mutable std::mutex _mutex;
+		std::condition_variable _idle;
+
+		friend class AllocationCL;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(MemoryBudgetCL);
+	};
+
+	// The victim is marked busy and its bytes leave the budget before the lock is released for the read
+	// back, so other threads neither pick it again nor restore it (Get() waits) until it is done.
+	inline bool MemoryBudgetCL::_EvictOne(std::unique_lock<std::mutex>& lock, const AllocationCL* keep) {
+		AllocationCL::Ptr victim;
+		for (size_t i = 0; i < _allocations.size();) {
+			AllocationCL::Ptr a = _allocations[i].lock();
+			if (!a) {
+				_allocations[i] = _allocations.back();
+				_allocations.pop_back();
+				continue;
+			}
+			const bool evictable = a->_resident && !a->_busy && !a->IsPinned() && (a->_residency || !a->_deviceNewer);
+			if (a.get() != keep && evictable && (!victim || a->_lastUse < victim->_lastUse)) {
+				victim = a;
+			}
+			i++;
+		}
+		if (!victim) {
+			return false;
+		}
+
+		// Only tracked buffers read back, and only their device dirty ranges; untracked victims hold nothing newer than the host.
+		const std::vector<ResidencyCL::Range> ranges = victim->_residency ? victim->_residency->TakeDeviceDirty() : std::vector<ResidencyCL::Range>();
+		const cl::Buffer buffer = victim->_buffer;
+		victim->_busy = true;
+		_used -= victim->_bytes;
+
+		size_t read = 0;
+		try {
+			lock.unlock();
+			if (!ranges.empty()) {
+				_queue.enqueueBarrierWithWaitList();
+			}
+			for (const auto& r : ranges) {
+				_queue.enqueueReadBuffer(buffer, CL_TRUE, r.first, r.second - r.first, static_cast<char*>(victim->_host) + r.first);
+				read++;
+			}
+			lock.lock();
+		} catch (...) {
+			lock.lock();
+			for (size_t r = read; r < ranges.size(); r++) {
+				victim->_residency->MarkDeviceDirty(ranges[r].first, ranges[r].second - ranges[r].first);
+			}
+			_used += victim->_bytes;
+			victim->_busy = false;
+			_idle.notify_all();
+			throw;
+		}
+
+		for (const auto& r : ranges) {
+			_readBacks++;
+			_readBackBytes += r.second - r.first;
+		}
+		victim->_buffer = cl::Buffer();
+		victim->_resident = false;
+		victim->_busy = false;
+		if (victim->_residency) {
+			victim->_residency->Rebind(victim->_buffer);
+		}
+		_evictions++;
+		_evictedBytes += victim->_bytes;
+		_idle.notify_all();
+		return true;
+	}
+
+	inline AllocationCL::AllocationCL(const std::shared_ptr<MemoryBudgetCL>& b, const cl::Context& c, cl_mem_flags f, void* host, size_t bytes)
+		: _budget(b), _context(c), _flags(f), _host(host), _bytes(bytes), _resident(false), _deviceNewer(false), _busy(false), _generation(0), _lastUse(0), _pins(0) {}
+
+	inline AllocationCL::Ptr AllocationCL::New(const std::shared_ptr<MemoryBudgetCL>& b, const cl::Context& c, cl_mem_flags f, void* host, size_t bytes) {
+		Ptr a = std::make_shared<AllocationCL>(b, c, f, host, bytes);
+		std::unique_lock<std::mutex> lock(b->_mutex);
+		a->_Create(lock, f);
+		b->_allocations.push_back(a);
+		return a;
+	}
+
+	// Runs with no lock, possibly in a completion callback. Nothing else can reach the allocation any more:
+	// the budget only uses it through a strong reference taken from its weak one.
+	inline AllocationCL::~AllocationCL() {
+		if (_resident) {
+			_budget->_released += _bytes;
+		}
+	}
+
+	inline cl::Buffer AllocationCL::Get() {
+		std::unique_lock<std::mutex> lock(_budget->_mutex);
+		while (_busy) {
+			_budget->_idle.wait(lock);
+		}
+		if (!_resident) {
+			// Host storage holds the latest contents, the new device buffer starts from it.
+			_busy = true;
+			try {
+				_Create(lock, _flags | CL_MEM_COPY_HOST_PTR);
+			} catch (...) {
+				_busy = false;
+				_budget->_idle.notify_all();
+				throw;
+			}
+			_busy = false;
+			_budget->_idle.notify_all();
+			if (_residency) {
+				_residency->TakeHostDirty();
+				_residency->Rebind(_buffer);
+			}
+			_deviceNewer = false;
+			_budget->_restores++;
+			_budget->_restoredBytes += _bytes;
+		}
+		_budget->_Touch(*this);
+		return _buffer;
+	}
+
+	inline std::shared_ptr<void> AllocationCL::Pin() {
+		_pins++;
+		Ptr self = shared_from_this();
+		return std::shared_ptr<void>(this, [self](void*) { self->_pins--; });
+	}
+
+	inline std::mutex& AllocationCL::_Mutex() const { return _budget->_mutex; }
+
+	inline bool AllocationCL::IsOrderedOn(const cl::CommandQueue& q) const { return _budget->_queue() == q(); }
+
+	// Called with the budget's mutex held, which evictions release while reading back. Makes room first, then
+	// retries allocation failures (reported by some drivers at creation) after evicting one more allocation each time.
+	inline void AllocationCL::_Create(std::unique_lock<std::mutex>& lock, cl_mem_flags f) {
+		_budget->_Fit(lock, _bytes, this);
+		for (;;) {
+			try {
+				_buffer = cl::Buffer(_context, f, _bytes, (f & CL_MEM_COPY_HOST_PTR) ? _host : nullptr);
+				break;
+			} catch (const cl::Error& err) {
+				if ((err.err() != CL_MEM_OBJECT_ALLOCATION_FAILURE && err.err() != CL_OUT_OF_RESOURCES) || !_budget->_EvictOne(lock, this)) {
+					throw;
+				}
+			}
+		}
+		_resident = true;
+		_generation++;
+		_budget->_used += _bytes;
+		_budget->_Touch(*this);
+	}
+
+}}
+
+#endif
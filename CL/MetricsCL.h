@@ -0,0 +1,150 @@
+#ifndef METRICS_CL_H
+#define METRICS_CL_H
+
+#include "QueueCL.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+namespace GPU {
+	namespace CL {
+
+	/*
+		Counters shared by a ContextCL and the programs it creates: program builds, and launches per
+		kernel name (every KernelCL of that name adds to the same counter, on any device or thread).
+		Queue traffic is counted by each QueueCL, live buffers by each DeviceCL and eviction traffic by
+		its MemoryBudgetCL; ContextCL::Metrics gathers all of them into a Snapshot.
+	*/
+	class MetricsCL {
+	public:
+		typedef std::shared_ptr<MetricsCL> Ptr;
+
+		struct Snapshot {
+			struct Device {
+				std::string Name;
+				size_t LiveBuffers;
+				size_t LiveBytes;
+				std::vector<QueueCL::Stats> Queues;
+				MemoryBudgetCL::Stats Budget;
+			};
+
+			size_t ProgramBuilds;
+			std::map<std::string, size_t> Launches;
+			std::vector<Device> Devices;
+
+			void ToText(std::ostream& out) const;
+			void ToJson(std::ostream& out) const;
+		};
+
+		MetricsCL() : _builds(0) {}
+
+		size_t Builds() const { return _builds; }
+
+		KernelCL::Counter LaunchCounter(const std::string& kernel) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			KernelCL::Counter& c = _launches[kernel];
+			if (!c) {
+				c = std::make_shared<std::atomic<size_t>>(0);
+			}
+			return c;
+		}
+
+		std::map<std::string, size_t> Launches() const {
+			std::lock_guard<std::mutex> lock(_mutex);
+			std::map<std::string, size_t> list;
+			for (const auto& l : _launches) {
+				list[l.first] = *l.second;
+			}
+			return list;
+		}
+
+		static Ptr New() { return std::make_shared<MetricsCL>(); }
+
+	private:
+		void _Built() { _builds++; }
+
+		static std::string _Escape(const std::string& s);
+
+		std::atomic<size_t> _builds;
+
+		mutable std::mutex _mutex;
+		std::map<std::string, KernelCL::Counter> _launches;
+
+		friend class ProgramCL;
+		U_DISABLE_COPY_AND_ASSIGNMENT(MetricsCL);
+	};
+
+	inline std::string MetricsCL::_Escape(const std::string& s) {
+		std::string e;
+		for (const char c : s) {
+			if (c == '"' || c == '\\') {
+				e += '\\';
+			}
+			e += c;
+		}
+		return e;
+	}
+
+	inline void MetricsCL::Snapshot::ToText(std::ostream& out) const {
+		out << "program_builds, " << ProgramBuilds << std::endl;
+		out << "kernel, launches" << std::endl;
+		for (const auto& l : Launches) {
+			out << l.first << ", " << l.second << std::endl;
+		}
+		out << "device, queue, live_buffers, live_bytes, bytes_uploaded, bytes_downloaded, bytes_copied, commands, launches, blocking_syncs, blocked_us" << std::endl;
+		for (size_t d = 0; d < Devices.size(); d++) {
+			const Device& dev = Devices[d];
+			for (size_t q = 0; q < dev.Queues.size(); q++) {
+				const QueueCL::Stats& s = dev.Queues[q];
+				out << d << ", " << q << ", " << dev.LiveBuffers << ", " << dev.LiveBytes << ", "
+					<< s.BytesUploaded << ", " << s.BytesDownloaded << ", " << s.BytesCopied << ", "
+					<< s.Commands << ", " << s.Launches << ", " << s.BlockingSyncs << ", " << s.BlockedNs / 1000.0 << std::endl;
+			}
+		}
+		out << "device, budget_used, budget, evictions, evicted_bytes, restores, restored_bytes, read_backs, read_back_bytes" << std::endl;
+		for (size_t d = 0; d < Devices.size(); d++) {
+			const MemoryBudgetCL::Stats& b = Devices[d].Budget;
+			out << d << ", " << b.Used << ", " << b.Budget << ", " << b.Evictions << ", " << b.EvictedBytes << ", "
+				<< b.Restores << ", " << b.RestoredBytes << ", " << b.ReadBacks << ", " << b.ReadBackBytes << std::endl;
+		}
+	}
+
+	inline void MetricsCL::Snapshot::ToJson(std::ostream& out) const {
+		out << "{\"program_builds\":" << ProgramBuilds << ",\"launches\":{";
+		size_t i = 0;
+		for (const auto& l : Launches) {
+			out << (i++ ? "," : "") << "\"" << _Escape(l.first) << "\":" << l.second;
+		}
+		out << "},\"devices\":[";
+		for (size_t d = 0; d < Devices.size(); d++) {
+			const Device& dev = Devices[d];
+			out << (d ? "," : "") << "\n{\"name\":\"" << _Escape(dev.Name) << "\""
+				<< ",\"live_buffers\":" << dev.LiveBuffers << ",\"live_bytes\":" << dev.LiveBytes << ",\"queues\":[";
+			for (size_t q = 0; q < dev.Queues.size(); q++) {
+				const QueueCL::Stats& s = dev.Queues[q];
+				out << (q ? "," : "") << "{\"bytes_uploaded\":" << s.BytesUploaded
+					<< ",\"bytes_downloaded\":" << s.BytesDownloaded
+					<< ",\"bytes_copied\":" << s.BytesCopied
+					<< ",\"commands\":" << s.Commands
+					<< ",\"launches\":" << s.Launches
+					<< ",\"blocking_syncs\":" << s.BlockingSyncs
+					<< ",\"blocked_ns\":" << s.BlockedNs << "}";
+			}
+			const MemoryBudgetCL::Stats& b = dev.Budget;
+			out << "],\"budget\":{\"used\":" << b.Used
+				<< ",\"budget\":" << b.Budget
+				<< ",\"evictions\":" << b.Evictions
+				<< ",\"evicted_bytes\":" << b.EvictedBytes
+				<< ",\"restores\":" << b.Restores
+				<< ",\"restored_bytes\":" << b.RestoredBytes
+				<< ",\"read_backs\":" << b.ReadBacks
+				<< ",\"read_back_bytes\":" << b.ReadBackBytes << "}}";
+		}
+		out << "\n]}" << std::endl;
+	}
+
+}}
+
+#endif
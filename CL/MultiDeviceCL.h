@@ -0,0 +1,167 @@
+#ifndef MULTI_DEVICE_CL_H
+#define MULTI_DEVICE_CL_H
+
+#include "ContextCL.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <exception>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Splits a 1D/2D NDRange into chunks along its last dimension and feeds them to every device of a context.
+		Each device first takes a batch proportional to its MaxComputeUnit, then keeps stealing single chunks
+		until none are left, so faster devices end up with more of the range. Every device writes into a
+		private scratch buffer, and only the rows of the chunks it ran are read back into the host storage.
+	*/
+	class MultiDeviceCL {
+	public:
+		typedef std::shared_ptr<MultiDeviceCL> Ptr;
+
+		struct Stats {
+			std::vector<size_t> Chunks;
+			std::vector<size_t> Items;
+			double Seconds;
+		};
+
+		// The program must already be built for every device of the context.
+		MultiDeviceCL(ContextCL& c, ProgramCL& p, const std::string& kernel);
+
+		template <typename T, typename... P>
+		void Args(const T& t, const P& ... args) {
+			for (auto& k : _kernel) {
+				k->Args(t, args...);
+			}
+		}
+
+		template <typename T>
+		void Arg(cl_uint i, const T& t) {
+			for (auto& k : _kernel) {
+				k->Arg(i, t);
+			}
+		}
+
+		KernelCL& Kernel(size_t device) { return *_kernel.at(device); }
+		size_t DeviceCount() const { return _kernel.size(); }
+
+		// Output buffer is bound at outArg; elements is how many T one work-item produces. Chunks are placed
+		// with global offsets, so r must not have one of its own.
+		template <typename T>
+		Stats Run(const KernelCL::Range& r, BufferCL<T>& out, cl_uint outArg = 0, size_t chunks = 0, size_t elements = 1);
+
+	private:
+		ContextCL& _context;
+		std::vector<KernelCL::Ptr> _kernel;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(MultiDeviceCL);
+	};
+
+	inline MultiDeviceCL::MultiDeviceCL(ContextCL& c, ProgramCL& p, const std::string& kernel) : _context(c) {
+		for (const auto& d : c.Devices()) {
+			_kernel.push_back(p.NewKernel(*d, kernel));
+		}
+	}
+
+	template <typename T>
+	MultiDeviceCL::Stats MultiDeviceCL::Run(const KernelCL::Range& r, BufferCL<T>& out, cl_uint outArg, size_t chunks, size_t elements) {
+		const size_t dims = r.GlobalSize.dimensions();
+		if (dims < 1 || dims > 2) {
+			throw std::runtime_error("MultiDeviceCL, only 1D and 2D ranges are supported.");
+		}
+		if (r.Offset.dimensions()) {
+			throw std::runtime_error("MultiDeviceCL, ranges with a global offset are not supported.");
+		}
+
+		const std::vector<DeviceCL::Ptr>& devices = _context.Devices();
+		const size_t split = dims - 1;
+		const size_t rows = r.GlobalSize[split];
+		const size_t width = dims == 2 ? r.GlobalSize[0] : 1;
+		const size_t step = r.LocalSize.dimensions() ? r.LocalSize[split] : 1;
+
+		if (!chunks) {
+			chunks = devices.size() * 8;
+		}
+		size_t rowsPerChunk = std::max<size_t>(rows / chunks, 1);
+		rowsPerChunk = ((rowsPerChunk + step - 1) / step) * step;
+		chunks = (rows + rowsPerChunk - 1) / rowsPerChunk;
+
+		cl_uint minUnits = devices.front()->GetInfo().MaxComputeUnit;
+		for (const auto& d : devices) {
+			minUnits = std::min(minUnits, d->GetInfo().MaxComputeUnit);
+		}
+
+		Stats st;
+		st.Chunks.assign(devices.size(), 0);
+		st.Items.assign(devices.size(), 0);
+
+		std::atomic<size_t> next(0);
+		std::vector<std::exception_ptr> errors(devices.size());
+		std::vector<std::thread> workers;
+
+		const auto start = std::chrono::steady_clock::now();
+
+		for (size_t d = 0; d < devices.size(); d++) {
+			workers.emplace_back([&, d]() {
+				try {
+					DeviceCL& device = *devices[d];
+					QueueCL& queue = device.Queue();
+					KernelCL& kernel = *_kernel[d];
+
+					cl::Buffer b(_context.Get(), CL_MEM_READ_WRITE, out.Size());
+					BufferCL<T> scratch(b, RawPointer<T>::New(nullptr, out.Count()), CL_MEM_READ_WRITE);
+					kernel.Arg(outArg, scratch);
+
+					size_t take = std::max<size_t>(device.GetInfo().MaxComputeUnit / std::max<cl_uint>(minUnits, 1), 1);
+					for (;;) {
+						const size_t first = next.fetch_add(take);
+						if (first >= chunks) {
+							break;
+						}
+						const size_t last = std::min(first + take, chunks);
+						take = 1;
+
+						const size_t row = first * rowsPerChunk;
+						const size_t count = std::min(last * rowsPerChunk, rows) - row;
+
+						KernelCL::Range chunk;
+						chunk.LocalSize = r.LocalSize;
+						if (dims == 1) {
+							chunk.Offset = cl::NDRange(row);
+							chunk.GlobalSize = cl::NDRange(count);
+						} else {
+							chunk.Offset = cl::NDRange(0, row);
+							chunk.GlobalSize = cl::NDRange(width, count);
+						}
+
+						FutureCL ran = queue.Enqueue(kernel, chunk, FutureCL());
+						const size_t offset = row * width * elements;
+						queue.ReadBuffer(scratch, offset, out.Data() + offset, count * width * elements, ran).Wait();
+
+						st.Chunks[d] += last - first;
+						st.Items[d] += count * width;
+					}
+				} catch (...) {
+					errors[d] = std::current_exception();
+				}
+			});
+		}
+
+		for (auto& w : workers) {
+			w.join();
+		}
+		for (const auto& e : errors) {
+			if (e) {
+				std::rethrow_exception(e);
+			}
+		}
+
+		st.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return st;
+	}
+
+}}
+
+#endif
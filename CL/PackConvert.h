@@ -0,0 +1,300 @@
+#ifndef PACK_CONVERT_GPU_H
+#define PACK_CONVERT_GPU_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define U_PACK_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(U_PACK_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define U_PACK_F16C
+#include <immintrin.h>
+#define U_TARGET_F16C __attribute__((target("avx,f16c")))
+#endif
+
+namespace GPU {
+	namespace CL {
+
+	/*
+		Host side float packing for reduced precision transfers: IEEE half (what vload_half reads),
+		bfloat16 and int8 with a scale. Rounding is to nearest even everywhere, the SIMD paths
+		produce the same bits as the scalar ones.
+	*/
+	class PackConvert {
+	public:
+		enum Isa { Scalar, SSE2, F16C };
+
+		static Isa Detect();
+		static Isa Active() { return static_cast<Isa>(_Selected().load()); }
+		static void SetIsa(Isa i) { _Selected() = (i > Detect() ? Detect() : i); }
+
+		static void FloatToHalf(const float* src, uint16_t* dst, size_t n);
+		static void HalfToFloat(const uint16_t* src, float* dst, size_t n);
+
+		static void FloatToBFloat16(const float* src, uint16_t* dst, size_t n);
+		static void BFloat16ToFloat(const uint16_t* src, float* dst, size_t n);
+
+		// q = round(f / scale), saturated to [-128, 127].
+		static void FloatToInt8(const float* src, int8_t* dst, size_t n, float scale);
+		static void Int8ToFloat(const int8_t* src, float* dst, size_t n, float scale);
+
+		static uint16_t ToHalf(float f);
+		static float FromHalf(uint16_t h);
+
+		static uint16_t ToBFloat16(float f) {
+			const uint32_t x = _Bits(f);
+			if ((x & 0x7fffffffu) > 0x7f800000u) {
+				return static_cast<uint16_t>((x >> 16) | 0x40); // Keep NaNs quiet instead of rounding them to infinity.
+			}
+			return static_cast<uint16_t>((x + 0x7fffu + ((x >> 16) & 1)) >> 16);
+		}
+
+		static float FromBFloat16(uint16_t b) { return _Float(static_cast<uint32_t>(b) << 16); }
+
+		static int8_t ToInt8(float f, float scale) {
+			const float q = std::nearbyint(f * (1.0f / scale));
+			return static_cast<int8_t>(q < -128.0f ? -128 : (q > 127.0f ? 127 : (q == q ? q : 0)));
+		}
+
+	private:
+		static std::atomic<int>& _Selected() {
+			static std::atomic<int> isa(Detect());
+			return isa;
+		}
+
+		static uint32_t _Bits(float f) { uint32_t x; std::memcpy(&x, &f, sizeof(x)); return x; }
+		static float _Float(uint32_t x) { float f; std::memcpy(&f, &x, sizeof(f)); return f; }
+
+#ifdef U_PACK_SSE2
+		static void _FloatToBFloat16SSE2(const float* src, uint16_t* dst, size_t n) {
+			const __m128i one = _mm_set1_epi32(1), bias = _mm_set1_epi32(0x7fff);
+			const __m128i abs = _mm_set1_epi32(0x7fffffff), inf = _mm_set1_epi32(0x7f800000), quiet = _mm_set1_epi32(0x40);
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				__m128i v[2];
+				for (int j = 0; j < 2; j++) {
+					const __m128i x = _mm_castps_si128(_mm_loadu_ps(src + i + 4 * j));
+					const __m128i rounded = _mm_add_epi32(x, _mm_add_epi32(bias, _mm_and_si128(_mm_srli_epi32(x, 16), one)));
+					const __m128i nan = _mm_cmpgt_epi32(_mm_and_si128(x, abs), inf);
+					const __m128i r = _mm_or_si128(_mm_andnot_si128(nan, rounded), _mm_and_si128(nan, _mm_or_si128(x, _mm_slli_epi32(quiet, 16))));
+					// Arithmetic shift keeps the values inside int16, so the signed pack is exact.
+					v[j] = _mm_srai_epi32(r, 16);
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(v[0], v[1]));
+			}
+			for (; i < n; i++) {
+				dst[i] = ToBFloat16(src[i]);
+			}
+		}
+
+		static void _BFloat16ToFloatSSE2(const uint16_t* src, float* dst, size_t n) {
+			const __m128i zero = _mm_setzero_si128();
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+				_mm_storeu_ps(dst + i, _mm_castsi128_ps(_mm_unpacklo_epi16(zero, b)));
+				_mm_storeu_ps(dst + i + 4, _mm_castsi128_ps(_mm_unpackhi_epi16(zero, b)));
+			}
+			for (; i < n; i++) {
+				dst[i] = FromBFloat16(src[i]);
+			}
+		}
+
+		// Clamped before the conversion so infinities saturate and NaNs become 0, as in ToInt8().
+		static __m128i _Quantize(const float* src, const __m128& s) {
+			const __m128 v = _mm_mul_ps(_mm_loadu_ps(src), s);
+			const __m128 c = _mm_min_ps(_mm_max_ps(_mm_and_ps(v, _mm_cmpord_ps(v, v)), _mm_set1_ps(-128.0f)), _mm_set1_ps(127.0f));
+			return _mm_cvtps_epi32(c);
+		}
+
+		static void _FloatToInt8SSE2(const float* src, int8_t* dst, size_t n, float scale) {
+			const __m128 s = _mm_set1_ps(1.0f / scale);
+			size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				const __m128i a = _mm_packs_epi32(_Quantize(src + i, s), _Quantize(src + i + 4, s));
+				const __m128i b = _mm_packs_epi32(_Quantize(src + i + 8, s), _Quantize(src + i + 12, s));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi16(a, b));
+			}
+			for (; i < n; i++) {
+				dst[i] = ToInt8(src[i], scale);
+			}
+		}
+
+		static void _Int8ToFloatSSE2(const int8_t* src, float* dst, size_t n, float scale) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 s = _mm_set1_ps(scale);
+			size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				const __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+				const __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(zero, q), 8), hi = _mm_srai_epi16(_mm_unpackhi_epi8(zero, q), 8);
+				_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(zero, lo), 16)), s));
+				_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(zero, lo), 16)), s));
+				_mm_storeu_ps(dst + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(zero, hi), 16)), s));
+				_mm_storeu_ps(dst + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(zero, hi), 16)), s));
+			}
+			for (; i < n; i++) {
+				dst[i] = src[i] * scale;
+			}
+		}
+#endif
+
+#ifdef U_PACK_F16C
+		U_TARGET_F16C static void _FloatToHalfF16C(const float* src, uint16_t* dst, size_t n) {
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+			}
+			for (; i < n; i++) {
+				dst[i] = ToHalf(src[i]);
+			}
+		}
+
+		U_TARGET_F16C static void _HalfToFloatF16C(const uint16_t* src, float* dst, size_t n) {
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+			}
+			for (; i < n; i++) {
+				dst[i] = FromHalf(src[i]);
+			}
+		}
+#endif
+	};
+
+	inline PackConvert::Isa PackConvert::Detect() {
+#ifdef U_PACK_F16C
+		if (__builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx")) {
+			return F16C;
+		}
+#endif
+#ifdef U_PACK_SSE2
+		return SSE2;
+#else
+		return Scalar;
+#endif
+	}
+
+	inline uint16_t PackConvert::ToHalf(float f) {
+		const uint32_t x = _Bits(f);
+		const uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000);
+		const uint32_t abs = x & 0x7fffffffu;
+
+		if (abs >= 0x7f800000u) {
+			return sign | 0x7c00 | (abs > 0x7f800000u ? 0x200 : 0);
+		}
+		if (abs >= 0x477ff000u) {
+			return sign | 0x7c00; // Rounds past 65504.
+		}
+		if (abs < 0x38800000u) {
+			// Half subnormal: shift in the implicit bit and round what falls off.
+			if (abs < 0x33000000u) {
+				return sign;
+			}
+			const uint32_t shift = 126 - (abs >> 23);
+			const uint32_t m = (abs & 0x7fffffu) | 0x800000u;
+			uint32_t h = m >> shift;
+			const uint32_t rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+			h += rem > half || (rem == half && (h & 1));
+			return static_cast<uint16_t>(sign | h);
+		}
+
+		uint32_t h = (abs - 0x38000000u) >> 13;
+		const uint32_t rem = abs & 0x1fffu;
+		h += rem > 0x1000u || (rem == 0x1000u && (h & 1));
+		return static_cast<uint16_t>(sign | h);
+	}
+
+	inline float PackConvert::FromHalf(uint16_t h) {
+		const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+		const uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+		if (!e) {
+			const float v = m * 5.9604644775390625e-8f; // 2^-24, exact for 10 bit mantissas.
+			return sign ? -v : v;
+		}
+		if (e == 31) {
+			return _Float(sign | 0x7f800000u | (m << 13));
+		}
+		return _Float(sign | ((e + 112) << 23) | (m << 13));
+	}
+
+	inline void PackConvert::FloatToHalf(const float* src, uint16_t* dst, size_t n) {
+#ifdef U_PACK_F16C
+		if (Active() == F16C) {
+			_FloatToHalfF16C(src, dst, n);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = ToHalf(src[i]);
+		}
+	}
+
+	inline void PackConvert::HalfToFloat(const uint16_t* src, float* dst, size_t n) {
+#ifdef U_PACK_F16C
+		if (Active() == F16C) {
+			_HalfToFloatF16C(src, dst, n);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = FromHalf(src[i]);
+		}
+	}
+
+	inline void PackConvert::FloatToBFloat16(const float* src, uint16_t* dst, size_t n) {
+#ifdef U_PACK_SSE2
+		if (Active() != Scalar) {
+			_FloatToBFloat16SSE2(src, dst, n);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = ToBFloat16(src[i]);
+		}
+	}
+
+	inline void PackConvert::BFloat16ToFloat(const uint16_t* src, float* dst, size_t n) {
+#ifdef U_PACK_SSE2
+		if (Active() != Scalar) {
+			_BFloat16ToFloatSSE2(src, dst, n);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = FromBFloat16(src[i]);
+		}
+	}
+
+	inline void PackConvert::FloatToInt8(const float* src, int8_t* dst, size_t n, float scale) {
+#ifdef U_PACK_SSE2
+		if (Active() != Scalar) {
+			_FloatToInt8SSE2(src, dst, n, scale);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = ToInt8(src[i], scale);
+		}
+	}
+
+	inline void PackConvert::Int8ToFloat(const int8_t* src, float* dst, size_t n, float scale) {
+#ifdef U_PACK_SSE2
+		if (Active() != Scalar) {
+			_Int8ToFloatSSE2(src, dst, n, scale);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = src[i] * scale;
+		}
+	}
+
+}}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef PACKED_BUFFER_CL_H
+#define PACKED_BUFFER_CL_H
+
+#include "Storage.h"
+#include "PackConvert.h"
+
+#include <cmath>
+#include <string>
+
+namespace GPU {
+	namespace CL {
+
+	/*
+		Float data that lives on the device in a narrower format. The host keeps full precision floats,
+		QueueCL packs them into a staging area before the upload and unpacks after the readback, so
+		only 2 (Half, BFloat16) or 1 (Int8) bytes per element cross the bus.
+		Kernels read Half with vload_half/vstore_half, the other formats with the helpers in KernelSource().
+	*/
+	class PackedBufferCL {
+	public:
+		typedef std::shared_ptr<PackedBufferCL> Ptr;
+
+		enum Format { Half, BFloat16, Int8 };
+
+		PackedBufferCL(const cl::Context& c, const Storage<float>::Ptr& host, Format f, cl_mem_flags flags = CL_MEM_READ_WRITE, float scale = 1.0f);
+
+		const cl::Buffer& Get() const { return _buffer; }
+
+		size_t Count() const { return _host->Size(); }
+		size_t Bytes() const { return Count() * ElementSize(); }
+		size_t ElementSize() const { return ElementSize(_format); }
+		Format GetFormat() const { return _format; }
+		cl_mem_flags Flags() const { return _flags; }
+
+		// Int8 only: device value = round(host value / scale).
+		float Scale() const { return _scale; }
+		void SetScale(float s) {
+			if (!(s > 0.0f)) {
+				throw std::runtime_error("PackedBufferCL, scale must be positive.");
+			}
+			_scale = s;
+		}
+
+		float* Data() const { return _host->Data(); }
+		const Storage<float>::Ptr& Host() const { return _host; }
+
+		// Packed bytes as last written by Pack() or read back from the device.
+		const void* Packed() const { return _packed.data(); }
+		void* Packed() { return _packed.data(); }
+
+		void Pack();
+		void Unpack();
+
+		static size_t ElementSize(Format f) { return f == Int8 ? 1 : 2; }
+
+		// Symmetric scale covering the largest magnitude in data.
+		static float ScaleFor(const float* data, size_t n);
+
+		// Prepend to kernels reading BFloat16 (ushort) or Int8 (char) buffers.
+		static std::string KernelSource();
+
+		static Ptr New(const cl::Context& c, const Storage<float>::Ptr& host, Format f, cl_mem_flags flags = CL_MEM_READ_WRITE, float scale = 1.0f) {
+			return std::make_shared<PackedBufferCL>(c, host, f, flags, scale);
+		}
+
+	private:
+		cl::Buffer _buffer;
+		Storage<float>::Ptr _host;
+		std::vector<unsigned char, AlignedAllocator<unsigned char>> _packed;
+
+		Format _format;
+		cl_mem_flags _flags;
+		float _scale;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(PackedBufferCL);
+	};
+
+	inline PackedBufferCL::PackedBufferCL(const cl::Context& c, const Storage<float>::Ptr& host, Format f, cl_mem_flags flags, float scale)
+		: _host(host), _packed(AlignedAllocator<unsigned char>(U_PAGE_SIZE)), _format(f), _flags(flags), _scale(1.0f) {
+		if (!host || !host->Size()) {
+			throw std::runtime_error("PackedBufferCL, empty host storage.");
+		}
+		if (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) {
+			throw std::runtime_error("PackedBufferCL, host pointer flags are not supported, the device holds packed data.");
+		}
+		SetScale(scale);
+
+		_packed.resize(Bytes());
+		_buffer = cl::Buffer(c, flags, Bytes());
+	}
+
+	inline void PackedBufferCL::Pack() {
+		const float* src = _host->Data();
+		switch (_format) {
+		case Half:
+			PackConvert::FloatToHalf(src, reinterpret_cast<uint16_t*>(_packed.data()), Count());
+			break;
+		case BFloat16:
+			PackConvert::FloatToBFloat16(src, reinterpret_cast<uint16_t*>(_packed.data()), Count());
+			break;
+		case Int8:
+			PackConvert::FloatToInt8(src, reinterpret_cast<int8_t*>(_packed.data()), Count(), _scale);
+			break;
+		}
+	}
+
+	inline void PackedBufferCL::Unpack() {
+		float* dst = _host->Data();
+		switch (_format) {
+		case Half:
+			PackConvert::HalfToFloat(reinterpret_cast<const uint16_t*>(_packed.data()), dst, Count());
+			break;
+		case BFloat16:
+			PackConvert::BFloat16ToFloat(reinterpret_cast<const uint16_t*>(_packed.data()), dst, Count());
+			break;
+		case Int8:
+			PackConvert::Int8ToFloat(reinterpret_cast<const int8_t*>(_packed.data()), dst, Count(), _scale);
+			break;
+		}
+	}
+
+	inline float PackedBufferCL::ScaleFor(const float* data, size_t n) {
+		float m = 0.0f;
+		for (size_t i = 0; i < n; i++) {
+			const float a = std::fabs(data[i]);
+			m = (a > m && std::isfinite(a)) ? a : m;
+		}
+		return m > 0.0f ? m / 127.0f : 1.0f;
+	}
+
+	inline std::string PackedBufferCL::KernelSource() {
+		return U_KERNEL_CL(
+			inline float load_bf16(size_t i, const __global ushort* p) { return as_float((uint)p[i] << 16); }
+
+			inline void store_bf16(float f, size_t i, __global ushort* p) {
+				uint x = as_uint(f);
+				p[i] = isnan(f) ? (ushort)((x >> 16) | 0x40) : (ushort)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+			}
+
+			inline float load_int8(size_t i, const __global char* p, float scale) { return p[i] * scale; }
+
+			inline void store_int8(float f, size_t i, __global char* p, float scale) {
+				p[i] = convert_char_sat_rte(f / scale);
+			}
+		);
+	}
+
+}}
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef PIXEL_CONVERT_GPU_H
+#define PIXEL_CONVERT_GPU_H
+
+#include "Image.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define U_PIXEL_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(U_PIXEL_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define U_PIXEL_AVX2
+#include <immintrin.h>
+#define U_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace GPU {
+	namespace CL {
+
+	/*
+		Host side conversions between 8 bit RGBA/BGRA pixels and the layouts kernels want.
+		Every routine has a scalar, an SSE2 and (where it pays off) an AVX2 version; the widest one
+		the CPU supports is picked at runtime and can be overridden with SetIsa().
+	*/
+	class PixelConvert {
+	public:
+		enum Isa { Scalar, SSE2, AVX2 };
+
+		// Optional conversion applied by QueueCL on image/buffer upload and the inverse on download.
+		enum Stage {
+			None,
+			Swizzle,	// BGRA <-> RGBA
+			ToFloat4,	// RGBA8 <-> interleaved float4 in [0, 1]
+			ToPlanar	// RGBA8 <-> four float planes in [0, 1]
+		};
+
+		static Isa Detect();
+		static Isa Active() { return static_cast<Isa>(_Selected().load()); }
+		static void SetIsa(Isa i) { _Selected() = (i > Detect() ? Detect() : i); }
+
+		static void RGBA8ToFloat4(const uint8_t* src, float* dst, size_t pixels);
+		static void Float4ToRGBA8(const float* src, uint8_t* dst, size_t pixels);
+
+		// Swaps bytes 0 and 2 of every pixel, src and dst may be the same.
+		static void SwizzleRB(const uint8_t* src, uint8_t* dst, size_t pixels);
+
+		static void PackedToPlanar(const uint8_t* src, float* r, float* g, float* b, float* a, size_t pixels);
+		static void PlanarToPacked(const float* r, const float* g, const float* b, const float* a, uint8_t* dst, size_t pixels);
+
+		// Whole image, honouring BytesPerLine. Float layouts are tightly packed; planar planes are Width * Height apart.
+		static void Upload(const Image& src, Stage s, void* dst);
+		static void Download(const void* src, Stage s, const Image& dst);
+
+		// Bytes Upload() writes for an image.
+		static size_t StagedSize(const Image& img, Stage s) {
+			const size_t pixels = img.Width() * img.Height();
+			return s == ToFloat4 || s == ToPlanar ? pixels * 4 * sizeof(float) : pixels * 4;
+		}
+
+		static size_t Pitch(const Image& img) { return img.BytesPerLine() ? img.BytesPerLine() : img.Width() * 4; }
+
+	private:
+		static std::atomic<int>& _Selected() {
+			static std::atomic<int> isa(Detect());
+			return isa;
+		}
+
+		static uint8_t _ToByte(float f) {
+			f *= 255.0f;
+			if (!(f > 0.0f)) {
+				return 0;
+			}
+			return f >= 255.0f ? 255 : static_cast<uint8_t>(std::nearbyint(f));
+		}
+
+		static void _RGBA8ToFloat4Scalar(const uint8_t* src, float* dst, size_t n) {
+			for (size_t i = 0; i < n * 4; i++) {
+				dst[i] = src[i] * (1.0f / 255.0f);
+			}
+		}
+
+		static void _Float4ToRGBA8Scalar(const float* src, uint8_t* dst, size_t n) {
+			for (size_t i = 0; i < n * 4; i++) {
+				dst[i] = _ToByte(src[i]);
+			}
+		}
+
+		static void _SwizzleRBScalar(const uint8_t* src, uint8_t* dst, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				const uint8_t r = src[4 * i], g = src[4 * i + 1], b = src[4 * i + 2], a = src[4 * i + 3];
+				dst[4 * i] = b; dst[4 * i + 1] = g; dst[4 * i + 2] = r; dst[4 * i + 3] = a;
+			}
+		}
+
+		static void _PackedToPlanarScalar(const uint8_t* src, float* r, float* g, float* b, float* a, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				r[i] = src[4 * i] * (1.0f / 255.0f);
+				g[i] = src[4 * i + 1] * (1.0f / 255.0f);
+				b[i] = src[4 * i + 2] * (1.0f / 255.0f);
+				a[i] = src[4 * i + 3] * (1.0f / 255.0f);
+			}
+		}
+
+		static void _PlanarToPackedScalar(const float* r, const float* g, const float* b, const float* a, uint8_t* dst, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				dst[4 * i] = _ToByte(r[i]);
+				dst[4 * i + 1] = _ToByte(g[i]);
+				dst[4 * i + 2] = _ToByte(b[i]);
+				dst[4 * i + 3] = _ToByte(a[i]);
+			}
+		}
+
+#ifdef U_PIXEL_SSE2
+		// Scale, round to nearest and saturate 16 floats into 16 bytes.
+		static __m128i _Bytes(__m128 f0, __m128 f1, __m128 f2, __m128 f3) {
+			const __m128 s = _mm_set1_ps(255.0f);
+			const __m128i a = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(f0, s)), _mm_cvtps_epi32(_mm_mul_ps(f1, s)));
+			const __m128i b = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(f2, s)), _mm_cvtps_epi32(_mm_mul_ps(f3, s)));
+			return _mm_packus_epi16(a, b);
+		}
+
+		static void _RGBA8ToFloat4SSE2(const uint8_t* src, float* dst, size_t n) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 s = _mm_set1_ps(1.0f / 255.0f);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+				const __m128i lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero);
+				_mm_storeu_ps(dst + 4 * i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), s));
+				_mm_storeu_ps(dst + 4 * i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), s));
+				_mm_storeu_ps(dst + 4 * i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), s));
+				_mm_storeu_ps(dst + 4 * i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), s));
+			}
+			_RGBA8ToFloat4Scalar(src + 4 * i, dst + 4 * i, n - i);
+		}
+
+		static void _Float4ToRGBA8SSE2(const float* src, uint8_t* dst, size_t n) {
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				const float* f = src + 4 * i;
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i),
+					_Bytes(_mm_loadu_ps(f), _mm_loadu_ps(f + 4), _mm_loadu_ps(f + 8), _mm_loadu_ps(f + 12)));
+			}
+			_Float4ToRGBA8Scalar(src + 4 * i, dst + 4 * i, n - i);
+		}
+
+		// No pshufb before SSSE3, swap the bytes with shifts and masks.
+		static void _SwizzleRBSSE2(const uint8_t* src, uint8_t* dst, size_t n) {
+			const __m128i ga = _mm_set1_epi32(static_cast<int>(0xff00ff00u));
+			const __m128i lo = _mm_set1_epi32(0x000000ff);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+				const __m128i rb = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, lo), 16), _mm_and_si128(_mm_srli_epi32(p, 16), lo));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), _mm_or_si128(_mm_and_si128(p, ga), rb));
+			}
+			_SwizzleRBScalar(src + 4 * i, dst + 4 * i, n - i);
+		}
+
+		static void _PackedToPlanarSSE2(const uint8_t* src, float* r, float* g, float* b, float* a, size_t n) {
+			const __m128i mask = _mm_set1_epi32(0xff);
+			const __m128 s = _mm_set1_ps(1.0f / 255.0f);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+				_mm_storeu_ps(r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(p, mask)), s));
+				_mm_storeu_ps(g + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask)), s));
+				_mm_storeu_ps(b + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask)), s));
+				_mm_storeu_ps(a + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(p, 24)), s));
+			}
+			_PackedToPlanarScalar(src + 4 * i, r + i, g + i, b + i, a + i, n - i);
+		}
+
+		static void _PlanarToPackedSSE2(const float* r, const float* g, const float* b, const float* a, uint8_t* dst, size_t n) {
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				// Bytes come out channel by channel (rrrr gggg bbbb aaaa), interleave them back to pixels.
+				const __m128i p = _Bytes(_mm_loadu_ps(r + i), _mm_loadu_ps(g + i), _mm_loadu_ps(b + i), _mm_loadu_ps(a + i));
+				const __m128i rg = _mm_unpacklo_epi8(p, _mm_srli_si128(p, 4));
+				const __m128i ba = _mm_unpacklo_epi8(_mm_srli_si128(p, 8), _mm_srli_si128(p, 12));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), _mm_unpacklo_epi16(rg, ba));
+			}
+			_PlanarToPackedScalar(r + i, g + i, b + i, a + i, dst + 4 * i, n - i);
+		}
+#endif
+
+#ifdef U_PIXEL_AVX2
+		U_TARGET_AVX2 static void _RGBA8ToFloat4AVX2(const uint8_t* src, float* dst, size_t n) {
+			const __m256 s = _mm256_set1_ps(1.0f / 255.0f);
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+				const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i + 16));
+				_mm256_storeu_ps(dst + 4 * i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(p0)), s));
+				_mm256_storeu_ps(dst + 4 * i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(p0, 8))), s));
+				_mm256_storeu_ps(dst + 4 * i + 16, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(p1)), s));
+				_mm256_storeu_ps(dst + 4 * i + 24, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(p1, 8))), s));
+			}
+			_RGBA8ToFloat4Scalar(src + 4 * i, dst + 4 * i, n - i);
+		}
+
+		U_TARGET_AVX2 static void _Float4ToRGBA8AVX2(const float* src, uint8_t* dst, size_t n) {
+			const __m256 s = _mm256_set1_ps(255.0f);
+			// packs/packus work per 128 bit lane, this puts the pixels back in order.
+			const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				const float* f = src + 4 * i;
+				const __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(f), s));
+				const __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(f + 8), s));
+				const __m256i c = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(f + 16), s));
+				const __m256i d = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(f + 24), s));
+				const __m256i p = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * i), _mm256_permutevar8x32_epi32(p, order));
+			}
+			_Float4ToRGBA8SSE2(src + 4 * i, dst + 4 * i, n - i);
+		}
+
+		U_TARGET_AVX2 static void _SwizzleRBAVX2(const uint8_t* src, uint8_t* dst, size_t n) {
+			const __m256i shuffle = _mm256_setr_epi8(
+				2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+				2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * i));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * i), _mm256_shuffle_epi8(p, shuffle));
+			}
+			_SwizzleRBScalar(src + 4 * i, dst + 4 * i, n - i);
+		}
+
+		U_TARGET_AVX2 static void _PackedToPlanarAVX2(const uint8_t* src, float* r, float* g, float* b, float* a, size_t n) {
+			const __m256i mask = _mm256_set1_epi32(0xff);
+			const __m256 s = _mm256_set1_ps(1.0f / 255.0f);
+			size_t i = 0;
+			for (; i + 8 <= n; i += 8) {
+				const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * i));
+				_mm256_storeu_ps(r + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(p, mask)), s));
+				_mm256_storeu_ps(g + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask)), s));
+				_mm256_storeu_ps(b + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), mask)), s));
+				_mm256_storeu_ps(a + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(p, 24)), s));
+			}
+			_PackedToPlanarSSE2(src + 4 * i, r + i, g + i, b + i, a + i, n - i);
+		}
+#endif
+	};
+
+	inline PixelConvert::Isa PixelConvert::Detect() {
+#ifdef U_PIXEL_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+			return AVX2;
+		}
+#endif
+#ifdef U_PIXEL_SSE2
+		return SSE2;
+#else
+		return Scalar;
+#endif
+	}
+
+	inline void PixelConvert::RGBA8ToFloat4(const uint8_t* src, float* dst, size_t pixels) {
+		switch (Active()) {
+#ifdef U_PIXEL_AVX2
+		case AVX2: _RGBA8ToFloat4AVX2(src, dst, pixels); return;
+#endif
+#ifdef U_PIXEL_SSE2
+		case SSE2: _RGBA8ToFloat4SSE2(src, dst, pixels); return;
+#endif
+		default: _RGBA8ToFloat4Scalar(src, dst, pixels);
+		}
+	}
+
+	inline void PixelConvert::Float4ToRGBA8(const float* src, uint8_t* dst, size_t pixels) {
+		switch (Active()) {
+#ifdef U_PIXEL_AVX2
+		case AVX2: _Float4ToRGBA8AVX2(src, dst, pixels); return;
+#endif
+#ifdef U_PIXEL_SSE2
+		case SSE2: _Float4ToRGBA8SSE2(src, dst, pixels); return;
+#endif
+		default: _Float4ToRGBA8Scalar(src, dst, pixels);
+		}
+	}
+
+	inline void PixelConvert::SwizzleRB(const uint8_t* src, uint8_t* dst, size_t pixels) {
+		switch (Active()) {
+#ifdef U_PIXEL_AVX2
+		case AVX2: _SwizzleRBAVX2(src, dst, pixels); return;
+#endif
+#ifdef U_PIXEL_SSE2
+		case SSE2: _SwizzleRBSSE2(src, dst, pixels); return;
+#endif
+		default: _SwizzleRBScalar(src, dst, pixels);
+		}
+	}
+
+	inline void PixelConvert::PackedToPlanar(const uint8_t* src, float* r, float* g, float* b, float* a, size_t pixels) {
+		switch (Active()) {
+#ifdef U_PIXEL_AVX2
+		case AVX2: _PackedToPlanarAVX2(src, r, g, b, a, pixels); return;
+#endif
+#ifdef U_PIXEL_SSE2
+		case SSE2: _PackedToPlanarSSE2(src, r, g, b, a, pixels); return;
+#endif
+		default: _PackedToPlanarScalar(src, r, g, b, a, pixels);
+		}
+	}
+
+	// Store bound either way, the SSE2 interleave is as fast as an AVX2 one would be.
+	inline void PixelConvert::PlanarToPacked(const float* r, const float* g, const float* b, const float* a, uint8_t* dst, size_t pixels) {
+#ifdef U_PIXEL_SSE2
+		if (Active() != Scalar) {
+			_PlanarToPackedSSE2(r, g, b, a, dst, pixels);
+			return;
+		}
+#endif
+		_PlanarToPackedScalar(r, g, b, a, dst, pixels);
+	}
+
+	inline void PixelConvert::Upload(const Image& src, Stage s, void* dst) {
+		const size_t w = src.Width(), h = src.Height(), pitch = Pitch(src);
+		uint8_t* bytes = static_cast<uint8_t*>(dst);
+		float* floats = static_cast<float*>(dst);
+
+		for (size_t y = 0; y < h; y++) {
+			const uint8_t* row = src.Bits() + y * pitch;
+			switch (s) {
+			case None: std::memcpy(bytes + y * w * 4, row, w * 4); break;
+			case Swizzle: SwizzleRB(row, bytes + y * w * 4, w); break;
+			case ToFloat4: RGBA8ToFloat4(row, floats + y * w * 4, w); break;
+			case ToPlanar: {
+				const size_t plane = w * h, o = y * w;
+				PackedToPlanar(row, floats + o, floats + plane + o, floats + 2 * plane + o, floats + 3 * plane + o, w);
+				break;
+			}
+			}
+		}
+	}
+
+	inline void PixelConvert::Download(const void* src, Stage s, const Image& dst) {
+		const size_t w = dst.Width(), h = dst.Height(), pitch = Pitch(dst);
+		const uint8_t* bytes = static_cast<const uint8_t*>(src);
+		const float* floats = static_cast<const float*>(src);
+
+		for (size_t y = 0; y < h; y++) {
+			uint8_t* row = dst.Bits() + y * pitch;
+			switch (s) {
+			case None: std::memcpy(row, bytes + y * w * 4, w * 4); break;
+			case Swizzle: SwizzleRB(bytes + y * w * 4, row, w); break;
+			case ToFloat4: Float4ToRGBA8(floats + y * w * 4, row, w); break;
+			case ToPlanar: {
+				const size_t plane = w * h, o = y * w;
+				PlanarToPacked(floats + o, floats + plane + o, floats + 2 * plane + o, floats + 3 * plane + o, row, w);
+				break;
+			}
+			}
+		}
+	}
+
+}}
+
+#endif
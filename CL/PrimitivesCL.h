@@ -0,0 +1,446 @@
+#ifndef PRIMITIVES_CL_H
+#define PRIMITIVES_CL_H
+
+#include "ContextCL.h"
+
+#include <limits>
+#include <type_traits>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Device-wide reduce, scan and segmented scan over a BufferCL<T> of scalars. Kernels are generated
+		per (type, operator) on first use and cached. Every pass is a local memory tree over one work-group
+		sized block, larger inputs recurse over the per-block totals. Not thread-safe, kernels carry arguments.
+	*/
+	class PrimitivesCL {
+	public:
+		typedef std::shared_ptr<PrimitivesCL> Ptr;
+
+		enum Op { Sum, Product, Min, Max };
+
+		// Cap on the work-group size, the tree depth gains little beyond it and local memory stays small.
+		static const size_t MaxGroupSize = 256;
+
+		PrimitivesCL(ContextCL& c, DeviceCL& d) : _context(c), _device(d) {}
+
+		// Blocking, returns the reduced value (Identity(op) for an empty buffer).
+		template <typename T>
+		T Reduce(QueueCL& q, const BufferCL<T>& in, Op op, const FutureCL& after = FutureCL());
+
+		template <typename T>
+		FutureCL InclusiveScan(QueueCL& q, const BufferCL<T>& in, BufferCL<T>& out, Op op, const FutureCL& after = FutureCL()) {
+			return _Scan(q, _Get<T>(op), in, out, nullptr, in.Count(), false, after);
+		}
+
+		template <typename T>
+		FutureCL ExclusiveScan(QueueCL& q, const BufferCL<T>& in, BufferCL<T>& out, Op op, const FutureCL& after = FutureCL()) {
+			return _Scan(q, _Get<T>(op), in, out, nullptr, in.Count(), true, after);
+		}
+
+		// A non-zero flag starts a new segment at that element.
+		template <typename T>
+		FutureCL SegmentedScan(QueueCL& q, const BufferCL<T>& in, const BufferCL<cl_uint>& flags, BufferCL<T>& out, Op op,
+			bool exclusive = false, const FutureCL& after = FutureCL()) {
+			if (flags.Count() < in.Count()) {
+				throw std::runtime_error("SegmentedScan, flags buffer smaller than the input.");
+			}
+			return _Scan(q, _Get<T>(op), in, out, &flags, in.Count(), exclusive, after);
+		}
+
+		// Work-group size used for T and op, builds the kernels if needed.
+		template <typename T>
+		size_t GroupSize(Op op) { return _Get<T>(op).Group; }
+
+		size_t ProgramCount() const { return _programs.size(); }
+
+		/**** Host reference implementations ****/
+
+		template <typename T>
+		static T Identity(Op op);
+
+		template <typename T>
+		static T Apply(Op op, const T& a, const T& b);
+
+		template <typename T>
+		static T ReduceHost(const T* in, size_t n, Op op);
+
+		template <typename T>
+		static void ScanHost(const T* in, T* out, size_t n, Op op, bool exclusive = false);
+
+		template <typename T>
+		static void SegmentedScanHost(const T* in, const cl_uint* flags, T* out, size_t n, Op op, bool exclusive = false);
+
+		static Ptr New(ContextCL& c, DeviceCL& d) {
+			return std::make_shared<PrimitivesCL>(c, d);
+		}
+
+	private:
+		struct _Program {
+			ProgramCL::Ptr Program;
+			KernelCL::Ptr Reduce, ScanBlocks, AddOffsets, SegScanBlocks, SegAddOffsets;
+			Op Operator;
+			size_t Group;
+		};
+
+		static const char* _OpName(Op op);
+		static std::string _OpExpression(Op op);
+		static const char* _Source();
+
+		template <typename T>
+		_Program& _Get(Op op);
+
+		template <typename T>
+		typename BufferCL<T>::Ptr _Scratch(size_t count) const {
+			// Device only, no host storage behind it.
+			return std::make_shared<BufferCL<T>>(_context.Get(), RawPointer<T>::New(nullptr, count), CL_MEM_READ_WRITE);
+		}
+
+		template <typename T>
+		FutureCL _Scan(QueueCL& q, _Program& p, const BufferCL<T>& in, BufferCL<T>& out, const BufferCL<cl_uint>* flags,
+			size_t n, bool exclusive, const FutureCL& after);
+
+		static KernelCL::Range _Range(size_t groups, size_t group) {
+			KernelCL::Range r;
+			r.GlobalSize = cl::NDRange(groups * group);
+			r.LocalSize = cl::NDRange(group);
+			return r;
+		}
+
+		ContextCL& _context;
+		DeviceCL& _device;
+
+		std::map<std::string, std::shared_ptr<_Program>> _programs;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(PrimitivesCL);
+	};
+
+	inline const char* PrimitivesCL::_OpName(Op op) {
+		switch (op) {
+		case Sum: return "sum";
+		case Product: return "product";
+		case Min: return "min";
+		case Max: return "max";
+		}
+		return "";
+	}
+
+	inline std::string PrimitivesCL::_OpExpression(Op op) {
+		switch (op) {
+		case Sum: return "((a) + (b))";
+		case Product: return "((a) * (b))";
+		case Min: return "min((a), (b))";
+		case Max: return "max((a), (b))";
+		}
+		throw std::runtime_error("PrimitivesCL, unknown operator.");
+	}
+
+	inline const char* PrimitivesCL::_Source() {
+		return U_KERNEL_CL(
+			__kernel void reduce(__global const T* in, __global T* out, uint n, T identity, __local T* tmp) {
+				uint lid = get_local_id(0);
+				T acc = identity;
+				for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {
+					acc = OP(acc, in[i]);
+				}
+				tmp[lid] = acc;
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				for (uint s = get_local_size(0) / 2; s > 0; s >>= 1) {
+					if (lid < s) {
+						tmp[lid] = OP(tmp[lid], tmp[lid + s]);
+					}
+					barrier(CLK_LOCAL_MEM_FENCE);
+				}
+				if (lid == 0) {
+					out[get_group_id(0)] = tmp[0];
+				}
+			}
+
+			__kernel void scan_blocks(__global const T* in, __global T* out, __global T* sums, uint n, T identity, int exclusive, __local T* tmp) {
+				uint lid = get_local_id(0);
+				uint gid = get_global_id(0);
+				uint wg = get_local_size(0);
+
+				tmp[lid] = gid < n ? in[gid] : identity;
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				for (uint o = 1; o < wg; o <<= 1) {
+					T x = tmp[lid];
+					if (lid >= o) {
+						x = OP(tmp[lid - o], x);
+					}
+					barrier(CLK_LOCAL_MEM_FENCE);
+					tmp[lid] = x;
+					barrier(CLK_LOCAL_MEM_FENCE);
+				}
+
+				if (gid < n) {
+					out[gid] = exclusive ? (lid ? tmp[lid - 1] : identity) : tmp[lid];
+				}
+				if (lid == wg - 1) {
+					sums[get_group_id(0)] = tmp[lid];
+				}
+			}
+
+			__kernel void add_offsets(__global T* out, __global const T* sums, uint n) {
+				uint g = get_group_id(0);
+				uint gid = get_global_id(0);
+				if (g > 0 && gid < n) {
+					out[gid] = OP(sums[g - 1], out[gid]);
+				}
+			}
+
+			__kernel void segscan_blocks(__global const T* in, __global const uint* flags, __global T* out, __global T* sums, __global uint* sumFlags,
+				uint n, T identity, int exclusive, __local T* tmp, __local uint* tmpf) {
+				uint lid = get_local_id(0);
+				uint gid = get_global_id(0);
+				uint wg = get_local_size(0);
+				uint f = gid < n ? (flags[gid] != 0) : 0;
+
+				tmp[lid] = gid < n ? in[gid] : identity;
+				tmpf[lid] = f;
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				for (uint o = 1; o < wg; o <<= 1) {
+					T x = tmp[lid];
+					uint xf = tmpf[lid];
+					if (lid >= o) {
+						if (!xf) {
+							x = OP(tmp[lid - o], x);
+						}
+						xf |= tmpf[lid - o];
+					}
+					barrier(CLK_LOCAL_MEM_FENCE);
+					tmp[lid] = x;
+					tmpf[lid] = xf;
+					barrier(CLK_LOCAL_MEM_FENCE);
+				}
+
+				if (gid < n) {
+					out[gid] = exclusive ? ((f || !lid) ? identity : tmp[lid - 1]) : tmp[lid];
+				}
+				if (lid == wg - 1) {
+					sums[get_group_id(0)] = tmp[lid];
+					sumFlags[get_group_id(0)] = tmpf[lid];
+				}
+			}
+
+			__kernel void segadd_offsets(__global T* out, __global const uint* flags, __global const T* sums, uint n, __local uint* tmpf) {
+				uint lid = get_local_id(0);
+				uint gid = get_global_id(0);
+				uint wg = get_local_size(0);
+
+				tmpf[lid] = gid < n ? (flags[gid] != 0) : 0;
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				for (uint o = 1; o < wg; o <<= 1) {
+					uint xf = tmpf[lid];
+					if (lid >= o) {
+						xf |= tmpf[lid - o];
+					}
+					barrier(CLK_LOCAL_MEM_FENCE);
+					tmpf[lid] = xf;
+					barrier(CLK_LOCAL_MEM_FENCE);
+				}
+
+				if (get_group_id(0) > 0 && gid < n && !tmpf[lid]) {
+					out[gid] = OP(sums[get_group_id(0) - 1], out[gid]);
+				}
+			}
+		);
+	}
+
+	template <typename T>
+	PrimitivesCL::_Program& PrimitivesCL::_Get(Op op) {
+		static_assert(std::is_arithmetic<T>::value, "PrimitivesCL, scalar types only.");
+
+		const char* type = TypeNameCL<T>::Get();
+		if (!type) {
+			throw std::runtime_error("PrimitivesCL, type has no OpenCL C name.");
+		}
+
+		const std::string key = std::string(type) + "/" + _OpName(op);
+		auto it = _programs.find(key);
+		if (it != _programs.end()) {
+			return *it->second;
+		}
+
+		std::ostringstream source;
+		if (std::is_same<T, cl_double>::value) {
+			source << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+		}
+		source << "#define T " << type << "\n";
+		source << "#define OP(a, b) " << _OpExpression(op) << "\n";
+		source << _Source() << "\n";
+
+		std::shared_ptr<_Program> p = std::make_shared<_Program>();
+		p->Operator = op;
+		p->Program = _context.NewProgramFromSource(source.str());
+		p->Program->BuildFor(_device);
+
+		p->Reduce = p->Program->NewKernel(_device, "reduce");
+		p->ScanBlocks = p->Program->NewKernel(_device, "scan_blocks");
+		p->AddOffsets = p->Program->NewKernel(_device, "add_offsets");
+		p->SegScanBlocks = p->Program->NewKernel(_device, "segscan_blocks");
+		p->SegAddOffsets = p->Program->NewKernel(_device, "segadd_offsets");
+
+		size_t group = MaxGroupSize;
+		for (const KernelCL::Ptr& k : { p->Reduce, p->ScanBlocks, p->AddOffsets, p->SegScanBlocks, p->SegAddOffsets }) {
+			if (k->GetInfo().maxWorkGroupSize) {
+				group = std::min(group, k->GetInfo().maxWorkGroupSize);
+			}
+		}
+		// Tree passes halve the active range, keep it a power of two.
+		p->Group = 1;
+		while (p->Group * 2 <= group) {
+			p->Group *= 2;
+		}
+
+		_programs[key] = p;
+		return *p;
+	}
+
+	template <typename T>
+	T PrimitivesCL::Reduce(QueueCL& q, const BufferCL<T>& in, Op op, const FutureCL& after) {
+		_Program& p = _Get<T>(op);
+		const size_t n = in.Count();
+		const T identity = Identity<T>(op);
+		if (!n) {
+			return identity;
+		}
+
+		// Pass one leaves at most Group partials, so a second single group pass always finishes.
+		const size_t groups = std::min((n + p.Group - 1) / p.Group, p.Group);
+		auto partials = _Scratch<T>(groups);
+
+		p.Reduce->Args(in, *partials, static_cast<cl_uint>(n), identity, cl::Local(p.Group * sizeof(T)));
+		FutureCL done = q.Enqueue(*p.Reduce, _Range(groups, p.Group), after);
+
+		const BufferCL<T>* result = partials.get();
+		typename BufferCL<T>::Ptr total;
+		if (groups > 1) {
+			total = _Scratch<T>(1);
+			p.Reduce->Args(*partials, *total, static_cast<cl_uint>(groups), identity, cl::Local(p.Group * sizeof(T)));
+			done = q.Enqueue(*p.Reduce, _Range(1, p.Group), done);
+			result = total.get();
+		}
+
+		T value = identity;
+		q.ReadBuffer(*result, 0, &value, 1, done).Wait();
+		return value;
+	}
+
+	template <typename T>
+	FutureCL PrimitivesCL::_Scan(QueueCL& q, _Program& p, const BufferCL<T>& in, BufferCL<T>& out, const BufferCL<cl_uint>* flags,
+		size_t n, bool exclusive, const FutureCL& after) {
+		if (out.Count() < n) {
+			throw std::runtime_error("PrimitivesCL, output buffer smaller than the input.");
+		}
+		if (!n) {
+			return after;
+		}
+
+		const T identity = Identity<T>(p.Operator);
+		const size_t groups = (n + p.Group - 1) / p.Group;
+		auto sums = _Scratch<T>(groups);
+
+		FutureCL done;
+		BufferCL<cl_uint>::Ptr sumFlags;
+		if (flags) {
+			sumFlags = _Scratch<cl_uint>(groups);
+			p.SegScanBlocks->Args(in, *flags, out, *sums, *sumFlags, static_cast<cl_uint>(n), identity, static_cast<cl_int>(exclusive),
+				cl::Local(p.Group * sizeof(T)), cl::Local(p.Group * sizeof(cl_uint)));
+			done = q.Enqueue(*p.SegScanBlocks, _Range(groups, p.Group), after);
+		} else {
+			p.ScanBlocks->Args(in, out, *sums, static_cast<cl_uint>(n), identity, static_cast<cl_int>(exclusive), cl::Local(p.Group * sizeof(T)));
+			done = q.Enqueue(*p.ScanBlocks, _Range(groups, p.Group), after);
+		}
+
+		if (groups == 1) {
+			return done;
+		}
+
+		// Inclusive scan of the block totals gives the carry into every following block.
+		auto carry = _Scratch<T>(groups);
+		done = _Scan(q, p, *sums, *carry, sumFlags.get(), groups, false, done);
+
+		if (flags) {
+			p.SegAddOffsets->Args(out, *flags, *carry, static_cast<cl_uint>(n), cl::Local(p.Group * sizeof(cl_uint)));
+			return q.Enqueue(*p.SegAddOffsets, _Range(groups, p.Group), done);
+		}
+		p.AddOffsets->Args(out, *carry, static_cast<cl_uint>(n));
+		return q.Enqueue(*p.AddOffsets, _Range(groups, p.Group), done);
+	}
+
+	/**** Host reference implementations ****/
+
+	template <typename T>
+	T PrimitivesCL::Identity(Op op) {
+		typedef std::numeric_limits<T> L;
+		switch (op) {
+		case Sum: return T(0);
+		case Product: return T(1);
+		case Min: return L::has_infinity ? L::infinity() : L::max();
+		case Max: return L::has_infinity ? -L::infinity() : L::lowest();
+		}
+		return T(0);
+	}
+
+	template <typename T>
+	T PrimitivesCL::Apply(Op op, const T& a, const T& b) {
+		switch (op) {
+		case Sum: return a + b;
+		case Product: return a * b;
+		case Min: return b < a ? b : a;
+		case Max: return a < b ? b : a;
+		}
+		return a;
+	}
+
+	template <typename T>
+	T PrimitivesCL::ReduceHost(const T* in, size_t n, Op op) {
+		T acc = Identity<T>(op);
+		for (size_t i = 0; i < n; i++) {
+			acc = Apply(op, acc, in[i]);
+		}
+		return acc;
+	}
+
+	template <typename T>
+	void PrimitivesCL::ScanHost(const T* in, T* out, size_t n, Op op, bool exclusive) {
+		T acc = Identity<T>(op);
+		for (size_t i = 0; i < n; i++) {
+			const T v = in[i];
+			if (exclusive) {
+				out[i] = acc;
+			}
+			acc = Apply(op, acc, v);
+			if (!exclusive) {
+				out[i] = acc;
+			}
+		}
+	}
+
+	template <typename T>
+	void PrimitivesCL::SegmentedScanHost(const T* in, const cl_uint* flags, T* out, size_t n, Op op, bool exclusive) {
+		T acc = Identity<T>(op);
+		for (size_t i = 0; i < n; i++) {
+			if (flags[i]) {
+				acc = Identity<T>(op);
+			}
+			const T v = in[i];
+			if (exclusive) {
+				out[i] = acc;
+			}
+			acc = Apply(op, acc, v);
+			if (!exclusive) {
+				out[i] = acc;
+			}
+		}
+	}
+
+}}
+
+#endif
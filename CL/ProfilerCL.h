@@ -0,0 +1,181 @@
+#ifndef PROFILER_CL_H
+#define PROFILER_CL_H
+
+#include "CommonCL.h"
+
+#include <map>
+#include <mutex>
+#include <sstream>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Collects the events of profiling enabled queues (CL_QUEUE_PROFILING_ENABLE). Timestamps are resolved
+		lazily on export, so recording costs one event copy per command.
+	*/
+	class ProfilerCL {
+	public:
+		typedef std::shared_ptr<ProfilerCL> Ptr;
+
+		struct Record {
+			std::string Kind;
+			std::string Name;
+			size_t Bytes;
+			size_t Queue;
+
+			cl_ulong Queued, Submit, Start, End;
+		};
+
+		struct Summary {
+			std::string Name;
+			size_t Count;
+			cl_ulong TotalNs, P50Ns, P99Ns;
+		};
+
+		ProfilerCL() {}
+
+		void Add(const void* queue, const std::string& kind, const std::string& name, size_t bytes, const cl::Event& ev);
+
+		std::vector<Record> Records() const;
+		std::vector<Summary> KernelSummary() const;
+
+		void ToChromeTrace(std::ostream& out) const;
+		void ToText(std::ostream& out) const;
+
+		void Clear();
+
+		static Ptr New() { return std::make_shared<ProfilerCL>(); }
+
+	private:
+		struct _Pending {
+			Record R;
+			cl::Event Event;
+		};
+
+		void _Resolve() const;
+		static std::string _Escape(const std::string& s);
+
+		mutable std::mutex _mutex;
+		mutable std::vector<_Pending> _pending;
+		mutable std::vector<Record> _records;
+		std::map<const void*, size_t> _queues;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(ProfilerCL);
+	};
+
+	inline void ProfilerCL::Add(const void* queue, const std::string& kind, const std::string& name, size_t bytes, const cl::Event& ev) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto q = _queues.find(queue);
+		if (q == _queues.end()) {
+			q = _queues.insert(std::make_pair(queue, _queues.size())).first;
+		}
+
+		_Pending p;
+		p.R.Kind = kind;
+		p.R.Name = name;
+		p.R.Bytes = bytes;
+		p.R.Queue = q->second;
+		p.R.Queued = p.R.Submit = p.R.Start = p.R.End = 0;
+		p.Event = ev;
+		_pending.push_back(p);
+	}
+
+	inline void ProfilerCL::_Resolve() const {
+		for (auto& p : _pending) {
+			p.Event.wait();
+			p.R.Queued = p.Event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+			p.R.Submit = p.Event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+			p.R.Start = p.Event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			p.R.End = p.Event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			_records.push_back(p.R);
+		}
+		_pending.clear();
+	}
+
+	inline std::vector<ProfilerCL::Record> ProfilerCL::Records() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_Resolve();
+		return _records;
+	}
+
+	inline std::vector<ProfilerCL::Summary> ProfilerCL::KernelSummary() const {
+		std::map<std::string, std::vector<cl_ulong>> durations;
+		for (const auto& r : Records()) {
+			if (r.Kind == "kernel") {
+				durations[r.Name].push_back(r.End - r.Start);
+			}
+		}
+
+		std::vector<Summary> list;
+		for (auto& d : durations) {
+			std::vector<cl_ulong>& v = d.second;
+			std::sort(v.begin(), v.end());
+
+			Summary s;
+			s.Name = d.first;
+			s.Count = v.size();
+			s.TotalNs = 0;
+			for (auto t : v) {
+				s.TotalNs += t;
+			}
+			// Nearest rank percentiles.
+			s.P50Ns = v[(v.size() * 50 + 99) / 100 - 1];
+			s.P99Ns = v[(v.size() * 99 + 99) / 100 - 1];
+			list.push_back(s);
+		}
+		return list;
+	}
+
+	inline std::string ProfilerCL::_Escape(const std::string& s) {
+		std::string e;
+		for (const char c : s) {
+			if (c == '"' || c == '\\') {
+				e += '\\';
+			}
+			e += c;
+		}
+		return e;
+	}
+
+	inline void ProfilerCL::ToChromeTrace(std::ostream& out) const {
+		const std::vector<Record> records = Records();
+
+		cl_ulong origin = 0;
+		for (const auto& r : records) {
+			if (!origin || r.Queued < origin) {
+				origin = r.Queued;
+			}
+		}
+
+		out << "{\"traceEvents\":[";
+		for (size_t i = 0; i < records.size(); i++) {
+			const Record& r = records[i];
+			out << (i ? "," : "") << "\n{\"name\":\"" << _Escape(r.Name.empty() ? r.Kind : r.Name) << "\""
+				<< ",\"cat\":\"" << r.Kind << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << r.Queue
+				<< ",\"ts\":" << (r.Start - origin) / 1000.0
+				<< ",\"dur\":" << (r.End - r.Start) / 1000.0
+				<< ",\"args\":{\"bytes\":" << r.Bytes
+				<< ",\"queued_us\":" << (r.Queued - origin) / 1000.0
+				<< ",\"submit_us\":" << (r.Submit - origin) / 1000.0 << "}}";
+		}
+		out << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
+	}
+
+	inline void ProfilerCL::ToText(std::ostream& out) const {
+		out << "kernel, count, total_us, p50_us, p99_us" << std::endl;
+		for (const auto& s : KernelSummary()) {
+			out << s.Name << ", " << s.Count << ", " << s.TotalNs / 1000.0 << ", " << s.P50Ns / 1000.0 << ", " << s.P99Ns / 1000.0 << std::endl;
+		}
+	}
+
+	inline void ProfilerCL::Clear() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_pending.clear();
+		_records.clear();
+	}
+
+}}
+
+#endif
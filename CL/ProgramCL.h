@@ -4,6 +4,10 @@
 #include "CommonCL.h"
 #include "KernelCL.h"
 #include "DeviceCL.h"
+#include "ProgramCacheCL.h"
+#include "TypedKernelCL.h"
+#include "KernelPoolCL.h"
+#include "MetricsCL.h"
 
 #include <fstream>
 
@@ -14,46 +18,148 @@ namespace CL {
 	public:
 		typedef std::shared_ptr<ProgramCL> Ptr;
 
-		void BuildFor(const DeviceCL&);
-		void BuildFor(const std::vector<DeviceCL::Ptr>&);
+		void BuildFor(const DeviceCL&, const std::string& options = "");
+		void BuildFor(const std::vector<DeviceCL::Ptr>&, const std::string& options = "");
 
 		KernelCL::Ptr NewKernel(const DeviceCL& c, const std::string& kernel);
 		KernelCL::Ptr NewKernel(const std::string& kernel);
 
+		KernelPoolCL::Ptr NewKernelPool(const DeviceCL& d, const std::string& kernel) {
+			return std::make_shared<KernelPoolCL>(Get(), d.Get(), kernel, _metrics ? _metrics->LaunchCounter(kernel) : nullptr);
+		}
+
+		template <typename... A>
+		typename TypedKernelCL<A...>::Ptr NewTypedKernel(const DeviceCL& d, const std::string& kernel) {
+			return std::make_shared<TypedKernelCL<A...>>(NewKernel(d, kernel));
+		}
+
 		const cl::Program& Get() const { return _program; }
 
-		ProgramCL(const cl::Program& p) : _program(p) {}
+		bool FromCache() const { return _fromCache; }
+
+		ProgramCL(const cl::Program& p) : _program(p), _fromCache(false) {}
+		ProgramCL(const cl::Program& p, const std::string& source, const ProgramCacheCL::Ptr& cache, const MetricsCL::Ptr& metrics = nullptr)
+			: _program(p), _source(source), _cache(cache), _metrics(metrics), _fromCache(false) {}
+
 	private:
+		void _Build(const std::vector<const DeviceCL*>&, const std::string& options);
+		bool _BuildFromCache(const std::vector<const DeviceCL*>&, const std::vector<cl::Device>&, const std::string& options);
+		void _StoreInCache(const std::vector<const DeviceCL*>&, const std::string& options);
 
 		cl::Program _program;
 
+		const std::string _source;
+		ProgramCacheCL::Ptr _cache;
+		MetricsCL::Ptr _metrics;
+		bool _fromCache;
+
 		U_DISABLE_COPY_AND_ASSIGNMENT(ProgramCL);
 	};
 
-	void ProgramCL::BuildFor(const DeviceCL& d) {
-		const cl::Device& d_ = d.Get();
+	void ProgramCL::BuildFor(const DeviceCL& d, const std::string& options) {
+		std::vector<const DeviceCL*> list; list.push_back(&d);
+		_Build(list, options);
+	}
 
-		std::vector<cl::Device> list; list.push_back(d_);
-		_program.build(list);
+	void ProgramCL::BuildFor(const std::vector<DeviceCL::Ptr>& dev, const std::string& options) {
+		std::vector<const DeviceCL*> list; 
+		for (auto d : dev) {
+			list.push_back(d.get());
+		}
+		_Build(list, options);
 	}
 
-	void ProgramCL::BuildFor(const std::vector<DeviceCL::Ptr>& dev) {
-		std::vector<cl::Device> list; 
+	void ProgramCL::_Build(const std::vector<const DeviceCL*>& dev, const std::string& options) {
+		std::vector<cl::Device> list;
 		for (auto d : dev) {
 			list.push_back(d->Get());
 		}
-		_program.build(list);
+
+		if (_metrics) {
+			_metrics->_Built();
+		}
+
+		if (!_cache || _source.empty()) {
+			_program.build(list, options.c_str());
+			return;
+		}
+
+		if (_BuildFromCache(dev, list, options)) {
+			_cache->_Hit();
+			return;
+		}
+
+		_cache->_Miss();
+		_program.build(list, options.c_str());
+		_StoreInCache(dev, options);
+	}
+
+	bool ProgramCL::_BuildFromCache(const std::vector<const DeviceCL*>& dev, const std::vector<cl::Device>& list, const std::string& options) {
+		std::vector<std::vector<unsigned char>> bin(dev.size());
+		cl::Program::Binaries binaries;
+		for (size_t i = 0; i < dev.size(); i++) {
+			if (!_cache->Load(_cache->Key(_source, options, *dev[i]), bin[i])) {
+				return false;
+			}
+			binaries.push_back(std::make_pair(bin[i].data(), bin[i].size()));
+		}
+
+		try {
+			cl::Program p(_program.getInfo<CL_PROGRAM_CONTEXT>(), list, binaries);
+			p.build(list, options.c_str());
+			_program = p;
+			_fromCache = true;
+			return true;
+		} catch (const cl::Error&) {
+			// Stale or foreign binary, fall back to the source.
+			return false;
+		}
+	}
+
+	void ProgramCL::_StoreInCache(const std::vector<const DeviceCL*>& dev, const std::string& options) {
+		// Binaries are reported in CL_PROGRAM_DEVICES order, which may include devices we did not build for.
+		const std::vector<cl::Device> devices = _program.getInfo<CL_PROGRAM_DEVICES>();
+		const std::vector<size_t> sizes = _program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+		std::vector<std::vector<unsigned char>> bin(sizes.size());
+		std::vector<unsigned char*> ptr(sizes.size());
+		for (size_t i = 0; i < sizes.size(); i++) {
+			bin[i].resize(sizes[i]);
+			ptr[i] = sizes[i] ? bin[i].data() : nullptr;
+		}
+
+		cl_int err = clGetProgramInfo(_program(), CL_PROGRAM_BINARIES, ptr.size() * sizeof(unsigned char*), ptr.data(), nullptr);
+		if (err != CL_SUCCESS) {
+			TRACE(err, "Unable to read program binaries, cache not updated");
+			return;
+		}
+
+		for (auto d : dev) {
+			for (size_t i = 0; i < devices.size(); i++) {
+				if (devices[i]() == d->Get()() && !bin[i].empty()) {
+					_cache->Store(_cache->Key(_source, options, *d), bin[i]);
+				}
+			}
+		}
 	}
 
 	KernelCL::Ptr ProgramCL::NewKernel(const DeviceCL& d, const std::string& kernel) {
-		return std::make_shared<KernelCL>(d.Get(), Get(), kernel);
+		auto k = std::make_shared<KernelCL>(d.Get(), Get(), kernel);
+		if (_metrics) {
+			k->SetLaunchCounter(_metrics->LaunchCounter(kernel));
+		}
+		return k;
 	}
 
 	KernelCL::Ptr ProgramCL::NewKernel(const std::string& kernel) {
-		return std::make_shared<KernelCL>(Get(), kernel);
+		auto k = std::make_shared<KernelCL>(Get(), kernel);
+		if (_metrics) {
+			k->SetLaunchCounter(_metrics->LaunchCounter(kernel));
+		}
+		return k;
 	}
 
 }}
 
 
-#endif
\ No newline at end of file
+#endif
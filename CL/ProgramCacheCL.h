@@ -0,0 +1,140 @@
+#ifndef PROGRAM_CACHE_CL_H
+#define PROGRAM_CACHE_CL_H
+
+#include "CommonCL.h"
+#include "DeviceCL.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		On-disk cache of program binaries. One file per (source, options, device) key,
+		written to a temporary file first and renamed in place so readers never see a partial binary.
+	*/
+	class ProgramCacheCL {
+	public:
+		typedef std::shared_ptr<ProgramCacheCL> Ptr;
+
+		struct Stats {
+			size_t Hits;
+			size_t Misses;
+			size_t Writes;
+		};
+
+		ProgramCacheCL(const std::string& dir) : _dir(dir), _hits(0), _misses(0), _writes(0), _tmp(0) {}
+
+		std::string Key(const std::string& source, const std::string& options, const DeviceCL& d) const;
+		std::string Path(const std::string& key) const;
+
+		bool Load(const std::string& key, std::vector<unsigned char>& binary) const;
+		bool Store(const std::string& key, const std::vector<unsigned char>& binary);
+
+		Stats GetStats() const {
+			Stats s;
+			s.Hits = _hits;
+			s.Misses = _misses;
+			s.Writes = _writes;
+			return s;
+		}
+
+		static Ptr New(const std::string& dir) {
+			return std::make_shared<ProgramCacheCL>(dir);
+		}
+
+	private:
+		static unsigned long long _Hash(unsigned long long h, const std::string& s);
+
+		void _Hit() { _hits++; }
+		void _Miss() { _misses++; }
+
+		const std::string _dir;
+		std::atomic<size_t> _hits, _misses, _writes, _tmp;
+
+		friend class ProgramCL;
+		U_DISABLE_COPY_AND_ASSIGNMENT(ProgramCacheCL);
+	};
+
+	inline unsigned long long ProgramCacheCL::_Hash(unsigned long long h, const std::string& s) {
+		// FNV-1a, stable across runs and standard libraries unlike std::hash.
+		for (const char c : s) {
+			h ^= static_cast<unsigned char>(c);
+			h *= 1099511628211ULL;
+		}
+		h ^= 0xff;
+		h *= 1099511628211ULL;
+		return h;
+	}
+
+	inline std::string ProgramCacheCL::Key(const std::string& source, const std::string& options, const DeviceCL& d) const {
+		const DeviceCL::Info& info = d.GetInfo();
+
+		unsigned long long h = 14695981039346656037ULL;
+		h = _Hash(h, source);
+		h = _Hash(h, options);
+		h = _Hash(h, info.Name);
+		h = _Hash(h, info.Vendor);
+		h = _Hash(h, info.DriverVersion);
+
+		std::ostringstream key;
+		key << std::hex << h;
+		return key.str();
+	}
+
+	inline std::string ProgramCacheCL::Path(const std::string& key) const {
+		if (_dir.empty()) {
+			return key + ".clbin";
+		}
+		return _dir + "/" + key + ".clbin";
+	}
+
+	inline bool ProgramCacheCL::Load(const std::string& key, std::vector<unsigned char>& binary) const {
+		std::ifstream file(Path(key), std::ios::binary);
+		if (!file) {
+			return false;
+		}
+
+		binary.assign(
+			std::istreambuf_iterator<char>(file),
+			(std::istreambuf_iterator<char>())
+			);
+		return !binary.empty();
+	}
+
+	inline bool ProgramCacheCL::Store(const std::string& key, const std::vector<unsigned char>& binary) {
+		const std::string path = Path(key);
+
+		std::ostringstream tmp;
+		tmp << path << ".tmp." << ProcessId() << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << "." << _tmp++;
+
+		{
+			std::ofstream file(tmp.str(), std::ios::binary | std::ios::trunc);
+			if (!file) {
+				return false;
+			}
+			file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+			if (!file) {
+				std::remove(tmp.str().c_str());
+				return false;
+			}
+		}
+
+		if (std::rename(tmp.str().c_str(), path.c_str()) != 0) {
+			// POSIX rename replaces the target, so this is an I/O or permission error. On Windows it also
+			// fails when another process published the same key first.
+			std::remove(tmp.str().c_str());
+			return false;
+		}
+
+		_writes++;
+		return true;
+	}
+
+}}
+
+#endif
@@ -2,8 +2,13 @@
 #define QUEUE_CL_H
 
 #include "KernelCL.h"
+#include "ProfilerCL.h"
+#include "PixelConvert.h"
 
 #include <functional>
+#include <cstring>
+#include <atomic>
+#include <chrono>
 
 namespace GPU {
 	namespace CL {
@@ -40,113 +45,1149 @@ namespace GPU {
 		U_DISABLE_COPY_AND_ASSIGNMENT(EventCL);
 	};
 
+	/*
+		Lightweight completion handle returned by the asynchronous QueueCL operations. 
+		Pass it as the wait list of the next operation to chain, join handles with WhenAll.
+	*/
+	class FutureCL {
+	public:
+		typedef std::function<void(cl_int)> Func;
+
+		FutureCL() {}
+		FutureCL(const cl::Event& ev) { _events.push_back(ev); }
+
+		const std::vector<cl::Event>& Events() const { return _events; }
+		bool Empty() const { return _events.empty(); }
+
+		void Wait() const {
+			if (!_events.empty()) {
+				cl::Event::waitForEvents(_events);
+			}
+		}
+
+		bool IsComplete() const {
+			for (const auto& ev : _events) {
+				if (ev.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		FutureCL& And(const FutureCL& o) {
+			_events.insert(_events.end(), o._events.begin(), o._events.end());
+			return *this;
+		}
+
+		static FutureCL WhenAll(const std::vector<FutureCL>& list) {
+			FutureCL all;
+			for (const auto& f : list) {
+				all.And(f);
+			}
+			return all;
+		}
+
+		// Runs f once every event completed, with the first error status if any failed.
+		void OnComplete(const Func& f);
+
+	private:
+		struct _Pending {
+			std::atomic<size_t> Remaining;
+			std::atomic<cl_int> Status;
+			Func Callback;
+		};
+
+		const std::vector<cl::Event>* _WaitList() const { return _events.empty() ? nullptr : &_events; }
+
+		std::vector<cl::Event> _events;
+
+		friend class QueueCL;
+	};
+
+	inline void FutureCL::OnComplete(const Func& f) {
+		if (_events.empty()) {
+			f(CL_COMPLETE);
+			return;
+		}
+
+		_Pending* p = new _Pending;
+		p->Remaining = _events.size();
+		p->Status = CL_COMPLETE;
+		p->Callback = f;
+
+		for (auto& ev : _events) {
+			ev.setCallback(CL_COMPLETE, [](cl_event, cl_int status, void* data) {
+				_Pending* p = static_cast<_Pending*>(data);
+				if (status < 0) {
+					p->Status = status;
+				}
+				if (--p->Remaining == 0) {
+					p->Callback(p->Status);
+					delete p;
+				}
+			}, p);
+		}
+	}
+
+	template <typename T>
+	class BufferMapCL {
+	public:
+		typedef std::unique_ptr<BufferMapCL> UPtr;
+
+		// pin keeps a budgeted buffer resident while it is mapped.
+		BufferMapCL(const cl::CommandQueue& q, const cl::Buffer& b, T* p, size_t count, const std::shared_ptr<void>& pin = nullptr) 
+			: _queue(q), _buffer(b), _pointer(p), _count(count), _pin(pin) {}
+
+		~BufferMapCL() {
+			try {
+				Unmap();
+			} catch (const cl::Error& err) {
+				TRACE(err.err(), err.what());
+			}
+		}
+
+		T* Data() const { return _pointer; }
+		size_t Count() const { return _count; }
+
+		T& At(size_t i) { return _pointer[i]; }
+		const T& At(size_t i) const { return _pointer[i]; }
+
+		bool IsMapped() const { return _pointer != nullptr; }
+
+		void Unmap() {
+			if (_pointer) {
+				_queue.enqueueUnmapMemObject(_buffer, _pointer);
+				_pointer = nullptr;
+			}
+		}
+
+	private:
+		cl::CommandQueue _queue;
+		cl::Buffer _buffer;
+		T* _pointer;
+		size_t _count;
+		std::shared_ptr<void> _pin;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(BufferMapCL);
+	};
+
+	class ImageMapCL {
+	public:
+		typedef std::unique_ptr<ImageMapCL> UPtr;
+
+		ImageMapCL(const cl::CommandQueue& q, const cl::Image2D& img, unsigned char* p, size_t pitch, size_t width, size_t height)
+			: _queue(q), _image(img), _pointer(p), _pitch(pitch), _width(width), _height(height) {}
+
+		~ImageMapCL() {
+			try {
+				Unmap();
+			} catch (const cl::Error& err) {
+				TRACE(err.err(), err.what());
+			}
+		}
+
+		unsigned char* Data() const { return _pointer; }
+		unsigned char* Row(size_t y) const { return _pointer + y * _pitch; }
+
+		// Row pitch chosen by the driver, not necessarily the host image's.
+		size_t Pitch() const { return _pitch; }
+		size_t Width() const { return _width; }
+		size_t Height() const { return _height; }
+
+		bool IsMapped() const { return _pointer != nullptr; }
+
+		void Unmap() {
+			if (_pointer) {
+				_queue.enqueueUnmapMemObject(_image, _pointer);
+				_pointer = nullptr;
+			}
+		}
+
+	private:
+		cl::CommandQueue _queue;
+		cl::Image2D _image;
+		unsigned char* _pointer;
+		size_t _pitch;
+		size_t _width;
+		size_t _height;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(ImageMapCL);
+	};
+
 	class QueueCL {
 	public:
 		typedef std::shared_ptr<QueueCL> Ptr;
 
-		void Enqueue(const KernelCL& k) { _queue.enqueueTask(k.Get()); }
-		void Enqueue(const KernelCL& k, EventCL& ev) { _queue.enqueueTask(k.Get(), nullptr, ev.Event()); ev._Set();  }
+		// Counted whether or not the queue profiles. Bytes of mapping transfers count as uploaded or
+		// downloaded; BlockedNs is the time callers spent waiting in Finish and blocking overloads.
+		struct Stats {
+			size_t BytesUploaded;
+			size_t BytesDownloaded;
+			size_t BytesCopied;
+			size_t Commands;
+			size_t Launches;
+			size_t BlockingSyncs;
+			cl_ulong BlockedNs;
+		};
+
+		Stats GetStats() const {
+			Stats s = { _uploaded, _downloaded, _copied, _commands, _launches, _syncs, _blockedNs };
+			return s;
+		}
+
+		/*
+			How host transfers wait. Blocking returns once the transfer is done. Async returns right away
+			with the transfer's future; the host memory must stay alive and untouched until it completes.
+			FireAndForget also returns right away but keeps the storage (and a budgeted buffer's device
+			memory) alive until the transfer completes, so the caller may drop its references.
+			The plain WriteBuffer, ReadBuffer, rect and image overloads use the queue's policy, the
+			overloads taking a TransferPolicy use theirs and return the future (empty when Blocking).
+			Zero-copy transfers are a map and unmap and always complete before returning.
+		*/
+		enum TransferPolicy { Blocking, Async, FireAndForget };
+
+		TransferPolicy GetTransferPolicy() const { return _policy; }
+		void SetTransferPolicy(TransferPolicy p) { _policy = p; }
+
+		void Enqueue(const KernelCL& k) { _Serialize(); _Task(k, nullptr, nullptr); }
+		void Enqueue(const KernelCL& k, EventCL& ev) { _Serialize(); _Task(k, nullptr, ev.Event()); ev._Set();  }
+
+		FutureCL Enqueue(const KernelCL& k, const FutureCL& after) {
+			cl::Event ev;
+			_Task(k, after._WaitList(), &ev);
+			return ev;
+		}
 
 		void Enqueue(const KernelCL& k, const KernelCL::Range& r) {
-			_queue.enqueueNDRangeKernel(k.Get(), r.Offset, r.GlobalSize, r.LocalSize);
+			_Serialize();
+			_Kernel(k, r, nullptr, nullptr);
 		}
 
 		void Enqueue(const KernelCL& k, const KernelCL::Range& r, EventCL& ev) {
-			_queue.enqueueNDRangeKernel(k.Get(), r.Offset, r.GlobalSize, r.LocalSize, nullptr, ev.Event());
+			_Serialize();
+			_Kernel(k, r, nullptr, ev.Event());
 			ev._Set();
 		}
 
+		FutureCL Enqueue(const KernelCL& k, const KernelCL::Range& r, const FutureCL& after) {
+			cl::Event ev;
+			_Kernel(k, r, after._WaitList(), &ev);
+			return ev;
+		}
+
 		/**** Generic buffer operations ****/
 
 		template <typename T>
 		void FillBuffer(const BufferCL<T>& src, const T& val) {
-			_queue.enqueueFillBuffer<T>(src.Get(), val, src.DeviceBytesOffset(), src.DeviceSizeFromOffset());
+			_Serialize();
+			_Fill(src, val, nullptr, nullptr);
+		}
+
+		template <typename T>
+		FutureCL FillBuffer(const BufferCL<T>& src, const T& val, const FutureCL& after) {
+			cl::Event ev;
+			_Fill(src, val, after._WaitList(), &ev);
+			return ev;
+		}
+
+		// Single event on this queue completing after every command in after.
+		FutureCL Marker(const FutureCL& after = FutureCL()) {
+			cl::Event ev;
+			_queue.enqueueMarkerWithWaitList(after._WaitList(), &ev);
+			return ev;
+		}
+
+		// Command queue barrier, later commands start after everything enqueued before.
+		FutureCL Barrier(const FutureCL& after = FutureCL()) {
+			cl::Event ev;
+			_queue.enqueueBarrierWithWaitList(after._WaitList(), &ev);
+			return ev;
 		}
 
 		void Flush() { _queue.flush(); }
-		void Finish() { _queue.finish(); }
+		void Finish() { _Blocking b(*this); _queue.finish(); }
+
+		cl_command_queue_properties Properties() const { return _properties; }
+		bool IsOutOfOrder() const { return (_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0; }
+		bool IsProfiling() const { return (_properties & CL_QUEUE_PROFILING_ENABLE) != 0; }
+
+		// Null unless the queue was created with CL_QUEUE_PROFILING_ENABLE. Queues may share one profiler.
+		const ProfilerCL::Ptr& Profiler() const { return _profiler; }
+		void SetProfiler(const ProfilerCL::Ptr& p) {
+			if (!IsProfiling()) {
+				throw std::runtime_error("SetProfiler, queue created without CL_QUEUE_PROFILING_ENABLE.");
+			}
+			_profiler = p;
+		}
+
+		const cl::CommandQueue& Get() const { return _queue; }
 		
 		/**** Buffer write operations ****/
 
 		template <typename T>
-		void WriteBuffer(const BufferCL<T>& src) {
-			_queue.enqueueWriteBuffer(src.Get(), CL_TRUE, src.HostBytesOffset(), src.HostSizeFromOffset(), src.Data());
+		void WriteBuffer(const BufferCL<T>& src) { WriteBuffer(src, _policy); }
+
+		template <typename T>
+		FutureCL WriteBuffer(const BufferCL<T>& src, TransferPolicy p) {
+			if (src.IsZeroCopy() && !src.IsTracked()) {
+				_Blocking b(*this);
+				_Serialize();
+				_MapSync(src, CL_MAP_WRITE_INVALIDATE_REGION, true);
+				return FutureCL();
+			}
+			return _Transfer(p, { src.Host(), src.Pin() }, [&](cl_bool blocking, cl::Event* ev) {
+				_Write(src, blocking, nullptr, ev);
+			});
 		}
 
 		template <typename T>
 		void WriteBuffer(const BufferCL<T>& src, EventCL& ev) {
-			_queue.enqueueWriteBuffer(src.Get(), CL_FALSE, src.HostBytesOffset(), src.HostSizeFromOffset(), src.Data(), ev.Event());
+			_Serialize();
+			_Write(src, CL_FALSE, nullptr, ev.Event());
 			ev._Set();
 		}
 
 		template <typename T>
-		void WriteBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b) {
+		FutureCL WriteBuffer(const BufferCL<T>& src, const FutureCL& after) {
+			cl::Event ev;
+			_Write(src, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		// Uploads count elements from an arbitrary host pointer at element offset of the device buffer.
+		template <typename T>
+		FutureCL WriteBuffer(const BufferCL<T>& dst, size_t offset, const T* src, size_t count, const FutureCL& after) {
+			cl::Event ev;
+			_WriteRange(dst, offset, src, count, after._WaitList(), &ev);
+			return ev;
+		}
+
+		template <typename T>
+		void WriteBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b) { WriteBufferRect(src, b, _policy); }
+
+		template <typename T>
+		FutureCL WriteBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b, TransferPolicy p) {
+			return _Transfer(p, { src.Host(), src.Pin() }, [&](cl_bool blocking, cl::Event* ev) {
+				_WriteRect(src, b, blocking, nullptr, ev);
+			});
+		}
+
+		template <typename T>
+		FutureCL WriteBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b, const FutureCL& after) {
+			cl::Event ev;
+			_WriteRect(src, b, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		/**** Buffer read operations ****/
+
+		template <typename T>
+		void ReadBuffer(const BufferCL<T>& dst) { ReadBuffer(dst, _policy); }
+
+		template <typename T>
+		FutureCL ReadBuffer(const BufferCL<T>& dst, TransferPolicy p) {
+			if (dst.IsZeroCopy() && !dst.IsTracked()) {
+				_Blocking b(*this);
+				_Serialize();
+				_MapSync(dst, CL_MAP_READ, false);
+				return FutureCL();
+			}
+			return _Transfer(p, { dst.Host(), dst.Pin() }, [&](cl_bool blocking, cl::Event* ev) {
+				_Read(dst, blocking, nullptr, ev);
+			});
+		}
+
+		template <typename T>
+		void ReadBuffer(const BufferCL<T>& src, EventCL& ev) {
+			_Serialize();
+			_Read(src, CL_FALSE, nullptr, ev.Event());
+			ev._Set();
+		}
+
+		template <typename T>
+		FutureCL ReadBuffer(const BufferCL<T>& src, const FutureCL& after) {
+			cl::Event ev;
+			_Read(src, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		template <typename T>
+		FutureCL ReadBuffer(const BufferCL<T>& src, size_t offset, T* dst, size_t count, const FutureCL& after) {
+			cl::Event ev;
+			_ReadRange(src, offset, dst, count, after._WaitList(), &ev);
+			return ev;
+		}
+
+		template <typename T>
+		void ReadBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b) { ReadBufferRect(src, b, _policy); }
+
+		template <typename T>
+		FutureCL ReadBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b, TransferPolicy p) {
+			return _Transfer(p, { src.Host(), src.Pin() }, [&](cl_bool blocking, cl::Event* ev) {
+				_ReadRect(src, b, blocking, nullptr, ev);
+			});
+		}
+
+		template <typename T>
+		FutureCL ReadBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b, const FutureCL& after) {
+			cl::Event ev;
+			_ReadRect(src, b, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		/*Buffer copy operations */
+
+		template <typename T> 
+		void CopyBuffer(const BufferCL<T>& src, BufferCL<T>& dest, const size_t& s = 0) {
+			_Serialize();
+			_Copy(src, dest, s, nullptr, nullptr);
+		}
+
+		// Plain copies never wait for the device; Blocking waits, FireAndForget keeps both buffers resident.
+		template <typename T>
+		FutureCL CopyBuffer(const BufferCL<T>& src, BufferCL<T>& dest, TransferPolicy p, const size_t& s = 0) {
+			return _Transfer(p, { src.Pin(), dest.Pin() }, [&](cl_bool blocking, cl::Event* ev) {
+				cl::Event done;
+				_Copy(src, dest, s, nullptr, ev ? ev : &done);
+				if (blocking) {
+					done.wait();
+				}
+			});
+		}
+
+		template <typename T> 
+		FutureCL CopyBuffer(const BufferCL<T>& src, BufferCL<T>& dest, const FutureCL& after, const size_t& s = 0) {
+			cl::Event ev;
+			_Copy(src, dest, s, after._WaitList(), &ev);
+			return ev;
+		}
+
+		template <typename T>
+		void CopyBufferRect(const BufferCL<T>& src, BufferCL<T>& dest, const BufferRectCL<T>& b) {
+			_Serialize();
+			_CopyRect(src, dest, b, nullptr, nullptr);
+		}
+
+		template <typename T>
+		FutureCL CopyBufferRect(const BufferCL<T>& src, BufferCL<T>& dest, const BufferRectCL<T>& b, TransferPolicy p) {
+			return _Transfer(p, { src.Pin(), dest.Pin() }, [&](cl_bool blocking, cl::Event* ev) {
+				cl::Event done;
+				_CopyRect(src, dest, b, nullptr, ev ? ev : &done);
+				if (blocking) {
+					done.wait();
+				}
+			});
+		}
+
+		template <typename T>
+		FutureCL CopyBufferRect(const BufferCL<T>& src, BufferCL<T>& dest, const BufferRectCL<T>& b, const FutureCL& after) {
+			cl::Event ev;
+			_CopyRect(src, dest, b, after._WaitList(), &ev);
+			return ev;
+		}
+
+		/**** Mapping operations ****/
+
+		template <typename T>
+		typename BufferMapCL<T>::UPtr Map(const BufferCL<T>& b, cl_map_flags f = CL_MAP_READ | CL_MAP_WRITE, const FutureCL& after = FutureCL()) {
+			_Blocking blocking(*this);
+			const std::shared_ptr<void> pin = b.Pin();
+			const cl::Buffer buffer = b.Get();
+			cl::Event local;
+			cl::Event* ev = _Track(nullptr, local);
+			T* p = static_cast<T*>(_queue.enqueueMapBuffer(buffer, CL_TRUE, f, b.DeviceBytesOffset(), b.DeviceSizeFromOffset(), after._WaitList(), ev));
+			_Record("map", "", b.DeviceSizeFromOffset(), ev);
+			if (f & (CL_MAP_WRITE | CL_MAP_WRITE_INVALIDATE_REGION)) {
+				b.MarkDeviceDirty();
+			}
+			return typename BufferMapCL<T>::UPtr(new BufferMapCL<T>(_queue, buffer, p, b.DeviceSizeFromOffset() / sizeof(T), pin));
+		}
+
+		template <typename T>
+		void Unmap(BufferMapCL<T>& m) { m.Unmap(); }
+
+		ImageMapCL::UPtr Map(const ImageCL& img, cl_map_flags f = CL_MAP_READ | CL_MAP_WRITE, const FutureCL& after = FutureCL()) {
+			_Blocking b(*this);
+			cl::Event local;
+			cl::Event* ev = _Track(nullptr, local);
+			size_t pitch = 0, slice = 0;
+			void* p = _queue.enqueueMapImage(img.Get(), CL_TRUE, f, img.Origin(), img.Region(), &pitch, &slice, after._WaitList(), ev);
+			_Record("map_image", "", img.Bytes(), ev);
+			return ImageMapCL::UPtr(new ImageMapCL(_queue, img.Get(), static_cast<unsigned char*>(p), pitch, img.Width(), img.Height()));
+		}
+
+		void Unmap(ImageMapCL& m) { m.Unmap(); }
+
+		/**** Converting transfers, see PixelConvert ****/
+
+		// The host image is converted into the buffer's storage, then uploaded.
+		template <typename T>
+		void WriteBuffer(const BufferCL<T>& dst, const Image& src, PixelConvert::Stage s) {
+			if (dst.HostSizeFromOffset() < PixelConvert::StagedSize(src, s)) {
+				throw std::runtime_error("WriteBuffer, buffer smaller than the converted image.");
+			}
+			PixelConvert::Upload(src, s, dst.Data());
+			dst.MarkHostDirty(0, (PixelConvert::StagedSize(src, s) + sizeof(T) - 1) / sizeof(T));
+			WriteBuffer(dst);
+		}
+
+		template <typename T>
+		void ReadBuffer(const BufferCL<T>& src, const Image& dst, PixelConvert::Stage s) {
+			if (src.HostSizeFromOffset() < PixelConvert::StagedSize(dst, s)) {
+				throw std::runtime_error("ReadBuffer, buffer smaller than the converted image.");
+			}
+			ReadBuffer(src, Blocking);
+			PixelConvert::Download(src.Data(), s, dst);
+		}
+
+		// Converted through a staging copy, the host image itself is not modified. ToFloat4 needs a CL_FLOAT RGBA image.
+		void WriteImage(const ImageCL& img, PixelConvert::Stage s) {
+			_Stage(img, s);
+			PixelConvert::Upload(img.Host(), s, _staging.data());
+			_Blocking b(*this);
+			_Serialize();
+			cl::Event local; cl::Event* ev = _Track(nullptr, local);
+			_queue.enqueueWriteImage(img.Get(), CL_TRUE, img.Origin(), img.Region(), 0, 0, _staging.data(), nullptr, ev);
+			_Record("write_image", "", img.Bytes(), ev);
+		}
+
+		void ReadImage(const ImageCL& img, PixelConvert::Stage s) {
+			_Stage(img, s);
+			{
+				_Blocking b(*this);
+				_Serialize();
+				cl::Event local; cl::Event* ev = _Track(nullptr, local);
+				_queue.enqueueReadImage(img.Get(), CL_TRUE, img.Origin(), img.Region(), 0, 0, _staging.data(), nullptr, ev);
+				_Record("read_image", "", img.Bytes(), ev);
+			}
+			PixelConvert::Download(_staging.data(), s, img.Host());
+		}
+
+		/**** Reduced precision transfers, see PackedBufferCL ****/
+
+		// Packs the host floats on the calling thread, then uploads the packed bytes.
+		void WriteBuffer(PackedBufferCL& dst) {
+			dst.Pack();
+			_Blocking b(*this);
+			_Serialize();
+			_WritePacked(dst, CL_TRUE, nullptr, nullptr);
+		}
+
+		// The packing is done before returning, only the upload is asynchronous.
+		// dst must not be packed again until the returned future completes.
+		FutureCL WriteBuffer(PackedBufferCL& dst, const FutureCL& after) {
+			dst.Pack();
+			cl::Event ev;
+			_WritePacked(dst, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		void ReadBuffer(PackedBufferCL& src) {
+			{
+				_Blocking b(*this);
+				_Serialize();
+				cl::Event local; cl::Event* ev = _Track(nullptr, local);
+				_queue.enqueueReadBuffer(src.Get(), CL_TRUE, 0, src.Bytes(), src.Packed(), nullptr, ev);
+				_Record("read_packed", "", src.Bytes(), ev);
+			}
+			src.Unpack();
+		}
+
+		/**** Image operations ****/
+
+		void WriteImage(const ImageCL& img) { WriteImage(img, _policy); }
+
+		FutureCL WriteImage(const ImageCL& img, TransferPolicy p) {
+			if (img.IsZeroCopy()) {
+				_Blocking b(*this);
+				_Serialize();
+				_MapSync(img, CL_MAP_WRITE_INVALIDATE_REGION, true);
+				return FutureCL();
+			}
+			return _Transfer(p, { img.HostPointer() }, [&](cl_bool blocking, cl::Event* ev) {
+				_WriteImage(img, blocking, nullptr, ev);
+			});
+		}
+
+		FutureCL WriteImage(const ImageCL& img, const FutureCL& after) {
+			cl::Event ev;
+			_WriteImage(img, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		void ReadImage(const ImageCL& img) { ReadImage(img, _policy); }
+
+		FutureCL ReadImage(const ImageCL& img, TransferPolicy p) {
+			if (img.IsZeroCopy()) {
+				_Blocking b(*this);
+				_Serialize();
+				_MapSync(img, CL_MAP_READ, false);
+				return FutureCL();
+			}
+			return _Transfer(p, { img.HostPointer() }, [&](cl_bool blocking, cl::Event* ev) {
+				_ReadImage(img, blocking, nullptr, ev);
+			});
+		}
+
+		FutureCL ReadImage(const ImageCL& img, const FutureCL& after) {
+			cl::Event ev;
+			_ReadImage(img, CL_FALSE, after._WaitList(), &ev);
+			return ev;
+		}
+
+		void CopyImage(const ImageCL& src, ImageCL& dest) {
+			_Serialize();
+			_CopyImage(src, dest, nullptr, nullptr);
+		}
+
+		FutureCL CopyImage(const ImageCL& src, ImageCL& dest, const FutureCL& after) {
+			cl::Event ev;
+			_CopyImage(src, dest, after._WaitList(), &ev);
+			return ev;
+		}
+
+		// Buffers hold the image tightly packed, row after row.
+		template <typename T>
+		void CopyImageToBuffer(const ImageCL& src, BufferCL<T>& dest) {
+			_Serialize();
+			_CopyImageToBuffer(src, dest, nullptr, nullptr);
+		}
+
+		template <typename T>
+		FutureCL CopyImageToBuffer(const ImageCL& src, BufferCL<T>& dest, const FutureCL& after) {
+			cl::Event ev;
+			_CopyImageToBuffer(src, dest, after._WaitList(), &ev);
+			return ev;
+		}
+
+		template <typename T>
+		void CopyBufferToImage(const BufferCL<T>& src, ImageCL& dest) {
+			_Serialize();
+			_CopyBufferToImage(src, dest, nullptr, nullptr);
+		}
+
+		template <typename T>
+		FutureCL CopyBufferToImage(const BufferCL<T>& src, ImageCL& dest, const FutureCL& after) {
+			cl::Event ev;
+			_CopyBufferToImage(src, dest, after._WaitList(), &ev);
+			return ev;
+		}
+
+	private: 
+		typedef std::vector<cl::Event> _Events;
+
+		void _Task(const KernelCL& k, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, k);
+			k.Restore();
+			_Events uploads;
+			wait = _Acquire(k, wait, uploads);
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueTask(k.Get(), wait, ev);
+			_Record("kernel", k.Name(), 0, ev);
+			_Launched(k);
+			_Release(k);
+			_Keep(pins, ev);
+		}
+
+		void _Kernel(const KernelCL& k, const KernelCL::Range& r, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, k);
+			k.Restore();
+			_Events uploads;
+			wait = _Acquire(k, wait, uploads);
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueNDRangeKernel(k.Get(), r.Offset, r.GlobalSize, k.LocalSizeFor(r), wait, ev);
+			_Record("kernel", k.Name(), 0, ev);
+			_Launched(k);
+			_Release(k);
+			_Keep(pins, ev);
+		}
+
+		/**** Residency, see BufferCL::Track ****/
+
+		// Uploads the host changes of every tracked argument; the launch then waits on those transfers.
+		const _Events* _Acquire(const KernelCL& k, const _Events* wait, _Events& uploads) {
+			for (const auto& b : k.Bindings()) {
+				if (b.second.Residency) {
+					_Sync(*b.second.Residency, true, b.second.Offset, b.second.Bytes, wait, uploads);
+				}
+			}
+			return uploads.empty() ? wait : &uploads;
+		}
+
+		// The kernel may have written anywhere in its writable arguments.
+		void _Release(const KernelCL& k) {
+			for (const auto& b : k.Bindings()) {
+				if (b.second.Residency && b.second.Writes) {
+					b.second.Residency->MarkDeviceDirty(b.second.Offset, b.second.Bytes);
+				} else if (b.second.Allocation && b.second.Writes) {
+					b.second.Allocation->MarkDeviceNewer();
+				}
+			}
+		}
+
+		// Moves the dirty ranges within [offset, offset + bytes) to the other side, transfers are appended to done.
+		void _Sync(ResidencyCL& r, bool toDevice, size_t offset, size_t bytes, const _Events* wait, _Events& done) {
+			const std::vector<ResidencyCL::Range> ranges = toDevice ? r.TakeHostDirty(offset, offset + bytes) : r.TakeDeviceDirty(offset, offset + bytes);
+			for (const auto& range : ranges) {
+				const size_t size = range.second - range.first;
+				char* host = r.Host() + range.first;
+				if (r.IsZeroCopy()) {
+					done.push_back(_MapSync(r.Buffer(), host, range.first, size, toDevice ? CL_MAP_WRITE_INVALIDATE_REGION : CL_MAP_READ, toDevice, wait));
+					continue;
+				}
+
+				cl::Event ev;
+				if (toDevice) {
+					_queue.enqueueWriteBuffer(r.Buffer(), CL_FALSE, range.first, size, host, wait, &ev);
+				} else {
+					_queue.enqueueReadBuffer(r.Buffer(), CL_FALSE, range.first, size, host, wait, &ev);
+				}
+				_Record(toDevice ? "write_dirty" : "read_dirty", "", size, &ev);
+				done.push_back(ev);
+			}
+		}
+
+		// Tracked counterpart of _Write and _Read: ev completes once every dirty range moved.
+		void _Sync(ResidencyCL& r, bool toDevice, size_t offset, size_t bytes, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Events done;
+			_Sync(r, toDevice, offset, bytes, wait, done);
+			if (ev) {
+				_queue.enqueueMarkerWithWaitList(done.empty() ? wait : &done, ev);
+			}
+			if (blocking && !done.empty()) {
+				cl::Event::waitForEvents(done);
+			}
+		}
+
+		template <typename T>
+		void _Fill(const BufferCL<T>& src, const T& val, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, src);
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueFillBuffer<T>(src.Get(), val, src.DeviceBytesOffset(), src.DeviceSizeFromOffset(), wait, ev);
+			_Record("fill", "", src.DeviceSizeFromOffset(), ev);
+			src.MarkDeviceDirty();
+			_Keep(pins, ev);
+		}
+
+		template <typename T>
+		void _Write(const BufferCL<T>& src, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, src);
+			cl::Event local; ev = _Track(ev, local, pins);
+			if (src.IsTracked()) {
+				src.Get(); // Restores an evicted buffer before its dirty ranges go up.
+				_Sync(*src.Residency(), true, src.HostBytesOffset(), src.Size(), blocking, wait, ev);
+			} else {
+				_queue.enqueueWriteBuffer(src.Get(), blocking, src.DeviceBytesOffset(), src.Size(), src.Data(), wait, ev);
+				_Record("write", "", src.Size(), ev);
+				src.MarkHostCurrent();
+			}
+			_Keep(pins, ev);
+		}
+
+		void _WritePacked(PackedBufferCL& dst, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			cl::Event local; ev = _Track(ev, local);
+			_queue.enqueueWriteBuffer(dst.Get(), blocking, 0, dst.Bytes(), dst.Packed(), wait, ev);
+			_Record("write_packed", "", dst.Bytes(), ev);
+		}
+
+		// The range comes from outside the storage, so the storage is stale there.
+		template <typename T>
+		void _WriteRange(const BufferCL<T>& dst, size_t offset, const T* src, size_t count, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, dst);
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueWriteBuffer(dst.Get(), CL_FALSE, dst.DeviceBytesOffset() + offset * sizeof(T), count * sizeof(T), src, wait, ev);
+			_Record("write", "", count * sizeof(T), ev);
+			dst.MarkDeviceDirty(offset, count);
+			_Keep(pins, ev);
+		}
+
+		template <typename T>
+		void _WriteRect(const BufferCL<T>& src, const BufferRectCL<T>& b, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, src);
+			cl::Event local; ev = _Track(ev, local, pins);
 			_queue.enqueueWriteBufferRect(
-				src.Get(), CL_TRUE,
-				b.DeviceOrigin(), b.HostOrigin(),
+				src.Get(), blocking,
+				_Origin(b.DeviceOrigin(), src.DeviceBytesOffset()), b.HostOrigin(),
 				b.Region,
 				b.DeviceRow, b.DeviceSlice,
 				b.HostRow, b.HostSlice,
-				src.Data()
+				src.Data(),
+				wait, ev
 			);
+			_Record("write_rect", "", _Bytes(b), ev);
+			_Keep(pins, ev);
 		}
 
-		/**** Buffer read operations ****/
-
 		template <typename T>
-		void ReadBuffer(const BufferCL<T>& dst) {
-			_queue.enqueueReadBuffer(dst.Get(), CL_TRUE, dst.DeviceBytesOffset(), dst.DeviceSizeFromOffset(), dst.Data());
+		void _Read(const BufferCL<T>& dst, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, dst);
+			cl::Event local; ev = _Track(ev, local, pins);
+			if (dst.IsTracked()) {
+				_Sync(*dst.Residency(), false, dst.HostBytesOffset(), dst.Size(), blocking, wait, ev);
+			} else {
+				_queue.enqueueReadBuffer(dst.Get(), blocking, dst.DeviceBytesOffset(), dst.Size(), dst.Data(), wait, ev);
+				_Record("read", "", dst.Size(), ev);
+				dst.MarkHostCurrent();
+			}
+			_Keep(pins, ev);
 		}
 
+		// Host changes within the range go up first, the read then sees them.
 		template <typename T>
-		void ReadBuffer(const BufferCL<T>& src, EventCL& ev) {
-			_queue.enqueueReadBuffer(src.Get(), CL_FALSE, src.DeviceBytesOffset(), src.DeviceSizeFromOffset(), src.Data(), ev.Event());
-			ev._Set();
+		void _ReadRange(const BufferCL<T>& src, size_t offset, T* dst, size_t count, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, src);
+			const cl::Buffer buffer = src.Get();
+			_Events uploads;
+			if (src.IsTracked()) {
+				_Sync(*src.Residency(), true, src.HostBytesOffset() + offset * sizeof(T), count * sizeof(T), wait, uploads);
+				wait = uploads.empty() ? wait : &uploads;
+			}
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueReadBuffer(buffer, CL_FALSE, src.DeviceBytesOffset() + offset * sizeof(T), count * sizeof(T), dst, wait, ev);
+			_Record("read", "", count * sizeof(T), ev);
+			_Keep(pins, ev);
 		}
 
 		template <typename T>
-		void ReadBufferRect(const BufferCL<T>& src, const BufferRectCL<T>& b) {
+		void _ReadRect(const BufferCL<T>& src, const BufferRectCL<T>& b, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, src);
+			cl::Event local; ev = _Track(ev, local, pins);
 			_queue.enqueueReadBufferRect(
-				src.Get(), CL_TRUE,
-				b.DeviceOrigin(), b.HostOrigin(),
+				src.Get(), blocking,
+				_Origin(b.DeviceOrigin(), src.DeviceBytesOffset()), b.HostOrigin(),
 				b.Region,
 				b.DeviceRow, b.DeviceSlice,
 				b.HostRow, b.HostSlice,
-				src.Data()
+				src.Data(),
+				wait, ev
 			);
+			_Record("read_rect", "", _Bytes(b), ev);
+			_Keep(pins, ev);
 		}
 
-		/*Buffer copy operations */
-
 		template <typename T> 
-		void CopyBuffer(const BufferCL<T>& src, BufferCL<T>& dest, const size_t& s = 0) {
+		void _Copy(const BufferCL<T>& src, BufferCL<T>& dest, size_t s, const _Events* wait, cl::Event* ev) {
+			// Both are pinned before either is restored, restoring one must not evict the other.
+			_Pins pins;
+			_Pin(pins, src, dest);
+			const cl::Buffer from = src.Get(), to = dest.Get();
+			_Events uploads;
+			if (src.IsTracked()) {
+				_Sync(*src.Residency(), true, src.HostBytesOffset(), src.Size(), wait, uploads);
+				wait = uploads.empty() ? wait : &uploads;
+			}
+			cl::Event local; ev = _Track(ev, local, pins);
+			const size_t bytes = s ? s : src.DeviceSizeFromOffset();
 			_queue.enqueueCopyBuffer(
-				src.Get(), 
-				dest.Get(), 
+				from, 
+				to, 
 				src.DeviceBytesOffset(), 
 				dest.DeviceBytesOffset(), 
-				s ? s : src.DeviceSizeFromOffset()
+				bytes,
+				wait, ev
 			);
+			_Record("copy", "", bytes, ev);
+			dest.MarkDeviceDirty(0, bytes / sizeof(T));
+			_Keep(pins, ev);
 		}
 
 		template <typename T>
-		void CopyBufferRect(const BufferCL<T>& src, BufferCL<T>& dest, const BufferRectCL<T>& b) {
+		void _CopyRect(const BufferCL<T>& src, BufferCL<T>& dest, const BufferRectCL<T>& b, const _Events* wait, cl::Event* ev) {
+			_Pins pins;
+			_Pin(pins, src, dest);
+			const cl::Buffer from = src.Get(), to = dest.Get();
+			cl::Event local; ev = _Track(ev, local, pins);
 			_queue.enqueueCopyBufferRect(
-				src.Get(),
-				dest.Get(),
-				b.DeviceOrigin(), b.HostOrigin(),
+				from,
+				to,
+				_Origin(b.DeviceOrigin(), src.DeviceBytesOffset()), _Origin(b.HostOrigin(), dest.DeviceBytesOffset()),
 				b.Region,
 				b.DeviceRow, b.DeviceSlice,
-				b.HostRow, b.HostSlice
+				b.HostRow, b.HostSlice,
+				wait, ev
 			);
+			_Record("copy_rect", "", _Bytes(b), ev);
+			_MarkRows(dest, b);
+			_Keep(pins, ev);
 		}
 
-	private: 
-		QueueCL(const cl::Context& c, const cl::Device& dev) {
-			_queue = cl::CommandQueue(c, dev);
+		void _WriteImage(const ImageCL& img, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Unconverted(img);
+			cl::Event local; ev = _Track(ev, local);
+			_queue.enqueueWriteImage(img.Get(), blocking, img.Origin(), img.Region(), img.Pitch(), 0, img.Bits(), wait, ev);
+			_Record("write_image", "", img.Bytes(), ev);
+		}
+
+		void _ReadImage(const ImageCL& img, cl_bool blocking, const _Events* wait, cl::Event* ev) {
+			_Unconverted(img);
+			cl::Event local; ev = _Track(ev, local);
+			_queue.enqueueReadImage(img.Get(), blocking, img.Origin(), img.Region(), img.Pitch(), 0, img.Bits(), wait, ev);
+			_Record("read_image", "", img.Bytes(), ev);
+		}
+
+		void _CopyImage(const ImageCL& src, ImageCL& dest, const _Events* wait, cl::Event* ev) {
+			cl::Event local; ev = _Track(ev, local);
+			_queue.enqueueCopyImage(src.Get(), dest.Get(), src.Origin(), dest.Origin(), src.Region(), wait, ev);
+			_Record("copy_image", "", src.Bytes(), ev);
+		}
+
+		template <typename T>
+		void _CopyImageToBuffer(const ImageCL& src, BufferCL<T>& dest, const _Events* wait, cl::Event* ev) {
+			if (dest.DeviceSizeFromOffset() < src.Bytes()) {
+				throw std::runtime_error("CopyImageToBuffer, buffer smaller than the image.");
+			}
+			_Pins pins;
+			_Pin(pins, dest);
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueCopyImageToBuffer(src.Get(), dest.Get(), src.Origin(), src.Region(), dest.DeviceBytesOffset(), wait, ev);
+			_Record("copy_image", "", src.Bytes(), ev);
+			dest.MarkDeviceDirty(0, (src.Bytes() + sizeof(T) - 1) / sizeof(T));
+			_Keep(pins, ev);
+		}
+
+		template <typename T>
+		void _CopyBufferToImage(const BufferCL<T>& src, ImageCL& dest, const _Events* wait, cl::Event* ev) {
+			if (src.DeviceSizeFromOffset() < dest.Bytes()) {
+				throw std::runtime_error("CopyBufferToImage, buffer smaller than the image.");
+			}
+			_Pins pins;
+			_Pin(pins, src);
+			cl::Event local; ev = _Track(ev, local, pins);
+			_queue.enqueueCopyBufferToImage(src.Get(), dest.Get(), src.DeviceBytesOffset(), dest.Origin(), dest.Region(), wait, ev);
+			_Record("copy_image", "", dest.Bytes(), ev);
+			_Keep(pins, ev);
+		}
+
+		// PixelConvert reads and writes RGBA8 host images.
+		void _Stage(const ImageCL& img, PixelConvert::Stage s) {
+			if (s == PixelConvert::ToPlanar || img.HostPixelSize() != 4 || PixelConvert::StagedSize(img.Host(), s) != img.Bytes()) {
+				throw std::runtime_error("ImageCL, conversion does not match the image format.");
+			}
+			_staging.resize(img.Bytes());
+		}
+
+		// Plain transfers move device format bytes, a converted host image is smaller than that.
+		static void _Unconverted(const ImageCL& img) {
+			if (img.IsConverted()) {
+				throw std::runtime_error("ImageCL, host image in another format, use a PixelConvert transfer.");
+			}
+		}
+
+		// Blocking: returns once the image is unmapped, so the device sees the host bytes (and vice versa).
+		void _MapSync(const ImageCL& img, cl_map_flags f, bool toDevice) {
+			_Unconverted(img);
+			size_t pitch = 0, slice = 0;
+			cl::Event local; cl::Event* ev = _Track(nullptr, local);
+			unsigned char* p = static_cast<unsigned char*>(
+				_queue.enqueueMapImage(img.Get(), CL_TRUE, f, img.Origin(), img.Region(), &pitch, &slice, nullptr, ev));
+			_Record("map_image", "", img.Bytes(), ev);
+			_Add(toDevice ? _uploaded : _downloaded, img.Bytes());
+			if (p != img.Bits()) {
+				const size_t row = img.Width() * img.PixelSize();
+				for (size_t y = 0; y < img.Height(); y++) {
+					unsigned char* host = img.Bits() + y * img.Pitch();
+					toDevice ? std::memcpy(p + y * pitch, host, row) : std::memcpy(host, p + y * pitch, row);
+				}
+			}
+			cl::Event unmapped;
+			_queue.enqueueUnmapMemObject(img.Get(), p, nullptr, &unmapped);
+			unmapped.wait();
+		}
+
+		// Zero-copy buffers alias their storage, so a map/unmap pair is enough to make either side coherent.
+		// Blocking like the image overload.
+		template <typename T>
+		void _MapSync(const BufferCL<T>& b, cl_map_flags f, bool toDevice) {
+			const std::shared_ptr<void> pin = b.Pin();
+			_MapSync(b.Get(), reinterpret_cast<char*>(b.Data()), b.DeviceBytesOffset(), b.Size(), f, toDevice, nullptr).wait();
+			b.MarkHostCurrent();
+		}
+
+		// Returns the unmap, the transfer is only complete once it is.
+		cl::Event _MapSync(const cl::Buffer& b, char* host, size_t offset, size_t size, cl_map_flags f, bool toDevice, const _Events* wait) {
+			cl::Event local; cl::Event* ev = _Track(nullptr, local);
+			void* p = _queue.enqueueMapBuffer(b, CL_TRUE, f, offset, size, wait, ev);
+			_Record("map", "", size, ev);
+			_Add(toDevice ? _uploaded : _downloaded, size);
+			if (p != host) {
+				toDevice ? std::memcpy(p, host, size) : std::memcpy(host, p, size);
+			}
+			cl::Event unmapped;
+			_queue.enqueueUnmapMemObject(b, p, nullptr, &unmapped);
+			return unmapped;
+		}
+
+		// Offset views start inside their buffer; the linear offset is origin[2] * slice + origin[1] * row + origin[0].
+		static cl::size_t<3> _Origin(const cl::size_t<3>& o, size_t offset) {
+			cl::size_t<3> r = o;
+			r[0] += offset;
+			return r;
+		}
+
+		template <typename T>
+		static size_t _Bytes(const BufferRectCL<T>& b) { return b.Region[0] * b.Region[1] * b.Region[2]; }
+
+		// Profiling needs an event even when the caller did not ask for one.
+		cl::Event* _Track(cl::Event* ev, cl::Event& local) const {
+			return ev || !_profiler ? ev : &local;
+		}
+
+		/**** Budgeted operands, see MemoryBudgetCL ****/
+
+		// Pinned from before Get() until the command is enqueued. Evictions are ordered after commands
+		// of the budget's own queue only, on any other queue the pins are held until completion.
+		struct _Pins {
+			_Pins() : Hold(false) {}
+
+			std::vector<std::shared_ptr<void>> List;
+			bool Hold;
+		};
+
+		void _Pin(_Pins& p, const AllocationCL::Ptr& a) const {
+			if (a) {
+				p.List.push_back(a->Pin());
+				p.Hold = p.Hold || !a->IsOrderedOn(_queue);
+			}
+		}
+
+		template <typename T>
+		void _Pin(_Pins& p, const BufferCL<T>& b) const { _Pin(p, b.Allocation()); }
+
+		template <typename T>
+		void _Pin(_Pins& p, const BufferCL<T>& a, const BufferCL<T>& b) const {
+			_Pin(p, a);
+			_Pin(p, b);
+		}
+
+		void _Pin(_Pins& p, const KernelCL& k) const {
+			for (const auto& b : k.Bindings()) {
+				_Pin(p, b.second.Allocation);
+			}
+		}
+
+		// Held pins need an event to be released by.
+		cl::Event* _Track(cl::Event* ev, cl::Event& local, const _Pins& p) const {
+			return ev || !p.Hold ? _Track(ev, local) : &local;
+		}
+
+		void _Keep(const _Pins& p, const cl::Event* ev) const {
+			if (p.Hold && ev) {
+				const std::vector<std::shared_ptr<void>> list = p.List;
+				FutureCL(*ev).OnComplete([list](cl_int) {});
+			}
+		}
+
+		// Marks the destination rows of a rectangle copy dirty on the device, the gaps between them stay clean.
+		template <typename T>
+		static void _MarkRows(const BufferCL<T>& dest, const BufferRectCL<T>& b) {
+			const size_t row = b.HostRow ? b.HostRow : b.Region[0];
+			const size_t slice = b.HostSlice ? b.HostSlice : row * b.Region[1];
+			const cl::size_t<3> o = b.HostOrigin();
+			for (size_t z = 0; z < b.Region[2]; z++) {
+				for (size_t y = 0; y < b.Region[1]; y++) {
+					const size_t first = (o[2] + z) * slice + (o[1] + y) * row + o[0];
+					const size_t last = first + b.Region[0];
+					dest.MarkDeviceDirty(first / sizeof(T), (last + sizeof(T) - 1) / sizeof(T) - first / sizeof(T));
+				}
+			}
+		}
+
+		void _Record(const char* kind, const std::string& name, size_t bytes, const cl::Event* ev) {
+			_Count(kind, bytes);
+			if (_profiler && ev) {
+				_profiler->Add(this, kind, name, bytes, *ev);
+			}
+		}
+
+		// Write, read and copy kinds move bytes; maps are counted by _MapSync, which knows the direction.
+		void _Count(const char* kind, size_t bytes) {
+			_Add(_commands, 1);
+			switch (kind[0]) {
+			case 'w': _Add(_uploaded, bytes); break;
+			case 'r': _Add(_downloaded, bytes); break;
+			case 'c': _Add(_copied, bytes); break;
+			default: break;
+			}
+		}
+
+		void _Launched(const KernelCL& k) {
+			_Add(_launches, 1);
+			k._Launched();
+		}
+
+		// Statistics only, nothing is ordered by them.
+		template <typename T, typename N>
+		static void _Add(std::atomic<T>& counter, N n) { counter.fetch_add(static_cast<T>(n), std::memory_order_relaxed); }
+
+		// Counts one blocking sync point and the time the caller spends in it.
+		struct _Blocking {
+			_Blocking(QueueCL& q) : Queue(q), Start(std::chrono::steady_clock::now()) {}
+			~_Blocking() {
+				const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count();
+				_Add(Queue._syncs, 1);
+				_Add(Queue._blockedNs, ns);
+			}
+
+			QueueCL& Queue;
+			const std::chrono::steady_clock::time_point Start;
+		};
+
+		// Runs enqueue(blocking, ev) after the legacy barrier. Fire and forget transfers hold keep until
+		// they complete and are flushed, so they complete without a later Flush or Finish.
+		template <typename F>
+		FutureCL _Transfer(TransferPolicy p, const std::vector<std::shared_ptr<void>>& keep, F enqueue) {
+			if (p == Blocking) {
+				_Blocking b(*this);
+				_Serialize();
+				enqueue(CL_TRUE, nullptr);
+				return FutureCL();
+			}
+
+			cl::Event ev;
+			_Serialize();
+			enqueue(CL_FALSE, &ev);
+			FutureCL f(ev);
+			if (p == FireAndForget) {
+				f.OnComplete([keep](cl_int) {});
+				_queue.flush();
+			}
+			return f;
+		}
+
+		// Legacy overloads keep program order on out-of-order queues.
+		void _Serialize() {
+			if (IsOutOfOrder()) {
+				_queue.enqueueBarrierWithWaitList();
+			}
+		}
+
+		QueueCL(const cl::Context& c, const cl::Device& dev, cl_command_queue_properties p = 0)
+			: _properties(p), _policy(Blocking), _uploaded(0), _downloaded(0), _copied(0), _commands(0), _launches(0), _syncs(0), _blockedNs(0) {
+			_queue = cl::CommandQueue(c, dev, p);
+			if (IsProfiling()) {
+				_profiler = ProfilerCL::New();
+			}
 		}
 
 		cl::CommandQueue _queue;
+		cl_command_queue_properties _properties;
+		TransferPolicy _policy;
+		ProfilerCL::Ptr _profiler;
+
+		std::atomic<size_t> _uploaded, _downloaded, _copied, _commands, _launches, _syncs;
+		std::atomic<cl_ulong> _blockedNs;
+
+		// Reused by converting image transfers, which are blocking.
+		std::vector<unsigned char> _staging;
 
 		friend class DeviceCL;
 		U_DISABLE_COPY_AND_ASSIGNMENT(QueueCL);
@@ -0,0 +1,174 @@
+#ifndef RESIDENCY_CL_H
+#define RESIDENCY_CL_H
+
+#include "CommonCL.h"
+
+#include <map>
+#include <mutex>
+
+namespace GPU {
+	namespace CL {
+
+	/*
+		Which side of a tracked buffer holds the latest bytes. Ranges are byte offsets from the start of
+		the host storage, kept sorted and merged. The two sets never overlap: marking a range dirty on
+		one side drops it from the other. QueueCL moves only these ranges (see BufferCL::Track).
+	*/
+	class ResidencyCL {
+	public:
+		typedef std::shared_ptr<ResidencyCL> Ptr;
+		typedef std::pair<size_t, size_t> Range; // [first, second)
+
+		ResidencyCL(const cl::Buffer& b, char* host, size_t bytes, bool zeroCopy)
+			: _buffer(b), _host(host), _bytes(bytes), _zeroCopy(zeroCopy) {}
+
+		cl::Buffer Buffer() const { std::lock_guard<std::mutex> lock(_mutex); return _buffer; }
+
+		// Evicted and restored buffers (see MemoryBudgetCL) get a new device buffer.
+		void Rebind(const cl::Buffer& b) { std::lock_guard<std::mutex> lock(_mutex); _buffer = b; }
+		char* Host() const { return _host; }
+		size_t Bytes() const { return _bytes; }
+		bool IsZeroCopy() const { return _zeroCopy; }
+
+		void MarkHostDirty(size_t offset, size_t bytes) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_Mark(_hostDirty, _deviceDirty, offset, bytes);
+		}
+
+		void MarkDeviceDirty(size_t offset, size_t bytes) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_Mark(_deviceDirty, _hostDirty, offset, bytes);
+		}
+
+		void MarkHostDirty() { MarkHostDirty(0, _bytes); }
+		void MarkDeviceDirty() { MarkDeviceDirty(0, _bytes); }
+
+		// Returns the ranges to upload (download) within [first, last) and considers them clean from now on.
+		std::vector<Range> TakeHostDirty(size_t first = 0, size_t last = ~size_t(0)) { return _Take(_hostDirty, first, last); }
+		std::vector<Range> TakeDeviceDirty(size_t first = 0, size_t last = ~size_t(0)) { return _Take(_deviceDirty, first, last); }
+
+		bool IsHostCurrent() const { std::lock_guard<std::mutex> lock(_mutex); return _deviceDirty.empty(); }
+
+		// Whether the device holds bytes in [offset, offset + bytes) the host does not.
+		bool IsDeviceDirty(size_t offset, size_t bytes) const {
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto i = _deviceDirty.upper_bound(offset);
+			if (i != _deviceDirty.begin() && std::prev(i)->second > offset) {
+				return true;
+			}
+			return i != _deviceDirty.end() && i->first < offset + bytes;
+		}
+		bool IsDeviceCurrent() const { std::lock_guard<std::mutex> lock(_mutex); return _hostDirty.empty(); }
+
+		size_t HostDirtyBytes() const { return _Sum(_hostDirty); }
+		size_t DeviceDirtyBytes() const { return _Sum(_deviceDirty); }
+
+		static Ptr New(const cl::Buffer& b, char* host, size_t bytes, bool zeroCopy) {
+			return std::make_shared<ResidencyCL>(b, host, bytes, zeroCopy);
+		}
+
+	private:
+		typedef std::map<size_t, size_t> _Ranges; // first -> second
+
+		void _Mark(_Ranges& dirty, _Ranges& other, size_t offset, size_t bytes);
+
+		static void _Insert(_Ranges& r, size_t first, size_t second);
+		static void _Erase(_Ranges& r, size_t first, size_t second);
+
+		std::vector<Range> _Take(_Ranges& r, size_t first, size_t last) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			std::vector<Range> out;
+			auto i = r.upper_bound(first);
+			i = i == r.begin() ? i : std::prev(i);
+			for (; i != r.end() && i->first < last; ++i) {
+				if (i->second > first) {
+					out.push_back(Range(std::max(i->first, first), std::min(i->second, last)));
+				}
+			}
+			_Erase(r, first, last);
+			return out;
+		}
+
+		size_t _Sum(const _Ranges& r) const {
+			std::lock_guard<std::mutex> lock(_mutex);
+			size_t s = 0;
+			for (const auto& i : r) {
+				s += i.second - i.first;
+			}
+			return s;
+		}
+
+		cl::Buffer _buffer;
+		char* _host;
+		size_t _bytes;
+		bool _zeroCopy;
+
+		mutable std::mutex _mutex;
+		_Ranges _hostDirty, _deviceDirty;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(ResidencyCL);
+	};
+
+	inline void ResidencyCL::_Mark(_Ranges& dirty, _Ranges& other, size_t offset, size_t bytes) {
+		if (offset >= _bytes || !bytes) {
+			return;
+		}
+		const size_t end = bytes > _bytes - offset ? _bytes : offset + bytes;
+		_Erase(other, offset, end);
+		_Insert(dirty, offset, end);
+	}
+
+	// Merges with every range it overlaps or touches.
+	inline void ResidencyCL::_Insert(_Ranges& r, size_t first, size_t second) {
+		auto i = r.upper_bound(first);
+		if (i != r.begin()) {
+			auto p = std::prev(i);
+			if (p->second >= first) {
+				if (p->second >= second) {
+					return;
+				}
+				first = p->first;
+				i = p;
+			}
+		}
+		while (i != r.end() && i->first <= second) {
+			second = std::max(second, i->second);
+			i = r.erase(i);
+		}
+		r[first] = second;
+	}
+
+	// Cuts [first, second) out, splitting a range that spans it.
+	inline void ResidencyCL::_Erase(_Ranges& r, size_t first, size_t second) {
+		if (r.empty()) {
+			return;
+		}
+		auto i = r.upper_bound(first);
+		if (i != r.begin()) {
+			auto p = std::prev(i);
+			if (p->second > first) {
+				const size_t end = p->second;
+				p->second = first;
+				if (p->first == first) {
+					r.erase(p);
+				}
+				if (end > second) {
+					r[second] = end;
+					return;
+				}
+			}
+		}
+		while (i != r.end() && i->first < second) {
+			if (i->second > second) {
+				const size_t end = i->second;
+				r.erase(i);
+				r[second] = end;
+				return;
+			}
+			i = r.erase(i);
+		}
+	}
+
+}}
+
+#endif
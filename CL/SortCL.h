@@ -0,0 +1,332 @@
+#ifndef SORT_CL_H
+#define SORT_CL_H
+
+#include "PrimitivesCL.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace GPU {
+namespace CL {
+
+	// Order preserving map from a key to the unsigned integer the radix passes sort on.
+	template <typename K> struct SortKeyCL;
+
+	template <> struct SortKeyCL<cl_uint> {
+		static const size_t Bits = 32;
+		static const char* Radix() { return "uint radix_key(uint k) { return k; }\n"; }
+	};
+
+	template <> struct SortKeyCL<cl_ulong> {
+		static const size_t Bits = 64;
+		static const char* Radix() { return "ulong radix_key(ulong k) { return k; }\n"; }
+	};
+
+	// Negative floats have every bit flipped, positive ones only the sign, so the bit patterns order like the values.
+	template <> struct SortKeyCL<cl_float> {
+		static const size_t Bits = 32;
+		static const char* Radix() { return "uint radix_key(float k) { uint u = as_uint(k); return u ^ ((u >> 31) ? 0xffffffffu : 0x80000000u); }\n"; }
+	};
+
+	/*
+		Stable LSD radix sort on the device, 4 bit digits. Every pass builds per work-group digit histograms,
+		scans them with PrimitivesCL and scatters each block after a local split sort, so equal keys keep their order.
+		Sorting is in place on the device buffers, host storage is not touched.
+	*/
+	class SortCL {
+	public:
+		typedef std::shared_ptr<SortCL> Ptr;
+
+		static const size_t DigitBits = 4;
+		static const size_t Buckets = 1 << DigitBits;
+
+		struct Stats {
+			size_t Keys;
+			size_t Passes;
+			double Seconds;
+			double KeysPerSecond;
+		};
+
+		SortCL(ContextCL& c, DeviceCL& d) : _context(c), _device(d), _primitives(c, d) {
+			_stats.Keys = _stats.Passes = 0;
+			_stats.Seconds = _stats.KeysPerSecond = 0;
+		}
+
+		// Blocking; keys must already be on the device.
+		template <typename K>
+		Stats Sort(QueueCL& q, BufferCL<K>& keys) {
+			return _Sort<K, cl_uint>(q, keys, nullptr);
+		}
+
+		// Values are permuted with their keys.
+		template <typename K, typename V>
+		Stats Sort(QueueCL& q, BufferCL<K>& keys, BufferCL<V>& values) {
+			if (values.Count() < keys.Count()) {
+				throw std::runtime_error("SortCL, values buffer smaller than the keys.");
+			}
+			return _Sort<K, V>(q, keys, &values);
+		}
+
+		// Sorts the whole buffer on the device but only reads back k keys, smallest or largest first.
+		template <typename K>
+		std::vector<K> TopK(QueueCL& q, BufferCL<K>& keys, size_t k, bool largest = false);
+
+		template <typename K, typename V>
+		void TopK(QueueCL& q, BufferCL<K>& keys, BufferCL<V>& values, size_t k, bool largest, std::vector<K>& topKeys, std::vector<V>& topValues);
+
+		const Stats& LastStats() const { return _stats; }
+
+		static Ptr New(ContextCL& c, DeviceCL& d) {
+			return std::make_shared<SortCL>(c, d);
+		}
+
+	private:
+		struct _Program {
+			ProgramCL::Ptr Program;
+			KernelCL::Ptr Histogram, ScatterKeys, ScatterPairs;
+			size_t Group;
+		};
+
+		static const char* _Source();
+
+		template <typename K, typename V>
+		_Program& _Get();
+
+		template <typename T>
+		typename BufferCL<T>::Ptr _Scratch(size_t count) const {
+			return std::make_shared<BufferCL<T>>(_context.Get(), RawPointer<T>::New(nullptr, count), CL_MEM_READ_WRITE);
+		}
+
+		template <typename K, typename V>
+		Stats _Sort(QueueCL& q, BufferCL<K>& keys, BufferCL<V>* values);
+
+		template <typename T>
+		static std::vector<T> _ReadBack(QueueCL& q, const BufferCL<T>& b, size_t n, size_t k, bool largest) {
+			std::vector<T> top(k);
+			if (k) {
+				q.ReadBuffer(b, largest ? n - k : 0, top.data(), k, FutureCL()).Wait();
+			}
+			if (largest) {
+				std::reverse(top.begin(), top.end());
+			}
+			return top;
+		}
+
+		ContextCL& _context;
+		DeviceCL& _device;
+		PrimitivesCL _primitives;
+		Stats _stats;
+
+		std::map<std::string, std::shared_ptr<_Program>> _programs;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(SortCL);
+	};
+
+	inline const char* SortCL::_Source() {
+		return U_KERNEL_CL(
+			uint digit(K k, uint shift) {
+				return (uint)(radix_key(k) >> shift) & 15u;
+			}
+
+			__kernel void histogram(__global const K* keys, __global uint* hist, uint n, uint shift, __local uint* counts) {
+				uint lid = get_local_id(0);
+				uint gid = get_global_id(0);
+				for (uint d = lid; d < 16; d += get_local_size(0)) {
+					counts[d] = 0;
+				}
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				if (gid < n) {
+					atomic_inc(&counts[digit(keys[gid], shift)]);
+				}
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				for (uint d = lid; d < 16; d += get_local_size(0)) {
+					hist[d * get_num_groups(0) + get_group_id(0)] = counts[d];
+				}
+			}
+
+			uint sorted_slot(uint d, __global const uint* offsets, __local uint* tmp, __local uint* ldigit, __local uint* lidx,
+				__local uint* start, uint* src) {
+				uint lid = get_local_id(0);
+				uint wg = get_local_size(0);
+				uint idx = lid;
+
+				for (uint b = 0; b < 4; b++) {
+					uint bit = (d >> b) & 1u;
+					tmp[lid] = 1u - bit;
+					barrier(CLK_LOCAL_MEM_FENCE);
+
+					for (uint o = 1; o < wg; o <<= 1) {
+						uint x = tmp[lid];
+						if (lid >= o) {
+							x += tmp[lid - o];
+						}
+						barrier(CLK_LOCAL_MEM_FENCE);
+						tmp[lid] = x;
+						barrier(CLK_LOCAL_MEM_FENCE);
+					}
+
+					uint zeros = tmp[wg - 1];
+					uint before = tmp[lid] - (1u - bit);
+					uint pos = bit ? zeros + (lid - before) : before;
+					barrier(CLK_LOCAL_MEM_FENCE);
+
+					ldigit[pos] = d;
+					lidx[pos] = idx;
+					barrier(CLK_LOCAL_MEM_FENCE);
+					d = ldigit[lid];
+					idx = lidx[lid];
+					barrier(CLK_LOCAL_MEM_FENCE);
+				}
+
+				if (lid == 0 || ldigit[lid - 1] != d) {
+					start[d] = lid;
+				}
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				*src = get_group_id(0) * wg + idx;
+				return offsets[d * get_num_groups(0) + get_group_id(0)] + lid - start[d];
+			}
+
+			__kernel void scatter_keys(__global const K* keysIn, __global K* keysOut, __global const uint* offsets, uint n, uint shift,
+				__local uint* tmp, __local uint* ldigit, __local uint* lidx, __local uint* start) {
+				uint gid = get_global_id(0);
+				uint src = 0;
+				uint dst = sorted_slot(gid < n ? digit(keysIn[gid], shift) : 15u, offsets, tmp, ldigit, lidx, start, &src);
+				if (src < n) {
+					keysOut[dst] = keysIn[src];
+				}
+			}
+
+			__kernel void scatter_pairs(__global const K* keysIn, __global K* keysOut, __global const V* valuesIn, __global V* valuesOut,
+				__global const uint* offsets, uint n, uint shift, __local uint* tmp, __local uint* ldigit, __local uint* lidx, __local uint* start) {
+				uint gid = get_global_id(0);
+				uint src = 0;
+				uint dst = sorted_slot(gid < n ? digit(keysIn[gid], shift) : 15u, offsets, tmp, ldigit, lidx, start, &src);
+				if (src < n) {
+					keysOut[dst] = keysIn[src];
+					valuesOut[dst] = valuesIn[src];
+				}
+			}
+		);
+	}
+
+	template <typename K, typename V>
+	SortCL::_Program& SortCL::_Get() {
+		const char* key = TypeNameCL<K>::Get();
+		const char* value = TypeNameCL<V>::Get();
+		if (!key || !value) {
+			throw std::runtime_error("SortCL, type has no OpenCL C name.");
+		}
+
+		const std::string name = std::string(key) + "/" + value;
+		auto it = _programs.find(name);
+		if (it != _programs.end()) {
+			return *it->second;
+		}
+
+		std::ostringstream source;
+		source << "#define K " << key << "\n";
+		source << "#define V " << value << "\n";
+		source << SortKeyCL<K>::Radix();
+		source << _Source() << "\n";
+
+		std::shared_ptr<_Program> p = std::make_shared<_Program>();
+		p->Program = _context.NewProgramFromSource(source.str());
+		p->Program->BuildFor(_device);
+
+		p->Histogram = p->Program->NewKernel(_device, "histogram");
+		p->ScatterKeys = p->Program->NewKernel(_device, "scatter_keys");
+		p->ScatterPairs = p->Program->NewKernel(_device, "scatter_pairs");
+
+		size_t group = PrimitivesCL::MaxGroupSize;
+		for (const KernelCL::Ptr& k : { p->Histogram, p->ScatterKeys, p->ScatterPairs }) {
+			if (k->GetInfo().maxWorkGroupSize) {
+				group = std::min(group, k->GetInfo().maxWorkGroupSize);
+			}
+		}
+		p->Group = 1;
+		while (p->Group * 2 <= group) {
+			p->Group *= 2;
+		}
+
+		_programs[name] = p;
+		return *p;
+	}
+
+	template <typename K, typename V>
+	SortCL::Stats SortCL::_Sort(QueueCL& q, BufferCL<K>& keys, BufferCL<V>* values) {
+		static_assert(SortKeyCL<K>::Bits % (2 * DigitBits) == 0, "SortCL, an odd pass count would leave the result in scratch.");
+
+		const auto start = std::chrono::steady_clock::now();
+
+		_Program& p = _Get<K, V>();
+		const size_t n = keys.Count();
+
+		_stats.Keys = n;
+		_stats.Passes = 0;
+
+		if (n > 1) {
+			const size_t groups = (n + p.Group - 1) / p.Group;
+
+			KernelCL::Range r;
+			r.GlobalSize = cl::NDRange(groups * p.Group);
+			r.LocalSize = cl::NDRange(p.Group);
+
+			auto hist = _Scratch<cl_uint>(Buckets * groups);
+			auto offsets = _Scratch<cl_uint>(Buckets * groups);
+			auto keysTmp = _Scratch<K>(n);
+			typename BufferCL<V>::Ptr valuesTmp = values ? _Scratch<V>(n) : nullptr;
+
+			BufferCL<K>* keysIn = &keys;
+			BufferCL<K>* keysOut = keysTmp.get();
+			BufferCL<V>* valuesIn = values;
+			BufferCL<V>* valuesOut = valuesTmp.get();
+
+			const cl::LocalSpaceArg local = cl::Local(p.Group * sizeof(cl_uint));
+			const cl::LocalSpaceArg buckets = cl::Local(Buckets * sizeof(cl_uint));
+
+			FutureCL done;
+			for (cl_uint shift = 0; shift < SortKeyCL<K>::Bits; shift += DigitBits) {
+				p.Histogram->Args(*keysIn, *hist, static_cast<cl_uint>(n), shift, buckets);
+				done = q.Enqueue(*p.Histogram, r, done);
+
+				done = _primitives.ExclusiveScan(q, *hist, *offsets, PrimitivesCL::Sum, done);
+
+				if (values) {
+					p.ScatterPairs->Args(*keysIn, *keysOut, *valuesIn, *valuesOut, *offsets, static_cast<cl_uint>(n), shift, local, local, local, buckets);
+					done = q.Enqueue(*p.ScatterPairs, r, done);
+					std::swap(valuesIn, valuesOut);
+				} else {
+					p.ScatterKeys->Args(*keysIn, *keysOut, *offsets, static_cast<cl_uint>(n), shift, local, local, local, buckets);
+					done = q.Enqueue(*p.ScatterKeys, r, done);
+				}
+				std::swap(keysIn, keysOut);
+				_stats.Passes++;
+			}
+			done.Wait();
+		}
+
+		_stats.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		_stats.KeysPerSecond = _stats.Seconds > 0 ? n / _stats.Seconds : 0;
+		return _stats;
+	}
+
+	template <typename K>
+	std::vector<K> SortCL::TopK(QueueCL& q, BufferCL<K>& keys, size_t k, bool largest) {
+		Sort(q, keys);
+		return _ReadBack(q, keys, keys.Count(), std::min(k, keys.Count()), largest);
+	}
+
+	template <typename K, typename V>
+	void SortCL::TopK(QueueCL& q, BufferCL<K>& keys, BufferCL<V>& values, size_t k, bool largest, std::vector<K>& topKeys, std::vector<V>& topValues) {
+		Sort(q, keys, values);
+		k = std::min(k, keys.Count());
+		topKeys = _ReadBack(q, keys, keys.Count(), k, largest);
+		topValues = _ReadBack(q, values, keys.Count(), k, largest);
+	}
+
+}}
+
+#endif
@@ -1,8 +1,13 @@
 #ifndef STORAGE_GPU_H
 #define STORAGE_GPU_H
 
+#include "CommonCL.h"
+
 #include <array>
 #include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
 
 namespace GPU {
 	namespace CL {
@@ -125,7 +130,121 @@ namespace GPU {
 		std::unique_ptr<std::array<T, s>> _pointer;
 	};
 
+	inline size_t AlignedSize(size_t bytes, size_t alignment) {
+		const size_t s = ((bytes + alignment - 1) / alignment) * alignment;
+		return s ? s : alignment;
+	}
+
+	inline void* AlignedAlloc(size_t bytes, size_t alignment) {
+		void* p = nullptr;
+#ifdef _WIN32
+		p = _aligned_malloc(AlignedSize(bytes, alignment), alignment);
+#else
+		if (posix_memalign(&p, alignment, AlignedSize(bytes, alignment)) != 0) {
+			p = nullptr;
+		}
+#endif
+		if (!p) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	inline void AlignedFree(void* p) {
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	inline bool IsAligned(const void* p, size_t alignment) {
+		return (reinterpret_cast<uintptr_t>(p) % alignment) == 0;
+	}
+
+	/*
+		Allocator for std containers, allocations are aligned and padded to a runtime alignment 
+		(usually DeviceCL::Alignment()).
+	*/
 	template <typename T>
+	class AlignedAllocator {
+	public:
+		typedef T value_type;
+
+		AlignedAllocator(size_t a = U_PAGE_SIZE) : _alignment(a) {}
+
+		template <typename U>
+		AlignedAllocator(const AlignedAllocator<U>& o) : _alignment(o.Alignment()) {}
+
+		T* allocate(size_t n) {
+			return static_cast<T*>(AlignedAlloc(n * sizeof(T), _alignment));
+		}
+
+		void deallocate(T* p, size_t) {
+			AlignedFree(p);
+		}
+
+		size_t Alignment() const { return _alignment; }
+
+		template <typename U>
+		struct rebind { typedef AlignedAllocator<U> other; };
+
+	private:
+		size_t _alignment;
+	};
+
+	template <typename T, typename U>
+	bool operator==(const AlignedAllocator<T>& a, const AlignedAllocator<U>& b) { return a.Alignment() == b.Alignment(); }
+
+	template <typename T, typename U>
+	bool operator!=(const AlignedAllocator<T>& a, const AlignedAllocator<U>& b) { return !(a == b); }
+
+	template <typename T>
+	class AlignedStorage : public Storage<T> {
+	public:
+		AlignedStorage(size_t s, size_t alignment = U_PAGE_SIZE) : Storage<T>(s), _alignment(alignment) {
+			_pointer = static_cast<T*>(AlignedAlloc(s * sizeof(T), _alignment));
+			for (size_t i = 0; i < s; i++) {
+				new (&_pointer[i]) T();
+			}
+		}
+
+		virtual ~AlignedStorage() {
+			Release();
+		}
+
+		virtual T* Data() {
+			return _pointer;
+		}
+
+		virtual const T* Data() const {
+			return _pointer;
+		}
+
+		virtual void Release() {
+			if (_pointer) {
+				AlignedFree(_pointer);
+				_pointer = nullptr;
+			}
+			this->size(0);
+		}
+
+		virtual T& At(size_t i) { return _pointer[i]; }
+		virtual const T& At(size_t i) const { return _pointer[i]; }
+
+		size_t Alignment() const { return _alignment; }
+		size_t PaddedSize() const { return AlignedSize(this->RawSize(), _alignment); }
+
+		static typename Storage<T>::Ptr New(size_t s, size_t alignment = U_PAGE_SIZE) {
+			return std::make_shared<AlignedStorage>(s, alignment);
+		}
+
+	private:
+		T* _pointer;
+		size_t _alignment;
+	};
+
+	template <typename T, typename A = std::allocator<T>>
 	class Vector : public Storage<T> {
 	public:
 		Vector() : Storage<T>(0) {}
@@ -133,6 +252,10 @@ namespace GPU {
 			_vec.reserve(s);
 		}
 
+		Vector(size_t s, const A& a) : Storage<T>(s), _vec(a) {
+			_vec.reserve(s);
+		}
+
 		virtual void PushBack(const T& t) { _vec.push_back(t); }
 
 		virtual T* Data() {
@@ -145,20 +268,24 @@ namespace GPU {
 
 		virtual void Release() {
 			_vec.clear();
-            _vec = std::vector<T>();
+            _vec = std::vector<T, A>(_vec.get_allocator());
 		}
 
         static typename Storage<T>::Ptr New(size_t s) {
 			return std::make_shared<Vector>(s);
 		}
 
+		static typename Storage<T>::Ptr New(size_t s, const A& a) {
+			return std::make_shared<Vector>(s, a);
+		}
+
 		virtual T& At(size_t i) { return _vec.at(i); }
 		virtual const T& At(size_t i) const { return _vec.at(i); }
 
 		virtual size_t Size() const { return _vec.size(); }
 
 	private:
-		std::vector<T> _vec;
+		std::vector<T, A> _vec;
 	};
 
 }}
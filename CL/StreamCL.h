@@ -0,0 +1,140 @@
+#ifndef STREAM_CL_H
+#define STREAM_CL_H
+
+#include "ContextCL.h"
+
+#include <chrono>
+#include <deque>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Streams a Storage larger than device memory through a kernel in fixed size chunks.
+		Depth staging buffers are cycled: chunk i+1 uploads on the transfer queue while kernel i
+		runs on the compute queue and chunk i-1 downloads. The kernel sees one staging buffer 
+		at argument index Arg and a global size equal to the chunk length. Depth is at least 2: the
+		upload of chunk i+1 only waits for the download of the chunk that used its slot before, which
+		with a single slot is chunk i, not enqueued yet.
+	*/
+	template <typename T>
+	class StreamCL {
+	public:
+		typedef std::shared_ptr<StreamCL> Ptr;
+		typedef std::function<void(size_t chunk, size_t first, size_t count)> Callback;
+
+		struct Stats {
+			size_t Chunks;
+			size_t Bytes;
+			double Seconds;
+			double GBps;
+		};
+
+		StreamCL(const ContextCL& c, DeviceCL& d, size_t chunk, size_t depth = 3);
+
+		// Callbacks run on the calling thread, in chunk order.
+		Stats Run(KernelCL& k, const Storage<T>& in, Storage<T>& out, cl_uint arg = 0, const Callback& cb = Callback());
+		Stats Run(KernelCL& k, Storage<T>& data, cl_uint arg = 0, const Callback& cb = Callback()) {
+			return Run(k, data, data, arg, cb);
+		}
+
+		size_t ChunkSize() const { return _chunk; }
+		size_t Depth() const { return _staging.size(); }
+
+	private:
+		DeviceCL& _device;
+		size_t _chunk;
+
+		std::vector<typename BufferCL<T>::Ptr> _staging;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(StreamCL);
+	};
+
+	template <typename T>
+	StreamCL<T>::StreamCL(const ContextCL& c, DeviceCL& d, size_t chunk, size_t depth) : _device(d), _chunk(chunk) {
+		if (!chunk) {
+			throw std::runtime_error("StreamCL, chunk size must be positive.");
+		}
+		if (depth < 2) {
+			throw std::runtime_error("StreamCL, depth must be at least 2.");
+		}
+		if (chunk * sizeof(T) > d.GetInfo().MaxBufferSize) {
+			throw std::runtime_error("StreamCL, chunk larger than the device max buffer size.");
+		}
+
+		for (size_t i = 0; i < depth; i++) {
+			cl::Buffer b(c.Get(), CL_MEM_READ_WRITE, chunk * sizeof(T));
+			_staging.push_back(std::make_shared<BufferCL<T>>(b, RawPointer<T>::New(nullptr, chunk), CL_MEM_READ_WRITE));
+		}
+	}
+
+	template <typename T>
+	typename StreamCL<T>::Stats StreamCL<T>::Run(KernelCL& k, const Storage<T>& in, Storage<T>& out, cl_uint arg, const Callback& cb) {
+		if (in.Size() != out.Size()) {
+			throw std::runtime_error("StreamCL, input and output sizes differ.");
+		}
+
+		QueueCL& compute = _device.ComputeQueue();
+		QueueCL& transfer = _device.TransferQueue();
+
+		const auto start = std::chrono::steady_clock::now();
+
+		const size_t total = in.Size();
+		const size_t chunks = (total + _chunk - 1) / _chunk;
+		const size_t depth = _staging.size();
+
+		std::vector<FutureCL> computed(chunks), released(depth);
+		std::deque<std::pair<size_t, FutureCL>> pending;
+
+		auto count = [&](size_t i) { return std::min(_chunk, total - i * _chunk); };
+		auto done = [&](size_t i) {
+			if (cb) {
+				cb(i, i * _chunk, count(i));
+			}
+		};
+
+		for (size_t s = 0; s <= chunks; s++) {
+			if (s < chunks) {
+				BufferCL<T>& b = *_staging[s % depth];
+
+				FutureCL up = transfer.WriteBuffer(b, 0, in.Data() + s * _chunk, count(s), released[s % depth]);
+
+				KernelCL::Range r;
+				r.GlobalSize = cl::NDRange(count(s));
+				k.Arg(arg, b);
+				computed[s] = compute.Enqueue(k, r, up);
+			}
+
+			if (s >= 1) {
+				const size_t i = s - 1;
+				FutureCL down = transfer.ReadBuffer(*_staging[i % depth], 0, out.Data() + i * _chunk, count(i), computed[i]);
+				released[i % depth] = down;
+				pending.push_back(std::make_pair(i, down));
+			}
+
+			compute.Flush();
+			transfer.Flush();
+
+			while (!pending.empty() && pending.front().second.IsComplete()) {
+				done(pending.front().first);
+				pending.pop_front();
+			}
+		}
+
+		while (!pending.empty()) {
+			pending.front().second.Wait();
+			done(pending.front().first);
+			pending.pop_front();
+		}
+
+		Stats st;
+		st.Chunks = chunks;
+		st.Bytes = in.RawSize() + out.RawSize();
+		st.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		st.GBps = st.Seconds > 0 ? st.Bytes / st.Seconds / 1e9 : 0;
+		return st;
+	}
+
+}}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef TUNER_CL_H
+#define TUNER_CL_H
+
+#include "DeviceCL.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		Benchmarks candidate local sizes for a kernel, device and global size and keeps the fastest.
+		Results persist in a plain text database (one "device|driver|kernel|global<TAB>local" line each)
+		and are pushed into the KernelCL, so a Range::Auto launch picks them up.
+		Tuning runs the kernel for real with its current arguments.
+	*/
+	class TunerCL {
+	public:
+		typedef std::shared_ptr<TunerCL> Ptr;
+
+		struct Result {
+			cl::NDRange LocalSize;
+			double BestMs;
+			size_t Candidates;
+			bool FromDatabase;
+		};
+
+		// Empty path keeps results in memory only.
+		TunerCL(const std::string& path = "", size_t iterations = 5) : _path(path), _iterations(iterations) {
+			Load();
+		}
+
+		Result Tune(QueueCL& q, KernelCL& k, const DeviceCL& d, const cl::NDRange& global, bool force = false);
+
+		std::vector<cl::NDRange> Candidates(const KernelCL& k, const cl::NDRange& global) const;
+
+		bool Load();
+		bool Save() const;
+
+		static Ptr New(const std::string& path = "", size_t iterations = 5) {
+			return std::make_shared<TunerCL>(path, iterations);
+		}
+
+	private:
+		static std::string _Key(const KernelCL& k, const DeviceCL& d, const cl::NDRange& global) {
+			return d.GetInfo().Name + "|" + d.GetInfo().DriverVersion + "|" + k.Name() + "|" + KernelCL::RangeKey(global);
+		}
+
+		static cl::NDRange _Range(const std::vector<size_t>& v) {
+			switch (v.size()) {
+			case 1: return cl::NDRange(v[0]);
+			case 2: return cl::NDRange(v[0], v[1]);
+			case 3: return cl::NDRange(v[0], v[1], v[2]);
+			default: return cl::NullRange;
+			}
+		}
+
+		double _Measure(QueueCL& q, KernelCL& k, const cl::NDRange& global, const cl::NDRange& local) const;
+
+		const std::string _path;
+		const size_t _iterations;
+
+		std::map<std::string, std::vector<size_t>> _db;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(TunerCL);
+	};
+
+	inline std::vector<cl::NDRange> TunerCL::Candidates(const KernelCL& k, const cl::NDRange& global) const {
+		const size_t max = k.GetInfo().maxWorkGroupSize;
+		const size_t multiple = std::max<size_t>(k.GetInfo().preferredWorkGroupSizeMultiple, 1);
+		if (!max) {
+			throw std::runtime_error("TunerCL, kernel was created without a device.");
+		}
+
+		std::vector<cl::NDRange> list;
+		if (global.dimensions() == 1) {
+			for (size_t x = multiple; x <= max; x += multiple) {
+				if (global[0] % x == 0) {
+					list.push_back(cl::NDRange(x));
+				}
+			}
+		} else {
+			for (size_t x = 1; x <= max; x *= 2) {
+				for (size_t y = 1; x * y <= max; y *= 2) {
+					if (global[0] % x || global[1] % y || (x * y < multiple && x * y != max)) {
+						continue;
+					}
+					list.push_back(global.dimensions() == 2 ? cl::NDRange(x, y) : cl::NDRange(x, y, 1));
+				}
+			}
+		}
+		return list;
+	}
+
+	inline double TunerCL::_Measure(QueueCL& q, KernelCL& k, const cl::NDRange& global, const cl::NDRange& local) const {
+		KernelCL::Range r;
+		r.GlobalSize = global;
+		r.LocalSize = local;
+
+		// Warm up, first launches include compilation and residency effects.
+		q.Enqueue(k, r);
+		q.Finish();
+
+		std::vector<double> times;
+		for (size_t i = 0; i < _iterations; i++) {
+			const auto start = std::chrono::steady_clock::now();
+			q.Enqueue(k, r);
+			q.Finish();
+			times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		}
+		std::sort(times.begin(), times.end());
+		return times[times.size() / 2];
+	}
+
+	inline TunerCL::Result TunerCL::Tune(QueueCL& q, KernelCL& k, const DeviceCL& d, const cl::NDRange& global, bool force) {
+		const std::string key = _Key(k, d, global);
+
+		Result res;
+		res.BestMs = 0;
+		res.Candidates = 0;
+		res.FromDatabase = false;
+		res.LocalSize = cl::NullRange;
+
+		auto known = _db.find(key);
+		if (!force && known != _db.end()) {
+			res.LocalSize = _Range(known->second);
+			res.FromDatabase = true;
+			k.TunedLocalSize(global, res.LocalSize);
+			return res;
+		}
+
+		bool found = false;
+		for (const auto& local : Candidates(k, global)) {
+			res.Candidates++;
+			try {
+				const double ms = _Measure(q, k, global, local);
+				if (!found || ms < res.BestMs) {
+					res.BestMs = ms;
+					res.LocalSize = local;
+					found = true;
+				}
+			} catch (const cl::Error& err) {
+				// Rejected by the driver (resources, work-group limits), skip it.
+				TRACE(err.err(), err.what());
+			}
+		}
+
+		std::vector<size_t> v;
+		for (size_t i = 0; i < res.LocalSize.dimensions(); i++) {
+			v.push_back(res.LocalSize[i]);
+		}
+		_db[key] = v;
+		k.TunedLocalSize(global, res.LocalSize);
+		Save();
+		return res;
+	}
+
+	inline bool TunerCL::Load() {
+		if (_path.empty()) {
+			return false;
+		}
+		std::ifstream file(_path);
+		if (!file) {
+			return false;
+		}
+
+		std::string line;
+		while (std::getline(file, line)) {
+			const size_t tab = line.find('\t');
+			if (tab == std::string::npos) {
+				continue;
+			}
+
+			std::vector<size_t> v;
+			std::istringstream local(line.substr(tab + 1));
+			size_t n;
+			while (local >> n) {
+				v.push_back(n);
+			}
+			_db[line.substr(0, tab)] = v;
+		}
+		return true;
+	}
+
+	inline bool TunerCL::Save() const {
+		if (_path.empty()) {
+			return false;
+		}
+
+		// Unique per process and thread like ProgramCacheCL, concurrent savers never share a temporary file.
+		std::ostringstream name;
+		name << _path << ".tmp." << ProcessId() << "." << std::hash<std::thread::id>()(std::this_thread::get_id());
+		const std::string tmp = name.str();
+		{
+			std::ofstream file(tmp, std::ios::trunc);
+			if (!file) {
+				return false;
+			}
+			for (const auto& e : _db) {
+				file << e.first << '\t';
+				for (size_t i = 0; i < e.second.size(); i++) {
+					file << (i ? " " : "") << e.second[i];
+				}
+				file << '\n';
+			}
+			if (!file) {
+				std::remove(tmp.c_str());
+				return false;
+			}
+		}
+#ifdef _WIN32
+		// Only POSIX rename replaces an existing target.
+		std::remove(_path.c_str());
+#endif
+		if (std::rename(tmp.c_str(), _path.c_str()) != 0) {
+			std::remove(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+}}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef TYPED_KERNEL_CL_H
+#define TYPED_KERNEL_CL_H
+
+#include "QueueCL.h"
+
+#include <cstring>
+#include <type_traits>
+
+namespace GPU {
+namespace CL {
+
+	/*
+		OpenCL C spelling of host argument types, used to check kernel signatures. 
+		Types without a specialization (user structs) are only checked for arity.
+	*/
+	template <typename T> struct TypeNameCL { static const char* Get() { return nullptr; } };
+
+#define U_TYPE_NAME_CL(type, name) \
+	template <> struct TypeNameCL<type> { static const char* Get() { return name; } }
+
+	U_TYPE_NAME_CL(cl_char, "char");
+	U_TYPE_NAME_CL(cl_uchar, "uchar");
+	U_TYPE_NAME_CL(cl_short, "short");
+	U_TYPE_NAME_CL(cl_ushort, "ushort");
+	U_TYPE_NAME_CL(cl_int, "int");
+	U_TYPE_NAME_CL(cl_uint, "uint");
+	U_TYPE_NAME_CL(cl_long, "long");
+	U_TYPE_NAME_CL(cl_ulong, "ulong");
+	U_TYPE_NAME_CL(cl_float, "float");
+	U_TYPE_NAME_CL(cl_double, "double");
+	U_TYPE_NAME_CL(cl_float2, "float2");
+	U_TYPE_NAME_CL(cl_float4, "float4");
+	U_TYPE_NAME_CL(cl_int4, "int4");
+	U_TYPE_NAME_CL(cl_uint4, "uint4");
+	U_TYPE_NAME_CL(cl_uchar4, "uchar4");
+
+#undef U_TYPE_NAME_CL
+
+	/*
+		How a host argument maps to a kernel parameter: expected address space and type name, 
+		and the bytes that identify its value for the unchanged-argument cache.
+	*/
+	template <typename T>
+	struct ArgTraitsCL {
+		static bool Address(cl_uint a) { return a == CL_KERNEL_ARG_ADDRESS_PRIVATE; }
+		static std::string Type() { return TypeNameCL<T>::Get() ? TypeNameCL<T>::Get() : ""; }
+		static std::vector<unsigned char> Key(const T& t) {
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(&t);
+			return std::vector<unsigned char>(p, p + sizeof(T));
+		}
+	};
+
+	template <typename T>
+	struct ArgTraitsCL<BufferCL<T>> {
+		static bool Address(cl_uint a) { return a == CL_KERNEL_ARG_ADDRESS_GLOBAL || a == CL_KERNEL_ARG_ADDRESS_CONSTANT; }
+		static std::string Type() { return TypeNameCL<T>::Get() ? std::string(TypeNameCL<T>::Get()) + "*" : ""; }
+		// Views share the cl_mem of their buffer and KernelCL records the bound range for residency, so
+		// the range and tracking are part of the key. Evictable buffers are keyed by their allocation,
+		// which KernelCL::Restore sets again when it was re-created (and Get() would restore it here).
+		static std::vector<unsigned char> Key(const BufferCL<T>& b) {
+			std::vector<unsigned char> key = b.IsEvictable() ? ArgTraitsCL<const void*>::Key(b.Allocation().get()) : ArgTraitsCL<cl_mem>::Key(b.Get()());
+			_Append(key, b.HostBytesOffset());
+			_Append(key, b.Size());
+			_Append(key, static_cast<const void*>(b.Residency().get()));
+			return key;
+		}
+
+	private:
+		template <typename V>
+		static void _Append(std::vector<unsigned char>& key, const V& v) {
+			const std::vector<unsigned char> k = ArgTraitsCL<V>::Key(v);
+			key.insert(key.end(), k.begin(), k.end());
+		}
+	};
+
+	template <>
+	struct ArgTraitsCL<ImageCL> {
+		static bool Address(cl_uint a) { return a == CL_KERNEL_ARG_ADDRESS_GLOBAL; }
+		static std::string Type() { return "image2d_t"; }
+		static std::vector<unsigned char> Key(const ImageCL& img) {
+			const cl_mem m = img.Get()();
+			return ArgTraitsCL<cl_mem>::Key(m);
+		}
+	};
+
+	// The element type depends on the runtime format (half, ushort or char), so only the address space is checked.
+	template <>
+	struct ArgTraitsCL<PackedBufferCL> {
+		static bool Address(cl_uint a) { return a == CL_KERNEL_ARG_ADDRESS_GLOBAL || a == CL_KERNEL_ARG_ADDRESS_CONSTANT; }
+		static std::string Type() { return ""; }
+		static std::vector<unsigned char> Key(const PackedBufferCL& b) {
+			const cl_mem m = b.Get()();
+			return ArgTraitsCL<cl_mem>::Key(m);
+		}
+	};
+
+	template <>
+	struct ArgTraitsCL<SamplerCL> {
+		static bool Address(cl_uint a) { return a == CL_KERNEL_ARG_ADDRESS_PRIVATE; }
+		static std::string Type() { return "sampler_t"; }
+		static std::vector<unsigned char> Key(const SamplerCL& s) {
+			const cl_sampler m = s.Get()();
+			return ArgTraitsCL<cl_sampler>::Key(m);
+		}
+	};
+
+	template <>
+	struct ArgTraitsCL<cl::LocalSpaceArg> {
+		static bool Address(cl_uint a) { return a == CL_KERNEL_ARG_ADDRESS_LOCAL; }
+		static std::string Type() { return ""; }
+		static std::vector<unsigned char> Key(const cl::LocalSpaceArg& l) { return ArgTraitsCL<size_t>::Key(l.size_); }
+	};
+
+	/*
+		Kernel with a compile-time signature. Arity and, when the driver reports CL_KERNEL_ARG_* info, 
+		address space and type of every parameter are checked once at creation. setArg is skipped for
+		arguments whose value (or buffer range) did not change since the previous launch.
+	*/
+	template <typename... A>
+	class TypedKernelCL {
+	public:
+		typedef std::shared_ptr<TypedKernelCL> Ptr;
+
+		TypedKernelCL(const KernelCL::Ptr& k) : _kernel(k), _cache(sizeof...(A)), _set(0), _skipped(0) {
+			_Check();
+		}
+
+		void Bind(const A& ... args) { _Bind(0, args...); }
+
+		void operator()(QueueCL& q, const KernelCL::Range& r, const A& ... args) {
+			Bind(args...);
+			q.Enqueue(*_kernel, r);
+		}
+
+		FutureCL Launch(QueueCL& q, const KernelCL::Range& r, const FutureCL& after, const A& ... args) {
+			Bind(args...);
+			return q.Enqueue(*_kernel, r, after);
+		}
+
+		KernelCL& Kernel() { return *_kernel; }
+
+		size_t SetCount() const { return _set; }
+		size_t SkippedCount() const { return _skipped; }
+
+	private:
+		void _Check();
+
+		template <typename T>
+		void _CheckArg(cl_uint i) const;
+		template <typename... P>
+		typename std::enable_if<sizeof...(P) == 0>::type _CheckArgs(cl_uint) const {}
+
+		template <typename T, typename... P>
+		void _CheckArgs(cl_uint i) const {
+			_CheckArg<T>(i);
+			_CheckArgs<P...>(i + 1);
+		}
+
+		template <typename T>
+		void _BindOne(cl_uint i, const T& t) {
+			std::vector<unsigned char> key = ArgTraitsCL<T>::Key(t);
+			if (!_cache[i].empty() && _cache[i] == key) {
+				_skipped++;
+				return;
+			}
+			_kernel->Arg(i, t);
+			_cache[i].swap(key);
+			_set++;
+		}
+
+		void _Bind(cl_uint) {}
+
+		template <typename T, typename... P>
+		void _Bind(cl_uint i, const T& t, const P& ... args) {
+			_BindOne(i, t);
+			_Bind(i + 1, args...);
+		}
+
+		static std::string _Strip(const std::string& s) {
+			std::string r;
+			for (const char c : s) {
+				if (c != ' ' && c != '\0') {
+					r += c;
+				}
+			}
+			return r;
+		}
+
+		KernelCL::Ptr _kernel;
+		std::vector<std::vector<unsigned char>> _cache;
+		size_t _set, _skipped;
+
+		U_DISABLE_COPY_AND_ASSIGNMENT(TypedKernelCL);
+	};
+
+	template <typename... A>
+	void TypedKernelCL<A...>::_Check() {
+		const cl_uint n = _kernel->Get().template getInfo<CL_KERNEL_NUM_ARGS>();
+		if (n != sizeof...(A)) {
+			std::ostringstream msg;
+			msg << "TypedKernelCL, " << _kernel->Name() << " takes " << n << " arguments, signature has " << sizeof...(A) << ".";
+			throw std::runtime_error(msg.str());
+		}
+
+		try {
+			_CheckArgs<A...>(0);
+		} catch (const cl::Error& err) {
+			// Program built without argument info, arity is all we can check.
+			if (err.err() != CL_KERNEL_ARG_INFO_NOT_AVAILABLE) {
+				throw;
+			}
+		}
+	}
+
+	template <typename... A>
+	template <typename T>
+	void TypedKernelCL<A...>::_CheckArg(cl_uint i) const {
+		const cl::Kernel& k = _kernel->Get();
+
+		const cl_uint address = k.template getArgInfo<CL_KERNEL_ARG_ADDRESS_QUALIFIER>(i);
+		if (!ArgTraitsCL<T>::Address(address)) {
+			std::ostringstream msg;
+			msg << "TypedKernelCL, " << _kernel->Name() << " argument " << i << " has a different address space.";
+			throw std::runtime_error(msg.str());
+		}
+
+		const std::string expected = ArgTraitsCL<T>::Type();
+		const std::string actual = _Strip(k.template getArgInfo<CL_KERNEL_ARG_TYPE_NAME>(i));
+		if (!expected.empty() && expected != actual) {
+			std::ostringstream msg;
+			msg << "TypedKernelCL, " << _kernel->Name() << " argument " << i << " is " << actual << ", expected " << expected << ".";
+			throw std::runtime_error(msg.str());
+		}
+	}
+
+}}
+
+#endif
@@ -0,0 +1,16 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+TARGET = gpu_bench
+
+QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -msse -msse2 -msse3
+
+# ./gpu_bench --benchmark_format=json --benchmark_out=bench.json
+SOURCES += cl_bench.cpp
+
+INCLUDEPATH += $$_PRO_FILE_PWD_/../
+INCLUDEPATH += /opt/AMDAPPSDK-2.9-1/include
+LIBS += -lOpenCL -lbenchmark_main -lbenchmark -lpthread
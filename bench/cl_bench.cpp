@@ -0,0 +1,493 @@
+#include <benchmark/benchmark.h>
+
+#include <CL/ContextCL.h>
+#include <CL/KernelCL.h>
+#include <CL/QueueCL.h>
+#include <CL/ProgramCL.h>
+#include <CL/CommandBatchCL.h>
+#include <CL/PrimitivesCL.h>
+#include <CL/SortCL.h>
+#include <CL/PixelConvert.h>
+#include <CL/PackedBufferCL.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+	// CPU implementations are the common denominator on build machines, fall back to the default device.
+	GPU::CL::ContextCL& Context() {
+		static GPU::CL::ContextCL::Ptr context = []() {
+			try {
+				return GPU::CL::PlatformCL().NewCPUContext();
+			} catch (const cl::Error&) {
+				return GPU::CL::PlatformCL::NewContext();
+			}
+		}();
+		return *context;
+	}
+
+	const std::string& EmptySource() {
+		static const std::string source = U_KERNEL_CL(
+			__kernel void empty(__global float* a, int i, float f) {}
+		);
+		return source;
+	}
+
+	GPU::CL::KernelCL& EmptyKernel() {
+		static GPU::CL::KernelCL::Ptr kernel;
+		if (!kernel) {
+			auto program = Context().NewProgramFromSource(EmptySource());
+			program->BuildFor(Context().Device());
+			kernel = program->NewKernel(Context().Device(), "empty");
+		}
+		return *kernel;
+	}
+
+	// Initialised once through a function-local static, so concurrent benchmark threads can share it.
+	GPU::CL::KernelPoolCL& EmptyKernelPool() {
+		static GPU::CL::KernelPoolCL::Ptr pool = []() {
+			auto program = Context().NewProgramFromSource(EmptySource());
+			program->BuildFor(Context().Device());
+			return program->NewKernelPool(Context().Device(), "empty");
+		}();
+		return *pool;
+	}
+
+	GPU::CL::PrimitivesCL& Primitives() {
+		static GPU::CL::PrimitivesCL::Ptr primitives = GPU::CL::PrimitivesCL::New(Context(), Context().Device());
+		return *primitives;
+	}
+
+	void TransferSizes(benchmark::internal::Benchmark* b) {
+		b->RangeMultiplier(4)->Range(4 << 10, 64 << 20);
+	}
+
+}
+
+static void BM_WriteBuffer(benchmark::State& state) {
+	auto buf = Context().NewBuffer<cl_uchar>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.WriteBuffer(*buf);
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WriteBuffer)->Apply(TransferSizes);
+
+static void BM_ReadBuffer(benchmark::State& state) {
+	auto buf = Context().NewBuffer<cl_uchar>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.ReadBuffer(*buf);
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ReadBuffer)->Apply(TransferSizes);
+
+static void BM_WriteBufferRect(benchmark::State& state) {
+	const size_t side = static_cast<size_t>(std::sqrt(static_cast<double>(state.range(0))));
+	auto buf = Context().NewBuffer<cl_uchar>(side * side);
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+
+	GPU::CL::BufferRectCL<cl_uchar> rect(side, side);
+	rect.DevicePitch(side);
+	rect.HostPitch(side);
+	for (auto _ : state) {
+		q.WriteBufferRect(*buf, rect);
+	}
+	state.SetBytesProcessed(state.iterations() * side * side);
+}
+BENCHMARK(BM_WriteBufferRect)->Apply(TransferSizes);
+
+static void BM_ReadBufferRect(benchmark::State& state) {
+	const size_t side = static_cast<size_t>(std::sqrt(static_cast<double>(state.range(0))));
+	auto buf = Context().NewBuffer<cl_uchar>(side * side);
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+
+	GPU::CL::BufferRectCL<cl_uchar> rect(side, side);
+	rect.DevicePitch(side);
+	rect.HostPitch(side);
+	for (auto _ : state) {
+		q.ReadBufferRect(*buf, rect);
+	}
+	state.SetBytesProcessed(state.iterations() * side * side);
+}
+BENCHMARK(BM_ReadBufferRect)->Apply(TransferSizes);
+
+static void BM_CopyBuffer(benchmark::State& state) {
+	auto src = Context().NewBuffer<cl_uchar>(state.range(0));
+	auto dst = Context().NewBuffer<cl_uchar>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.CopyBuffer(*src, *dst);
+		q.Finish();
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CopyBuffer)->Apply(TransferSizes);
+
+static void BM_FillBuffer(benchmark::State& state) {
+	auto buf = Context().NewBuffer<cl_uchar>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.FillBuffer<cl_uchar>(*buf, 1);
+		q.Finish();
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FillBuffer)->Apply(TransferSizes);
+
+static void BM_EnqueueTask(benchmark::State& state) {
+	auto buf = Context().NewBuffer<float>(1);
+	GPU::CL::KernelCL& k = EmptyKernel();
+	k.Args(*buf, 1, 1.0f);
+
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.Enqueue(k);
+		q.Finish();
+	}
+}
+BENCHMARK(BM_EnqueueTask);
+
+static void BM_EnqueueRange(benchmark::State& state) {
+	auto buf = Context().NewBuffer<float>(1);
+	GPU::CL::KernelCL& k = EmptyKernel();
+	k.Args(*buf, 1, 1.0f);
+
+	GPU::CL::KernelCL::Range r;
+	r.GlobalSize = cl::NDRange(state.range(0));
+
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.Enqueue(k, r);
+		q.Finish();
+	}
+}
+BENCHMARK(BM_EnqueueRange)->Arg(1)->Arg(1024)->Arg(1 << 20);
+
+static void BM_Args(benchmark::State& state) {
+	auto buf = Context().NewBuffer<float>(1);
+	GPU::CL::KernelCL& k = EmptyKernel();
+	for (auto _ : state) {
+		k.Args(*buf, 1, 1.0f);
+	}
+}
+BENCHMARK(BM_Args);
+
+static void BM_NewBuffer(benchmark::State& state) {
+	auto storage = Context().NewStorage<cl_uchar>(state.range(0));
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(Context().NewBuffer<cl_uchar>(storage));
+	}
+}
+BENCHMARK(BM_NewBuffer)->Arg(4 << 10)->Arg(1 << 20)->Arg(16 << 20);
+
+static void BM_ProgramBuild(benchmark::State& state) {
+	for (auto _ : state) {
+		auto program = Context().NewProgramFromSource(EmptySource());
+		program->BuildFor(Context().Device());
+	}
+}
+BENCHMARK(BM_ProgramBuild)->Unit(benchmark::kMillisecond);
+
+// Per-thread kernels and queues: submission throughput should scale with threads rather than serialise on one queue.
+static void BM_ConcurrentEnqueue(benchmark::State& state) {
+	static GPU::CL::BufferCL<float>::Ptr buf = Context().NewBuffer<float>(1);
+
+	GPU::CL::KernelCL& k = EmptyKernelPool().Local();
+	GPU::CL::QueueCL& q = Context().Device().ThreadQueue();
+	k.Args(*buf, 1, 1.0f);
+
+	size_t n = 0;
+	for (auto _ : state) {
+		q.Enqueue(k);
+		if (++n % 64 == 0) {
+			q.Finish();
+		}
+	}
+	q.Finish();
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ConcurrentEnqueue)->ThreadRange(1, 32)->UseRealTime();
+
+// A frame of small writes, kernels and reads, issued one blocking call at a time versus replayed as a batch.
+static void BM_IndividualCommands(benchmark::State& state) {
+	auto buf = Context().NewBuffer<float>(1024);
+	GPU::CL::KernelCL& k = EmptyKernel();
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+
+	for (auto _ : state) {
+		for (int i = 0; i < 16; i++) {
+			q.WriteBuffer(*buf);
+			k.Args(*buf, i, 1.0f);
+			q.Enqueue(k);
+			q.ReadBuffer(*buf);
+		}
+		q.Finish();
+	}
+	state.SetItemsProcessed(state.iterations() * 48);
+}
+BENCHMARK(BM_IndividualCommands);
+
+static void BM_CommandBatch(benchmark::State& state) {
+	auto buf = Context().NewBuffer<float>(1024);
+	GPU::CL::KernelCL& k = EmptyKernel();
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+
+	GPU::CL::CommandBatchCL batch;
+	for (int i = 0; i < 16; i++) {
+		batch.WriteBuffer(*buf).Task(k, *buf, i, 1.0f).ReadBuffer(*buf);
+	}
+
+	for (auto _ : state) {
+		batch.Submit(q).Wait();
+	}
+	state.SetItemsProcessed(state.iterations() * batch.Size());
+}
+BENCHMARK(BM_CommandBatch);
+
+static void BM_Reduce(benchmark::State& state) {
+	auto buf = Context().NewBuffer<float>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	q.WriteBuffer(*buf);
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(Primitives().Reduce(q, *buf, GPU::CL::PrimitivesCL::Sum));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(float));
+}
+BENCHMARK(BM_Reduce)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+
+static void BM_ReduceHost(benchmark::State& state) {
+	std::vector<float> data(state.range(0), 1.0f);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(GPU::CL::PrimitivesCL::ReduceHost(data.data(), data.size(), GPU::CL::PrimitivesCL::Sum));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(float));
+}
+BENCHMARK(BM_ReduceHost)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+
+static void BM_Scan(benchmark::State& state) {
+	auto in = Context().NewBuffer<float>(state.range(0));
+	auto out = Context().NewBuffer<float>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	q.WriteBuffer(*in);
+
+	for (auto _ : state) {
+		Primitives().InclusiveScan(q, *in, *out, GPU::CL::PrimitivesCL::Sum).Wait();
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(float));
+}
+BENCHMARK(BM_Scan)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+
+static void BM_SegmentedScan(benchmark::State& state) {
+	auto in = Context().NewBuffer<float>(state.range(0));
+	auto flags = Context().NewBuffer<cl_uint>(state.range(0));
+	auto out = Context().NewBuffer<float>(state.range(0));
+	for (int64_t i = 0; i < state.range(0); i++) {
+		flags->Data()[i] = (i % 1024) == 0;
+	}
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	q.WriteBuffer(*in);
+	q.WriteBuffer(*flags);
+
+	for (auto _ : state) {
+		Primitives().SegmentedScan(q, *in, *flags, *out, GPU::CL::PrimitivesCL::Sum).Wait();
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(float));
+}
+BENCHMARK(BM_SegmentedScan)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+
+static void BM_Sort(benchmark::State& state) {
+	static GPU::CL::SortCL::Ptr sort = GPU::CL::SortCL::New(Context(), Context().Device());
+
+	auto keys = Context().NewBuffer<cl_uint>(state.range(0));
+	for (int64_t i = 0; i < state.range(0); i++) {
+		keys->Data()[i] = static_cast<cl_uint>(i * 2654435761u);
+	}
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+
+	for (auto _ : state) {
+		state.PauseTiming();
+		q.WriteBuffer(*keys);
+		state.ResumeTiming();
+		sort->Sort(q, *keys);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Sort)->RangeMultiplier(16)->Range(1 << 12, 1 << 24)->Unit(benchmark::kMillisecond);
+
+static void BM_SortHost(benchmark::State& state) {
+	std::vector<cl_uint> keys(state.range(0));
+	for (auto _ : state) {
+		state.PauseTiming();
+		for (size_t i = 0; i < keys.size(); i++) {
+			keys[i] = static_cast<cl_uint>(i * 2654435761u);
+		}
+		state.ResumeTiming();
+		std::stable_sort(keys.begin(), keys.end());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SortHost)->RangeMultiplier(16)->Range(1 << 12, 1 << 24)->Unit(benchmark::kMillisecond);
+
+// One 4K RGBA8 frame per iteration, Arg(0) is the PixelConvert::Isa, Arg(1) the stage.
+static void BM_PixelConvert(benchmark::State& state) {
+	typedef GPU::CL::PixelConvert P;
+
+	const P::Isa isa = static_cast<P::Isa>(state.range(0));
+	if (isa > P::Detect()) {
+		state.SkipWithError("instruction set not supported");
+		return;
+	}
+
+	const size_t pixels = 3840 * 2160;
+	std::vector<uint8_t> frame(pixels * 4, 0x7f);
+	std::vector<float> staged(pixels * 4);
+
+	P::SetIsa(isa);
+	for (auto _ : state) {
+		switch (state.range(1)) {
+		case P::Swizzle: P::SwizzleRB(frame.data(), frame.data(), pixels); break;
+		case P::ToFloat4: P::RGBA8ToFloat4(frame.data(), staged.data(), pixels); break;
+		case P::ToPlanar: P::PackedToPlanar(frame.data(), staged.data(), staged.data() + pixels, staged.data() + 2 * pixels, staged.data() + 3 * pixels, pixels); break;
+		}
+		benchmark::ClobberMemory();
+	}
+	P::SetIsa(P::Detect());
+	state.SetBytesProcessed(state.iterations() * pixels * 4);
+}
+BENCHMARK(BM_PixelConvert)
+	->ArgsProduct({ { GPU::CL::PixelConvert::Scalar, GPU::CL::PixelConvert::SSE2, GPU::CL::PixelConvert::AVX2 },
+		{ GPU::CL::PixelConvert::Swizzle, GPU::CL::PixelConvert::ToFloat4, GPU::CL::PixelConvert::ToPlanar } })
+	->Unit(benchmark::kMillisecond);
+
+// Bytes processed are counted as full floats for all three, so the rates compare effective bandwidth.
+static void BM_WriteReadFloat(benchmark::State& state) {
+	auto buf = Context().NewBuffer<cl_float>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.WriteBuffer(*buf);
+		q.ReadBuffer(*buf);
+	}
+	state.SetBytesProcessed(2 * state.iterations() * state.range(0) * sizeof(float));
+}
+BENCHMARK(BM_WriteReadFloat)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+
+static void BM_WriteReadPacked(benchmark::State& state) {
+	auto buf = Context().NewPackedBuffer(state.range(0), static_cast<GPU::CL::PackedBufferCL::Format>(state.range(1)), 0.01f);
+	std::fill(buf->Data(), buf->Data() + buf->Count(), 0.5f);
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.WriteBuffer(*buf);
+		q.ReadBuffer(*buf);
+	}
+	state.SetBytesProcessed(2 * state.iterations() * state.range(0) * sizeof(float));
+}
+BENCHMARK(BM_WriteReadPacked)
+	->ArgsProduct({ benchmark::CreateRange(1 << 12, 1 << 24, 16),
+		{ GPU::CL::PackedBufferCL::Half, GPU::CL::PackedBufferCL::BFloat16, GPU::CL::PackedBufferCL::Int8 } });
+
+static void BM_PackConvert(benchmark::State& state) {
+	typedef GPU::CL::PackConvert P;
+
+	const P::Isa isa = static_cast<P::Isa>(state.range(0));
+	if (isa > P::Detect()) {
+		state.SkipWithError("instruction set not supported");
+		return;
+	}
+
+	const size_t count = 1 << 22;
+	std::vector<float> data(count, 0.5f);
+	std::vector<uint16_t> packed(count);
+
+	P::SetIsa(isa);
+	for (auto _ : state) {
+		switch (state.range(1)) {
+		case GPU::CL::PackedBufferCL::Half: P::FloatToHalf(data.data(), packed.data(), count); break;
+		case GPU::CL::PackedBufferCL::BFloat16: P::FloatToBFloat16(data.data(), packed.data(), count); break;
+		case GPU::CL::PackedBufferCL::Int8: P::FloatToInt8(data.data(), reinterpret_cast<int8_t*>(packed.data()), count, 0.01f); break;
+		}
+		benchmark::ClobberMemory();
+	}
+	P::SetIsa(P::Detect());
+	state.SetBytesProcessed(state.iterations() * count * sizeof(float));
+}
+BENCHMARK(BM_PackConvert)
+	->ArgsProduct({ { GPU::CL::PackConvert::Scalar, GPU::CL::PackConvert::SSE2, GPU::CL::PackConvert::F16C },
+		{ GPU::CL::PackedBufferCL::Half, GPU::CL::PackedBufferCL::BFloat16, GPU::CL::PackedBufferCL::Int8 } })
+	->Unit(benchmark::kMillisecond);
+
+// One element changed per iteration; compare with BM_WriteBuffer at the same size.
+static void BM_TrackedWriteBuffer(benchmark::State& state) {
+	auto buf = Context().NewTrackedBuffer<cl_uchar>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	size_t i = 0;
+	for (auto _ : state) {
+		buf->At(i++ % buf->Count()) = 1;
+		q.WriteBuffer(*buf);
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_TrackedWriteBuffer)->Apply(TransferSizes);
+
+static void BM_SliceTiles(benchmark::State& state) {
+	const size_t size = 16 << 20, tile = state.range(0);
+	auto buf = Context().NewBuffer<cl_uchar>(size);
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		for (size_t offset = 0; offset < size; offset += tile) {
+			q.WriteBuffer(*buf->Slice(offset, std::min(tile, size - offset)));
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_SliceTiles)->RangeMultiplier(16)->Range(64 << 10, 16 << 20);
+
+// Four buffers round-robin under a budget of two: every write restores one and evicts another.
+static void BM_BudgetEviction(benchmark::State& state) {
+	const GPU::CL::MemoryBudgetCL::Ptr& budget = Context().Device().Budget();
+	const size_t saved = budget->Budget();
+	std::vector<GPU::CL::BufferCL<cl_uchar>::Ptr> buffers;
+	for (int i = 0; i < 4; i++) {
+		buffers.push_back(Context().NewBuffer<cl_uchar>(state.range(0)));
+	}
+	budget->SetBudget(budget->Used() - 2 * state.range(0));
+
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	size_t i = 0;
+	for (auto _ : state) {
+		q.WriteBuffer(*buffers[i++ % buffers.size()]);
+	}
+	budget->SetBudget(saved);
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BudgetEviction)->Apply(TransferSizes);
+
+// Counters are always on: blocking writes with them, and the cost of a snapshot.
+static void BM_MetricsSnapshot(benchmark::State& state) {
+	auto buf = Context().NewBuffer<cl_uchar>(4 << 10);
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	for (auto _ : state) {
+		q.WriteBuffer(*buf);
+		benchmark::DoNotOptimize(Context().Metrics());
+	}
+}
+BENCHMARK(BM_MetricsSnapshot);
+
+// Blocking, Async and FireAndForget writes; the non-blocking ones are waited for once, at the end.
+static void BM_WriteBufferPolicy(benchmark::State& state) {
+	auto buf = Context().NewBuffer<cl_uchar>(state.range(0));
+	GPU::CL::QueueCL& q = Context().Device().Queue();
+	const auto policy = static_cast<GPU::CL::QueueCL::TransferPolicy>(state.range(1));
+	for (auto _ : state) {
+		q.WriteBuffer(*buf, policy);
+	}
+	q.Finish();
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WriteBufferPolicy)
+	->ArgsProduct({ { 64 << 10, 4 << 20 },
+		{ GPU::CL::QueueCL::Blocking, GPU::CL::QueueCL::Async, GPU::CL::QueueCL::FireAndForget } });
@@ -4,6 +4,19 @@
 #include <CL/KernelCL.h>
 #include <CL/QueueCL.h>
 #include <CL/ProgramCL.h>
+#include <CL/StreamCL.h>
+#include <CL/MultiDeviceCL.h>
+#include <CL/TunerCL.h>
+#include <CL/CommandBatchCL.h>
+#include <CL/MappedFile.h>
+#include <CL/PrimitivesCL.h>
+#include <CL/SortCL.h>
+#include <CL/PixelConvert.h>
+#include <CL/PackedBufferCL.h>
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
 
 TEST(CL, ContextDefault) {
     try {
@@ -49,11 +62,11 @@ TEST(CL, ContextComplete) {
 
 
 	size_t gpuNum = 0, cpuNum = 0;
-	std::for_each(context->ConstBegin(), context->ConstEnd(), [&gpuNum, &cpuNum](const GPU::CL::DeviceCL& d){
-		std::cout << " ** Vendor: " << d.GetInfo().Vendor << std::endl;
-		std::cout << " ** Max buffer size: " << d.GetInfo().MaxBufferSize << std::endl;
+	std::for_each(context->ConstBegin(), context->ConstEnd(), [&gpuNum, &cpuNum](const GPU::CL::DeviceCL::Ptr& d){
+		std::cout << " ** Vendor: " << d->GetInfo().Vendor << std::endl;
+		std::cout << " ** Max buffer size: " << d->GetInfo().MaxBufferSize << std::endl;
 
-		d.GetInfo().Type == CL_DEVICE_TYPE_GPU ? gpuNum++ : cpuNum++;
+		d->GetInfo().Type == CL_DEVICE_TYPE_GPU ? gpuNum++ : cpuNum++;
 	});
 
 	auto gpus = context->GPUs();
@@ -271,3 +284,1379 @@ TEST(CL, Queue) {
 		TRACE(err.err(), err.what());
 	}
 }
+
+TEST(CL, ProgramCache) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		auto cache = GPU::CL::ProgramCacheCL::New("");
+		gpuContext.SetProgramCache(cache);
+
+		const std::string source = U_KERNEL_CL(
+			__kernel void fill(__global float* a, float v) {
+				a[get_global_id(0)] = v;
+			}
+		);
+		std::remove(cache->Path(cache->Key(source, "", gpuContext.Device())).c_str());
+
+		auto first = gpuContext.NewProgramFromSource(source);
+		first->BuildFor(gpuContext.Device());
+		ASSERT_FALSE(first->FromCache());
+		ASSERT_EQ(cache->GetStats().Misses, 1);
+		ASSERT_EQ(cache->GetStats().Writes, 1);
+
+		auto second = gpuContext.NewProgramFromSource(source);
+		second->BuildFor(gpuContext.Device());
+		ASSERT_TRUE(second->FromCache());
+		ASSERT_EQ(cache->GetStats().Hits, 1);
+
+		float out[16];
+		auto buf = gpuContext.NewBuffer<float>(GPU::CL::RawPointer<float>::New(out, 16));
+		auto kernel = second->NewKernel(gpuContext.Device(), "fill");
+		kernel->Args(*buf, 3.0f);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(16);
+		gpuContext.Device().Queue().Enqueue(*kernel, r);
+		gpuContext.Device().Queue().ReadBuffer(*buf);
+		ASSERT_FLOAT_EQ(out[15], 3.0f);
+
+		std::remove(cache->Path(cache->Key(source, "", gpuContext.Device())).c_str());
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, ZeroCopyMap) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		const size_t size = 1024;
+		auto input = GPU::CL::Vector<float>::New(size);
+		for (size_t i = 0; i < size; i++) {
+			input->PushBack(static_cast<float>(i));
+		}
+
+		auto buf = gpuContext.NewZeroCopyBuffer<float>(input);
+		ASSERT_TRUE(buf->IsZeroCopy());
+
+		cq.FillBuffer(*buf, 5.0f);
+		cq.ReadBuffer(*buf);
+		ASSERT_FLOAT_EQ(input->At(size - 1), 5.0f);
+
+		auto host = gpuContext.NewHostBuffer<float>(size);
+		ASSERT_EQ(host->Count(), size);
+		{
+			auto view = cq.Map(*host, CL_MAP_WRITE_INVALIDATE_REGION);
+			ASSERT_EQ(view->Count(), size);
+			for (size_t i = 0; i < size; i++) {
+				view->At(i) = 2.0f;
+			}
+		}
+
+		cq.CopyBuffer(*host, *buf);
+		{
+			auto view = cq.Map(*buf, CL_MAP_READ);
+			ASSERT_FLOAT_EQ(view->At(0), 2.0f);
+			view->Unmap();
+			ASSERT_FALSE(view->IsMapped());
+		}
+		cq.Finish();
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, AlignedStorage) {
+	GPU::CL::ContextCL gpuContext;
+	const size_t align = gpuContext.Device().Alignment();
+	ASSERT_EQ(align % U_PAGE_SIZE, 0);
+
+	GPU::CL::AlignedStorage<float> storage(10, align);
+	ASSERT_TRUE(GPU::CL::IsAligned(storage.Data(), align));
+	ASSERT_EQ(storage.PaddedSize() % align, 0);
+	ASSERT_FLOAT_EQ(storage.At(9), 0.0f);
+
+	GPU::CL::Vector<float, GPU::CL::AlignedAllocator<float>> vec(10, GPU::CL::AlignedAllocator<float>(align));
+	vec.PushBack(1.0f);
+	ASSERT_TRUE(GPU::CL::IsAligned(vec.Data(), align));
+
+	try {
+		auto buf = gpuContext.NewBuffer<float>(1024);
+		ASSERT_EQ(buf->Count(), 1024);
+		ASSERT_TRUE(GPU::CL::IsAligned(buf->Data(), align));
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, BufferPool) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+		const auto& pool = gpuContext.Pool();
+
+		{
+			auto a = gpuContext.NewPooledBuffer<float>(1000);
+			auto b = gpuContext.NewPooledBuffer<float>(10);
+
+			auto s = pool.GetStats();
+			ASSERT_EQ(s.Slabs, 1);
+			ASSERT_EQ(s.RequestedBytes, 1010 * sizeof(float));
+			ASSERT_GE(s.InUseBytes, s.RequestedBytes);
+
+			cq.FillBuffer(*a, 4.0f);
+			cq.ReadBuffer(*a);
+			ASSERT_FLOAT_EQ(a->Data()[999], 4.0f);
+		}
+
+		auto s = pool.GetStats();
+		ASSERT_EQ(s.InUseBytes, 0);
+		ASSERT_GT(s.FreeListBytes, 0);
+		ASSERT_GT(s.HighWaterBytes, 0);
+
+		auto c = gpuContext.NewPooledBuffer<float>(1000);
+		ASSERT_EQ(pool.GetStats().Reuses, 1);
+		ASSERT_EQ(pool.GetStats().Slabs, 1);
+		ASSERT_LE(pool.SlabSize(), gpuContext.Device().GetInfo().MaxBufferSize);
+		ASSERT_EQ(pool.SlabSize() % pool.Alignment(), 0u);
+
+		// Storage contents are uploaded, as for NewBuffer.
+		auto storage = gpuContext.NewStorage<float>(100);
+		std::fill(storage->Data(), storage->Data() + 100, 3.0f);
+		auto d = gpuContext.NewPooledBuffer<float>(storage);
+		std::fill(d->Data(), d->Data() + 100, 0.0f);
+		cq.ReadBuffer(*d);
+		ASSERT_FLOAT_EQ(d->Data()[99], 3.0f);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, FutureChain) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void twice(__global float* a) {
+					a[get_global_id(0)] *= 2.0f;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "twice");
+
+		const size_t size = 256;
+		auto a = gpuContext.NewBuffer<float>(size);
+		auto b = gpuContext.NewBuffer<float>(size);
+		for (size_t i = 0; i < size; i++) {
+			a->Data()[i] = static_cast<float>(i);
+		}
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(size);
+
+		auto written = cq.WriteBuffer(*a, GPU::CL::FutureCL());
+		auto filled = cq.FillBuffer(*b, 1.0f, GPU::CL::FutureCL());
+
+		kernel->Args(*a);
+		auto computed = cq.Enqueue(*kernel, r, written);
+		auto copied = cq.CopyBuffer(*a, *b, GPU::CL::FutureCL::WhenAll({ computed, filled }));
+		auto read = cq.ReadBuffer(*b, copied);
+		read.Wait();
+
+		ASSERT_TRUE(read.IsComplete());
+		ASSERT_FLOAT_EQ(b->Data()[size - 1], 2.0f * (size - 1));
+
+		cq.Finish();
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, DeviceQueues) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::DeviceCL& device = gpuContext.Device();
+		ASSERT_EQ(device.QueueCount(), 1);
+
+		GPU::CL::QueueCL& compute = device.ComputeQueue();
+		GPU::CL::QueueCL& transfer = device.TransferQueue();
+		ASSERT_NE(&compute, &transfer);
+		ASSERT_EQ(&transfer, &device.TransferQueue());
+		ASSERT_FALSE(transfer.IsOutOfOrder());
+
+		GPU::CL::QueueCL& ooo = device.AddQueue(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+		ASSERT_EQ(ooo.IsOutOfOrder(), device.SupportsOutOfOrder());
+
+		const size_t size = 1024;
+		auto a = gpuContext.NewBuffer<float>(size);
+		auto b = gpuContext.NewBuffer<float>(size);
+
+		auto filled = ooo.FillBuffer(*a, 3.0f, GPU::CL::FutureCL());
+		auto copied = ooo.CopyBuffer(*a, *b, filled);
+		auto read = transfer.ReadBuffer(*b, copied);
+		read.Wait();
+		ASSERT_FLOAT_EQ(b->Data()[size - 1], 3.0f);
+
+		ooo.FillBuffer(*a, 4.0f);
+		ooo.ReadBuffer(*a);
+		ASSERT_FLOAT_EQ(a->Data()[0], 4.0f);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Stream) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void twice(__global float* a) {
+					a[get_global_id(0)] *= 2.0f;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "twice");
+
+		const size_t size = 10000;
+		GPU::CL::AlignedStorage<float> in(size), out(size);
+		for (size_t i = 0; i < size; i++) {
+			in.At(i) = static_cast<float>(i);
+		}
+
+		GPU::CL::StreamCL<float> stream(gpuContext, gpuContext.Device(), 1024, 3);
+
+		size_t next = 0, elements = 0;
+		auto st = stream.Run(*kernel, in, out, 0, [&](size_t chunk, size_t first, size_t count) {
+			ASSERT_EQ(chunk, next++);
+			ASSERT_EQ(first, chunk * 1024);
+			elements += count;
+		});
+
+		ASSERT_EQ(st.Chunks, 10);
+		ASSERT_EQ(next, 10);
+		ASSERT_EQ(elements, size);
+		ASSERT_FLOAT_EQ(out.At(size - 1), 2.0f * (size - 1));
+		std::cout << " ** Streamed at " << st.GBps << " GB/s" << std::endl;
+
+		typedef GPU::CL::StreamCL<float> Stream;
+		ASSERT_THROW(Stream(gpuContext, gpuContext.Device(), 1024, 1), std::runtime_error);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, MultiDevice) {
+	try {
+		GPU::CL::ContextCL::Ptr context = GPU::CL::PlatformCL().NewCompleteContext();
+
+		auto program = context->NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void index(__global float* out, float scale) {
+					size_t i = get_global_size(0) * get_global_id(1) + get_global_id(0);
+					out[i] = i * scale;
+				}
+			)
+		);
+		program->BuildFor(context->Devices());
+
+		const size_t w = 256, h = 256;
+		auto out = context->NewBuffer<float>(w * h);
+
+		GPU::CL::MultiDeviceCL launcher(*context, *program, "index");
+		launcher.Args(*out, 2.0f);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(w, h);
+		r.LocalSize = cl::NDRange(8, 8);
+
+		auto st = launcher.Run(r, *out, 0, 32);
+
+		size_t chunks = 0, items = 0;
+		for (size_t d = 0; d < launcher.DeviceCount(); d++) {
+			chunks += st.Chunks[d];
+			items += st.Items[d];
+		}
+		ASSERT_EQ(chunks, 32);
+		ASSERT_EQ(items, w * h);
+		ASSERT_FLOAT_EQ(out->Data()[w * h - 1], 2.0f * (w * h - 1));
+
+		r.Offset = cl::NDRange(0, 8);
+		ASSERT_THROW(launcher.Run(r, *out, 0, 32), std::runtime_error);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Profiling) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().AddQueue(CL_QUEUE_PROFILING_ENABLE);
+		ASSERT_TRUE(cq.IsProfiling());
+		ASSERT_FALSE(gpuContext.Device().Queue().Profiler());
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void twice(__global float* a) {
+					a[get_global_id(0)] *= 2.0f;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "twice");
+
+		const size_t size = 1024;
+		auto buf = gpuContext.NewBuffer<float>(size);
+		kernel->Args(*buf);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(size);
+
+		cq.WriteBuffer(*buf);
+		for (int i = 0; i < 4; i++) {
+			cq.Enqueue(*kernel, r);
+		}
+		cq.FillBuffer(*buf, 1.0f);
+		cq.ReadBuffer(*buf);
+		cq.Finish();
+
+		auto records = cq.Profiler()->Records();
+		ASSERT_EQ(records.size(), 7);
+		ASSERT_EQ(records[0].Kind, "write");
+		ASSERT_EQ(records[0].Bytes, size * sizeof(float));
+		ASSERT_EQ(records[1].Name, "twice");
+		ASSERT_LE(records[1].Start, records[1].End);
+
+		auto summary = cq.Profiler()->KernelSummary();
+		ASSERT_EQ(summary.size(), 1);
+		ASSERT_EQ(summary[0].Count, 4);
+		ASSERT_LE(summary[0].P50Ns, summary[0].P99Ns);
+
+		std::ostringstream trace;
+		cq.Profiler()->ToChromeTrace(trace);
+		ASSERT_NE(trace.str().find("\"name\":\"twice\""), std::string::npos);
+		cq.Profiler()->ToText(std::cout);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Tuner) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void matrix(__global float* a) {
+					a[get_global_size(0) * get_global_id(1) + get_global_id(0)] = 1.0f;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "matrix");
+
+		const size_t size = 256;
+		auto buf = gpuContext.NewBuffer<float>(size * size);
+		kernel->Args(*buf);
+
+		const std::string db = "gpu_test_tuning.db";
+		std::remove(db.c_str());
+
+		const cl::NDRange global(size, size);
+		GPU::CL::TunerCL tuner(db, 2);
+		auto res = tuner.Tune(cq, *kernel, gpuContext.Device(), global);
+		ASSERT_FALSE(res.FromDatabase);
+		ASSERT_GT(res.Candidates, 0);
+		ASSERT_EQ(res.LocalSize.dimensions(), 2);
+		ASSERT_EQ(size % res.LocalSize[0], 0);
+		ASSERT_LE(res.LocalSize[0] * res.LocalSize[1], kernel->GetInfo().maxWorkGroupSize);
+
+		cq.FillBuffer(*buf, 0.0f);
+		cq.Enqueue(*kernel, GPU::CL::KernelCL::Range::Auto(global));
+		cq.ReadBuffer(*buf);
+		ASSERT_FLOAT_EQ(buf->Data()[size * size - 1], 1.0f);
+
+		auto other = program->NewKernel(gpuContext.Device(), "matrix");
+		GPU::CL::TunerCL persisted(db);
+		auto cached = persisted.Tune(cq, *other, gpuContext.Device(), global);
+		ASSERT_TRUE(cached.FromDatabase);
+		ASSERT_EQ(other->TunedLocalSize(global)[0], res.LocalSize[0]);
+
+		std::remove(db.c_str());
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, TypedKernel) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void axpy(__global float* y, __global const float* x, float a) {
+					size_t i = get_global_id(0);
+					y[i] += a * x[i];
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device(), "-cl-kernel-arg-info");
+
+		typedef GPU::CL::BufferCL<float> Buffer;
+		auto axpy = program->NewTypedKernel<Buffer, Buffer, float>(gpuContext.Device(), "axpy");
+
+		const size_t size = 256;
+		auto y = gpuContext.NewBuffer<float>(size);
+		auto x = gpuContext.NewBuffer<float>(size);
+		cq.FillBuffer(*y, 1.0f);
+		cq.FillBuffer(*x, 2.0f);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(size);
+
+		(*axpy)(cq, r, *y, *x, 0.5f);
+		(*axpy)(cq, r, *y, *x, 0.5f);
+		ASSERT_EQ(axpy->SetCount(), 3);
+		ASSERT_EQ(axpy->SkippedCount(), 3);
+
+		axpy->Launch(cq, r, GPU::CL::FutureCL(), *y, *x, 1.0f).Wait();
+		ASSERT_EQ(axpy->SetCount(), 4);
+
+		cq.ReadBuffer(*y);
+		ASSERT_FLOAT_EQ(y->Data()[size - 1], 5.0f);
+
+		// A view shares the cl_mem of its buffer but not the range recorded for residency.
+		auto t = gpuContext.NewTrackedBuffer<float>(size);
+		cq.FillBuffer(*t, 0.0f);
+		axpy->Bind(*t->View(0, size / 2), *x, 1.0f);
+		ASSERT_EQ(axpy->Kernel().Bindings().at(0).Bytes, size / 2 * sizeof(float));
+		axpy->Bind(*t, *x, 1.0f);
+		ASSERT_EQ(axpy->Kernel().Bindings().at(0).Bytes, size * sizeof(float));
+
+		ASSERT_THROW((program->NewTypedKernel<Buffer, float>(gpuContext.Device(), "axpy")), std::runtime_error);
+		ASSERT_THROW((program->NewTypedKernel<Buffer, Buffer, cl_int>(gpuContext.Device(), "axpy")), std::runtime_error);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, KernelPool) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::DeviceCL& device = gpuContext.Device();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void set(__global float* a, float v) {
+					a[get_global_id(0)] = v;
+				}
+			)
+		);
+		program->BuildFor(device);
+		auto pool = program->NewKernelPool(device, "set");
+
+		const size_t threads = 4, size = 256;
+		std::vector<GPU::CL::BufferCL<float>::Ptr> buffers;
+		for (size_t t = 0; t < threads; t++) {
+			buffers.push_back(gpuContext.NewBuffer<float>(size));
+		}
+
+		std::vector<GPU::CL::KernelCL*> kernels(threads);
+		std::vector<GPU::CL::QueueCL*> queues(threads);
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				GPU::CL::KernelCL& k = pool->Local();
+				GPU::CL::QueueCL& q = device.ThreadQueue();
+				kernels[t] = &k;
+				queues[t] = &q;
+
+				GPU::CL::KernelCL::Range r;
+				r.GlobalSize = cl::NDRange(size);
+				for (int i = 0; i < 16; i++) {
+					k.Args(*buffers[t], static_cast<float>(t));
+					q.Enqueue(k, r);
+				}
+				q.ReadBuffer(*buffers[t]);
+			});
+		}
+		for (auto& w : workers) {
+			w.join();
+		}
+
+		ASSERT_EQ(pool->Size(), threads);
+		for (size_t t = 0; t < threads; t++) {
+			ASSERT_FLOAT_EQ(buffers[t]->Data()[size - 1], static_cast<float>(t));
+			for (size_t o = t + 1; o < threads; o++) {
+				ASSERT_NE(kernels[t], kernels[o]);
+				ASSERT_NE(queues[t], queues[o]);
+			}
+		}
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, CommandBatch) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void scale(__global float* a, float f) {
+					a[get_global_id(0)] *= f;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "scale");
+
+		const size_t size = 256;
+		auto a = gpuContext.NewBuffer<float>(size);
+		auto b = gpuContext.NewBuffer<float>(size);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(size);
+
+		GPU::CL::CommandBatchCL batch(GPU::CL::CommandBatchCL::FlushPolicy(1, 2));
+		batch.FillBuffer(*a, 1.0f)
+			.Enqueue(*kernel, r, *a, 3.0f)
+			.Enqueue(*kernel, r, *a, 2.0f)
+			.CopyBuffer(*a, *b)
+			.Enqueue(*kernel, r, *b, 0.5f)
+			.ReadBuffer(*a)
+			.ReadBuffer(*b);
+		ASSERT_EQ(batch.Size(), 7);
+
+		for (int frame = 0; frame < 3; frame++) {
+			batch.Submit(cq).Wait();
+
+			ASSERT_EQ(batch.LastStats().Commands, 7);
+			ASSERT_EQ(batch.LastStats().Flushes, 4);
+			ASSERT_FLOAT_EQ(a->Data()[size - 1], 6.0f);
+			ASSERT_FLOAT_EQ(b->Data()[0], 3.0f);
+		}
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, MappedFile) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void twice(__global const float* in, __global float* out) {
+					out[get_global_id(0)] = 2.0f * in[get_global_id(0)];
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "twice");
+
+		const size_t size = 4096;
+		const std::string input = "mapped_in.bin", output = "mapped_out.bin";
+		{
+			auto in = GPU::CL::MappedFile<float>::New(input, GPU::CL::MappedFile<float>::ReadWrite, size);
+			for (size_t i = 0; i < size; i++) {
+				in->At(i) = static_cast<float>(i);
+			}
+		}
+
+		auto in = gpuContext.NewMappedBuffer<float>(input);
+		ASSERT_EQ(in->Count(), size);
+		ASSERT_TRUE(in->IsZeroCopy());
+
+		auto file = std::make_shared<GPU::CL::MappedFile<float>>(output, GPU::CL::MappedFile<float>::ReadWrite, size);
+		ASSERT_TRUE(GPU::CL::IsAligned(file->Data(), U_PAGE_SIZE));
+		auto out = gpuContext.NewBuffer<float>(file, CL_MEM_WRITE_ONLY);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(size);
+		kernel->Args(*in, *out);
+		cq.Enqueue(*kernel, r);
+		cq.ReadBuffer(*out);
+		file->Sync();
+
+		auto check = GPU::CL::MappedFile<float>::New(output);
+		ASSERT_EQ(check->Size(), size);
+		ASSERT_FLOAT_EQ(check->At(size - 1), 2.0f * (size - 1));
+
+		std::remove(input.c_str());
+		std::remove(output.c_str());
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Primitives) {
+	try {
+		typedef GPU::CL::PrimitivesCL P;
+
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+		P primitives(gpuContext, gpuContext.Device());
+
+		// Spans several levels of block totals.
+		const size_t size = 100003;
+		auto in = gpuContext.NewBuffer<cl_int>(size);
+		auto flags = gpuContext.NewBuffer<cl_uint>(size);
+		auto out = gpuContext.NewBuffer<cl_int>(size);
+		for (size_t i = 0; i < size; i++) {
+			in->Data()[i] = static_cast<cl_int>(i % 7) - 3;
+			flags->Data()[i] = (i % 1000 == 17) ? 1 : 0;
+		}
+		cq.WriteBuffer(*in);
+		cq.WriteBuffer(*flags);
+
+		for (P::Op op : { P::Sum, P::Min, P::Max }) {
+			ASSERT_EQ(primitives.Reduce(cq, *in, op), P::ReduceHost(in->Data(), size, op));
+		}
+		ASSERT_EQ(primitives.ProgramCount(), 3);
+
+		std::vector<cl_int> expected(size);
+		for (bool exclusive : { false, true }) {
+			(exclusive ? primitives.ExclusiveScan(cq, *in, *out, P::Sum) : primitives.InclusiveScan(cq, *in, *out, P::Sum)).Wait();
+			cq.ReadBuffer(*out);
+			P::ScanHost(in->Data(), expected.data(), size, P::Sum, exclusive);
+			for (size_t i = 0; i < size; i++) {
+				ASSERT_EQ(out->Data()[i], expected[i]) << i;
+			}
+
+			primitives.SegmentedScan(cq, *in, *flags, *out, P::Max, exclusive).Wait();
+			cq.ReadBuffer(*out);
+			P::SegmentedScanHost(in->Data(), flags->Data(), expected.data(), size, P::Max, exclusive);
+			for (size_t i = 0; i < size; i++) {
+				ASSERT_EQ(out->Data()[i], expected[i]) << i;
+			}
+		}
+
+		auto f = gpuContext.NewBuffer<cl_float>(size);
+		for (size_t i = 0; i < size; i++) {
+			f->Data()[i] = 0.5f;
+		}
+		cq.WriteBuffer(*f);
+		ASSERT_FLOAT_EQ(primitives.Reduce(cq, *f, P::Sum), 0.5f * size);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Sort) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+		GPU::CL::SortCL sort(gpuContext, gpuContext.Device());
+
+		const size_t size = 20011;
+		auto keys = gpuContext.NewBuffer<cl_uint>(size);
+		auto values = gpuContext.NewBuffer<cl_uint>(size);
+		std::vector<std::pair<cl_uint, cl_uint>> expected(size);
+		for (size_t i = 0; i < size; i++) {
+			// Few distinct keys, so stability is visible through the values.
+			keys->Data()[i] = static_cast<cl_uint>((i * 2654435761u) % 977);
+			values->Data()[i] = static_cast<cl_uint>(i);
+			expected[i] = std::make_pair(keys->Data()[i], values->Data()[i]);
+		}
+		std::stable_sort(expected.begin(), expected.end(),
+			[](const std::pair<cl_uint, cl_uint>& a, const std::pair<cl_uint, cl_uint>& b) { return a.first < b.first; });
+
+		cq.WriteBuffer(*keys);
+		cq.WriteBuffer(*values);
+		auto stats = sort.Sort(cq, *keys, *values);
+		ASSERT_EQ(stats.Keys, size);
+		ASSERT_EQ(stats.Passes, 8);
+		ASSERT_GT(stats.KeysPerSecond, 0.0);
+
+		cq.ReadBuffer(*keys);
+		cq.ReadBuffer(*values);
+		for (size_t i = 0; i < size; i++) {
+			ASSERT_EQ(keys->Data()[i], expected[i].first) << i;
+			ASSERT_EQ(values->Data()[i], expected[i].second) << i;
+		}
+
+		auto floats = gpuContext.NewBuffer<cl_float>(size);
+		std::vector<cl_float> sorted(size);
+		for (size_t i = 0; i < size; i++) {
+			sorted[i] = floats->Data()[i] = std::sin(static_cast<float>(i)) * 1000.0f;
+		}
+		std::sort(sorted.begin(), sorted.end());
+		cq.WriteBuffer(*floats);
+
+		auto top = sort.TopK(cq, *floats, 10, true);
+		ASSERT_EQ(top.size(), 10);
+		for (size_t i = 0; i < top.size(); i++) {
+			ASSERT_FLOAT_EQ(top[i], sorted[size - 1 - i]);
+		}
+
+		auto wide = gpuContext.NewBuffer<cl_ulong>(size);
+		for (size_t i = 0; i < size; i++) {
+			wide->Data()[i] = (static_cast<cl_ulong>(size - i) << 40) | i;
+		}
+		cq.WriteBuffer(*wide);
+		auto smallest = sort.TopK(cq, *wide, 3);
+		ASSERT_EQ(sort.LastStats().Passes, 16);
+		ASSERT_EQ(smallest[0], (static_cast<cl_ulong>(1) << 40) | (size - 1));
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+namespace {
+
+	// Rows padded to Pitch bytes, like a scan-line aligned bitmap.
+	class PaddedImage : public GPU::Image {
+	public:
+		// A pitch of 0 is tightly packed RGBA8.
+		PaddedImage(size_t w, size_t h, size_t pitch) : _w(w), _h(h), _pitch(pitch), _bits((pitch ? pitch : w * 4) * h) {}
+
+		virtual unsigned char* Bits() const { return const_cast<unsigned char*>(_bits.data()); }
+		virtual size_t Width() const { return _w; }
+		virtual size_t Height() const { return _h; }
+		virtual size_t BytesPerLine() const { return _pitch; }
+
+	private:
+		size_t _w, _h, _pitch;
+		std::vector<unsigned char> _bits;
+	};
+
+}
+
+TEST(CL, Image) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		const size_t w = 37, h = 19, pitch = 160;
+		auto src = std::make_shared<PaddedImage>(w, h, pitch);
+		for (size_t y = 0; y < h; y++) {
+			for (size_t x = 0; x < w * 4; x++) {
+				src->Bits()[y * pitch + x] = static_cast<unsigned char>(x + y);
+			}
+		}
+
+		auto in = gpuContext.NewImage(src);
+		ASSERT_EQ(in->Pitch(), pitch);
+		ASSERT_EQ(in->PixelSize(), 4);
+
+		auto dst = std::make_shared<PaddedImage>(w, h, 0);
+		auto out = gpuContext.NewImage(dst, CL_MEM_READ_WRITE);
+		ASSERT_EQ(out->Pitch(), w * 4);
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void invert(__read_only image2d_t in, __write_only image2d_t out, sampler_t s) {
+					int2 p = (int2)(get_global_id(0), get_global_id(1));
+					write_imageui(out, p, (uint4)(255) - read_imageui(in, s, p));
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "invert");
+		auto sampler = gpuContext.NewSampler();
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(w, h);
+		kernel->Args(*in, *out, *sampler);
+		cq.Enqueue(*kernel, r);
+		cq.ReadImage(*out);
+		ASSERT_EQ(dst->Bits()[(h - 1) * w * 4 + 5], 255 - ((h - 1) + 5));
+
+		auto linear = gpuContext.NewBuffer<cl_uchar>(w * h * 4);
+		cq.CopyImageToBuffer(*in, *linear);
+		cq.ReadBuffer(*linear);
+		ASSERT_EQ(linear->Data()[w * 4 + 3], 1 + 3);
+
+		cq.CopyBufferToImage(*linear, *out);
+		auto map = cq.Map(*out, CL_MAP_READ);
+		ASSERT_EQ(map->Row(h - 1)[7], (h - 1) + 7);
+		map->Unmap();
+
+		cq.CopyImage(*in, *out);
+		cq.ReadImage(*out);
+		ASSERT_EQ(dst->Bits()[2 * w * 4], 2);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, PixelConvert) {
+	typedef GPU::CL::PixelConvert P;
+
+	const P::Isa detected = P::Detect();
+	const size_t w = 67, h = 5, pitch = 300;
+	PaddedImage src(w, h, pitch);
+	for (size_t i = 0; i < pitch * h; i++) {
+		src.Bits()[i] = static_cast<unsigned char>(i * 31);
+	}
+
+	// Every instruction set must agree with the scalar path in both directions of every stage, including the tails.
+	const size_t size = w * h * 4;
+	std::vector<float> reference(size), planar(size), floats(size);
+	std::vector<unsigned char> swizzled(size), packed(size);
+	PaddedImage fromFloat4(w, h, 0), fromPlanar(w, h, 0), fromSwizzle(w, h, 0), back(w, h, 0);
+	P::SetIsa(P::Scalar);
+	P::Upload(src, P::ToFloat4, reference.data());
+	P::Upload(src, P::ToPlanar, planar.data());
+	P::Upload(src, P::Swizzle, swizzled.data());
+	P::Download(reference.data(), P::ToFloat4, fromFloat4);
+	P::Download(planar.data(), P::ToPlanar, fromPlanar);
+	P::Download(swizzled.data(), P::Swizzle, fromSwizzle);
+
+	for (int isa = P::SSE2; isa <= detected; isa++) {
+		P::SetIsa(static_cast<P::Isa>(isa));
+		ASSERT_EQ(P::Active(), isa);
+
+		P::Upload(src, P::ToFloat4, floats.data());
+		ASSERT_EQ(floats, reference);
+		P::Upload(src, P::ToPlanar, floats.data());
+		ASSERT_EQ(floats, planar);
+		P::Upload(src, P::Swizzle, packed.data());
+		ASSERT_EQ(packed, swizzled);
+
+		P::Download(reference.data(), P::ToFloat4, back);
+		ASSERT_EQ(std::memcmp(back.Bits(), fromFloat4.Bits(), size), 0);
+		P::Download(planar.data(), P::ToPlanar, back);
+		ASSERT_EQ(std::memcmp(back.Bits(), fromPlanar.Bits(), size), 0);
+		P::Download(swizzled.data(), P::Swizzle, back);
+		ASSERT_EQ(std::memcmp(back.Bits(), fromSwizzle.Bits(), size), 0);
+	}
+	P::SetIsa(detected);
+
+	// The scalar path itself round trips.
+	ASSERT_FLOAT_EQ(planar[w * h + 1], src.Bits()[5] / 255.0f);
+	for (size_t y = 0; y < h; y++) {
+		ASSERT_EQ(std::memcmp(fromFloat4.Bits() + y * w * 4, src.Bits() + y * pitch, w * 4), 0);
+		ASSERT_EQ(std::memcmp(fromPlanar.Bits() + y * w * 4, src.Bits() + y * pitch, w * 4), 0);
+		ASSERT_EQ(std::memcmp(fromSwizzle.Bits() + y * w * 4, src.Bits() + y * pitch, w * 4), 0);
+		ASSERT_EQ(swizzled[y * w * 4], src.Bits()[y * pitch + 2]);
+	}
+
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto buffer = gpuContext.NewBuffer<cl_float>(w * h * 4);
+		cq.WriteBuffer(*buffer, src, P::ToPlanar);
+		cq.ReadBuffer(*buffer, back, P::ToPlanar);
+		ASSERT_EQ(std::memcmp(back.Bits() + (h - 1) * w * 4, src.Bits() + (h - 1) * pitch, w * 4), 0);
+
+		// Converted into the storage of a tracked buffer, the whole staged size goes up.
+		auto tracked = gpuContext.NewTrackedBuffer<cl_float>(w * h * 4);
+		cq.WriteBuffer(*tracked, src, P::ToPlanar);
+		ASSERT_TRUE(tracked->Residency()->IsDeviceCurrent());
+		tracked->MarkDeviceDirty();
+		std::memset(back.Bits(), 0, w * h * 4);
+		cq.ReadBuffer(*tracked, back, P::ToPlanar);
+		ASSERT_EQ(std::memcmp(back.Bits() + (h - 1) * w * 4, src.Bits() + (h - 1) * pitch, w * 4), 0);
+
+		auto image = std::make_shared<PaddedImage>(w, h, pitch);
+		std::memcpy(image->Bits(), src.Bits(), pitch * h);
+		const cl::ImageFormat floatFormat(CL_RGBA, CL_FLOAT);
+		auto float4 = gpuContext.NewImage(image, CL_MEM_READ_WRITE, floatFormat, 4);
+		ASSERT_TRUE(float4->IsConverted());
+		cq.WriteImage(*float4, P::ToFloat4);
+		std::memset(image->Bits(), 0, pitch * h);
+		cq.ReadImage(*float4, P::ToFloat4);
+		ASSERT_EQ(std::memcmp(image->Bits() + pitch, src.Bits() + pitch, w * 4), 0);
+
+		// Plain transfers would move a float row per RGBA8 row, as would an undeclared host format.
+		ASSERT_THROW(cq.ReadImage(*float4), std::runtime_error);
+		ASSERT_THROW(cq.WriteImage(*float4, GPU::CL::QueueCL::FireAndForget), std::runtime_error);
+		ASSERT_THROW(gpuContext.NewImage(image, CL_MEM_READ_WRITE, floatFormat), std::runtime_error);
+		ASSERT_THROW(gpuContext.NewImage(image, U_COPY_READ_WRITE, floatFormat, 4), std::runtime_error);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, PackedBuffer) {
+	typedef GPU::CL::PackConvert P;
+	typedef GPU::CL::PackedBufferCL Packed;
+
+	const size_t size = 1003;
+	std::vector<float> data(size);
+	for (size_t i = 0; i < size; i++) {
+		data[i] = std::sin(0.01f * i) * 100.0f;
+	}
+	data[1] = 65520.0f;
+	data[2] = 1e-8f;
+
+	const P::Isa detected = P::Detect();
+	std::vector<uint16_t> reference(size), packed(size);
+	std::vector<int8_t> quantized(size), q(size);
+	const float scale = Packed::ScaleFor(data.data(), size);
+
+	P::SetIsa(P::Scalar);
+	P::FloatToHalf(data.data(), reference.data(), size);
+	P::FloatToInt8(data.data(), quantized.data(), size, scale);
+	ASSERT_EQ(reference[1], 0x7c00);
+	ASSERT_EQ(reference[2], 0);
+	ASSERT_EQ(P::ToHalf(1.0f), 0x3c00);
+	ASSERT_EQ(P::FromHalf(0x3555), 0.333251953125f);
+
+	for (int isa = P::SSE2; isa <= detected; isa++) {
+		P::SetIsa(static_cast<P::Isa>(isa));
+		P::FloatToHalf(data.data(), packed.data(), size);
+		ASSERT_EQ(packed, reference);
+		P::FloatToInt8(data.data(), q.data(), size, scale);
+		ASSERT_EQ(q, quantized);
+	}
+	P::SetIsa(detected);
+
+	// Round trip error stays within half an ulp of each format.
+	std::vector<float> back(size);
+	P::FloatToBFloat16(data.data(), packed.data(), size);
+	P::BFloat16ToFloat(packed.data(), back.data(), size);
+	for (size_t i = 3; i < size; i++) {
+		ASSERT_LE(std::fabs(back[i] - data[i]), std::fabs(data[i]) / 256.0f);
+	}
+	P::Int8ToFloat(quantized.data(), back.data(), size, scale);
+	for (size_t i = 3; i < size; i++) {
+		ASSERT_LE(std::fabs(back[i] - data[i]), scale / 2.0f + 1e-3f);
+	}
+
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			Packed::KernelSource() + U_KERNEL_CL(
+				__kernel void twice_half(__global half* a) {
+					size_t i = get_global_id(0);
+					vstore_half(2.0f * vload_half(i, a), i, a);
+				}
+
+				__kernel void twice_bf16(__global ushort* a) {
+					size_t i = get_global_id(0);
+					store_bf16(2.0f * load_bf16(i, a), i, a);
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(size);
+
+		const std::pair<Packed::Format, const char*> formats[] = { { Packed::Half, "twice_half" }, { Packed::BFloat16, "twice_bf16" } };
+		for (const auto& f : formats) {
+			auto buffer = gpuContext.NewPackedBuffer(size, f.first);
+			ASSERT_EQ(buffer->Bytes(), size * 2);
+			std::copy(data.begin() + 3, data.end(), buffer->Data() + 3);
+			std::fill(buffer->Data(), buffer->Data() + 3, 1.0f);
+
+			auto kernel = program->NewKernel(gpuContext.Device(), f.second);
+			kernel->Args(*buffer);
+			cq.Enqueue(*kernel, r, cq.WriteBuffer(*buffer, GPU::CL::FutureCL())).Wait();
+			cq.ReadBuffer(*buffer);
+
+			for (size_t i = 3; i < size; i++) {
+				ASSERT_LE(std::fabs(buffer->Data()[i] - 2.0f * data[i]), std::fabs(data[i]) / 64.0f);
+			}
+		}
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Residency) {
+	GPU::CL::ResidencyCL r(cl::Buffer(), nullptr, 1024, false);
+	r.MarkHostDirty(0, 16);
+	r.MarkHostDirty(16, 16);
+	r.MarkHostDirty(100, 10);
+	r.MarkDeviceDirty(8, 96);
+	r.MarkHostDirty(2000, 10);
+
+	ASSERT_EQ(r.HostDirtyBytes(), 8u + 6u);
+	ASSERT_EQ(r.DeviceDirtyBytes(), 96u);
+	ASSERT_FALSE(r.IsHostCurrent());
+
+	const std::vector<GPU::CL::ResidencyCL::Range> host = r.TakeHostDirty();
+	ASSERT_EQ(host.size(), 2u);
+	ASSERT_EQ(host[0], GPU::CL::ResidencyCL::Range(0, 8));
+	ASSERT_EQ(host[1], GPU::CL::ResidencyCL::Range(104, 110));
+	ASSERT_TRUE(r.IsDeviceCurrent());
+
+	r.MarkHostDirty(50, 4);
+	ASSERT_EQ(r.TakeDeviceDirty().size(), 2u);
+	ASSERT_TRUE(r.IsHostCurrent());
+
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void add(__global const float* a, __global float* b) {
+					b[get_global_id(0)] += a[get_global_id(0)];
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "add");
+
+		const size_t size = 1 << 16;
+		auto a = gpuContext.NewTrackedBuffer<float>(gpuContext.NewStorage<float>(size), U_COPY_READ);
+		auto b = gpuContext.NewTrackedBuffer<float>(size);
+		std::fill(a->Data(), a->Data() + size, 1.0f);
+		std::fill(b->Data(), b->Data() + size, 0.0f);
+		a->MarkHostDirty();
+		b->MarkHostDirty();
+
+		GPU::CL::KernelCL::Range range;
+		range.GlobalSize = cl::NDRange(size);
+
+		// No explicit writes: the launch uploads, the read downloads only the written argument.
+		kernel->Args(*a, *b);
+		cq.Enqueue(*kernel, range);
+		ASSERT_TRUE(a->Residency()->IsHostCurrent());
+		ASSERT_EQ(b->Residency()->DeviceDirtyBytes(), size * sizeof(float));
+		cq.ReadBuffer(*b);
+		ASSERT_FLOAT_EQ(b->Data()[size - 1], 1.0f);
+
+		// A single changed element is the only upload before the next launch.
+		a->At(10) = 5.0f;
+		ASSERT_EQ(a->Residency()->HostDirtyBytes(), sizeof(float));
+		cq.WriteBuffer(*a);
+		ASSERT_TRUE(a->Residency()->IsDeviceCurrent());
+		cq.WriteBuffer(*b);
+
+		cq.Enqueue(*kernel, range);
+		cq.ReadBuffer(*b);
+		ASSERT_FLOAT_EQ(b->Data()[10], 6.0f);
+		ASSERT_FLOAT_EQ(b->Data()[11], 2.0f);
+
+		// Elements the device changed cannot be handed out until they are read back.
+		cq.Enqueue(*kernel, range);
+		ASSERT_THROW(b->At(0), std::runtime_error);
+		ASSERT_THROW(b->Value(0), std::runtime_error);
+		ASSERT_EQ(b->Residency()->DeviceDirtyBytes(), size * sizeof(float));
+		cq.ReadBuffer(*b);
+		ASSERT_FLOAT_EQ(b->Value(0), 3.0f);
+		ASSERT_TRUE(b->Residency()->IsDeviceCurrent());
+
+		// Range writes leave the storage stale, range reads see pending host changes.
+		const float value = 7.0f;
+		cq.WriteBuffer(*b, 20, &value, 1, GPU::CL::FutureCL()).Wait();
+		ASSERT_EQ(b->Residency()->DeviceDirtyBytes(), sizeof(float));
+		b->At(30) = 8.0f;
+		float got[2] = { 0.0f, 0.0f };
+		cq.ReadBuffer(*b, 20, got, 1, GPU::CL::FutureCL()).Wait();
+		cq.ReadBuffer(*b, 30, got + 1, 1, GPU::CL::FutureCL()).Wait();
+		ASSERT_FLOAT_EQ(got[0], 7.0f);
+		ASSERT_FLOAT_EQ(got[1], 8.0f);
+		ASSERT_TRUE(b->Residency()->IsDeviceCurrent());
+		cq.ReadBuffer(*b);
+		ASSERT_FLOAT_EQ(b->Value(20), 7.0f);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, BufferViews) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		const size_t size = 1 << 16;
+		auto whole = gpuContext.NewBuffer<cl_float>(size);
+		std::fill(whole->Data(), whole->Data() + size, 0.0f);
+		cq.WriteBuffer(*whole);
+
+		// Tiles at aligned offsets are sub-buffers and can be bound; the odd one is an offset view.
+		const size_t tile = gpuContext.Device().Alignment() / sizeof(cl_float);
+		auto first = whole->Slice(0, tile);
+		auto second = whole->Slice(tile, tile);
+		auto odd = whole->Slice(3, 5);
+		ASSERT_TRUE(second->IsKernelArgument());
+		ASSERT_FALSE(odd->IsKernelArgument());
+		ASSERT_EQ(odd->DeviceBytesOffset(), 3 * sizeof(cl_float));
+		ASSERT_EQ(odd->Size(), 5 * sizeof(cl_float));
+		ASSERT_EQ(odd->Data(), whole->Data() + 3);
+		ASSERT_THROW(whole->Slice(size - 1, 2), std::runtime_error);
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void set(__global float* a, float v) {
+					a[get_global_id(0)] = v;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "set");
+		ASSERT_THROW(kernel->Arg(0, *odd), std::runtime_error);
+
+		GPU::CL::KernelCL::Range r;
+		r.GlobalSize = cl::NDRange(tile);
+		kernel->Args(*second, 2.0f);
+		cq.Enqueue(*kernel, r);
+
+		// Views work in every transfer without touching the rest of the buffer.
+		cq.FillBuffer(*odd, 1.0f);
+		cq.ReadBuffer(*second);
+		cq.ReadBuffer(*odd);
+		ASSERT_FLOAT_EQ(whole->Data()[tile], 2.0f);
+		ASSERT_FLOAT_EQ(whole->Data()[7], 1.0f);
+		ASSERT_FLOAT_EQ(whole->Data()[8], 0.0f);
+
+		odd->Data()[0] = 4.0f;
+		cq.WriteBuffer(*odd->View(0, 1));
+		cq.CopyBuffer(*odd, *first->View(100, 5));
+		cq.ReadBuffer(*whole);
+		ASSERT_FLOAT_EQ(whole->Data()[100], 4.0f);
+		ASSERT_FLOAT_EQ(whole->Data()[104], 1.0f);
+		ASSERT_FLOAT_EQ(whole->Data()[105], 0.0f);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, MemoryBudget) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+		const GPU::CL::MemoryBudgetCL::Ptr& budget = gpuContext.Device().Budget();
+		ASSERT_EQ(budget->Budget(), static_cast<size_t>(gpuContext.Device().GetInfo().GlobalMemSize));
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void inc(__global int* b) {
+					b[get_global_id(0)] += 1;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "inc");
+
+		const size_t size = 1 << 16, bytes = size * sizeof(cl_int);
+		budget->SetBudget(budget->Used() + 2 * bytes);
+
+		std::vector<GPU::CL::BufferCL<cl_int>::Ptr> buffers;
+		for (cl_int i = 0; i < 4; i++) {
+			auto storage = gpuContext.NewStorage<cl_int>(size);
+			std::fill(storage->Data(), storage->Data() + size, i * 10);
+			buffers.push_back(gpuContext.NewTrackedBuffer<cl_int>(storage));
+			ASSERT_TRUE(buffers.back()->IsBudgeted());
+		}
+		ASSERT_EQ(budget->GetStats().Evictions, 2u);
+		ASSERT_FALSE(buffers[0]->Allocation()->IsResident());
+
+		GPU::CL::KernelCL::Range range;
+		range.GlobalSize = cl::NDRange(size);
+
+		// Every launch restores its argument and evicts the least recently used one, whose dirty ranges go to the host.
+		for (int pass = 0; pass < 2; pass++) {
+			for (auto& b : buffers) {
+				kernel->Arg(0, *b);
+				cq.Enqueue(*kernel, range);
+			}
+		}
+		const GPU::CL::MemoryBudgetCL::Stats stats = budget->GetStats();
+		ASSERT_GT(stats.Restores, 0u);
+		ASSERT_EQ(stats.RestoredBytes, stats.Restores * bytes);
+		ASSERT_GT(stats.ReadBacks, 0u);
+		ASSERT_EQ(stats.ReadBackBytes, stats.ReadBacks * bytes);
+		ASSERT_LE(budget->Used(), budget->Budget());
+
+		for (size_t i = 0; i < buffers.size(); i++) {
+			cq.ReadBuffer(*buffers[i]);
+			ASSERT_EQ(buffers[i]->Data()[0], static_cast<cl_int>(i * 10 + 2));
+			ASSERT_EQ(buffers[i]->Data()[size - 1], static_cast<cl_int>(i * 10 + 2));
+		}
+
+		// Pinned buffers stay resident.
+		{
+			auto pin = buffers[0]->Pin();
+			budget->EvictAll();
+			ASSERT_TRUE(buffers[0]->Allocation()->IsResident());
+			ASSERT_FALSE(buffers[1]->Allocation()->IsResident());
+		}
+		budget->EvictAll();
+		ASSERT_EQ(budget->Used(), 0u);
+
+		// Untracked buffers the device changed stay resident until read back.
+		auto plain = gpuContext.NewBuffer<cl_int>(size);
+		std::fill(plain->Data(), plain->Data() + size, 1);
+		cq.WriteBuffer(*plain);
+		kernel->Arg(0, *plain);
+		cq.Enqueue(*kernel, range);
+		budget->EvictAll();
+		ASSERT_TRUE(plain->Allocation()->IsResident());
+		cq.ReadBuffer(*plain);
+		ASSERT_EQ(plain->Data()[0], 2);
+
+		// Host edits not yet written survive an eviction.
+		plain->Data()[0] = 7;
+		budget->EvictAll();
+		ASSERT_FALSE(plain->Allocation()->IsResident());
+		cq.WriteBuffer(*plain);
+		std::fill(plain->Data(), plain->Data() + size, 0);
+		cq.ReadBuffer(*plain);
+		ASSERT_EQ(plain->Data()[0], 7);
+		ASSERT_EQ(plain->Data()[size - 1], 2);
+
+		// Copies mark their destination too, both operands are pinned while either is restored.
+		auto copy = gpuContext.NewBuffer<cl_int>(size);
+		budget->EvictAll();
+		cq.CopyBuffer(*plain, *copy);
+		budget->EvictAll();
+		ASSERT_TRUE(copy->Allocation()->IsResident());
+		ASSERT_FALSE(plain->Allocation()->IsResident());
+		cq.ReadBuffer(*copy);
+		ASSERT_EQ(copy->Data()[0], 7);
+
+		// Released allocations leave the budget on its next call.
+		const size_t used = budget->Used();
+		copy.reset();
+		ASSERT_EQ(budget->Used(), used - bytes);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, Metrics) {
+	GPU::CL::MetricsCL::Snapshot snapshot;
+	snapshot.ProgramBuilds = 1;
+	snapshot.Launches["a\"b"] = 3;
+	const GPU::CL::MemoryBudgetCL::Stats budget = { 4096, 8192, 1, 2048, 1, 2048, 1, 1024 };
+	GPU::CL::MetricsCL::Snapshot::Device device = { "gpu", 2, 4096, std::vector<GPU::CL::QueueCL::Stats>(1), budget };
+	device.Queues[0] = GPU::CL::QueueCL::Stats{ 1024, 512, 0, 3, 3, 2, 1500 };
+	snapshot.Devices.push_back(device);
+
+	std::ostringstream json;
+	snapshot.ToJson(json);
+	ASSERT_NE(json.str().find("\"a\\\"b\":3"), std::string::npos);
+	ASSERT_NE(json.str().find("\"bytes_uploaded\":1024"), std::string::npos);
+	ASSERT_NE(json.str().find("\"blocked_ns\":1500"), std::string::npos);
+	ASSERT_NE(json.str().find("\"read_back_bytes\":1024"), std::string::npos);
+
+	std::ostringstream text;
+	snapshot.ToText(text);
+	ASSERT_NE(text.str().find("0, 0, 2, 4096, 1024, 512, 0, 3, 3, 2, 1.5"), std::string::npos);
+	ASSERT_NE(text.str().find("0, 4096, 8192, 1, 2048, 1, 2048, 1, 1024"), std::string::npos);
+
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+
+		auto program = gpuContext.NewProgramFromSource(
+			U_KERNEL_CL(
+				__kernel void inc(__global int* b) {
+					b[get_global_id(0)] += 1;
+				}
+			)
+		);
+		program->BuildFor(gpuContext.Device());
+		auto kernel = program->NewKernel(gpuContext.Device(), "inc");
+
+		const size_t size = 1 << 16, bytes = size * sizeof(cl_int);
+		auto a = gpuContext.NewBuffer<cl_int>(size);
+		auto b = gpuContext.NewBuffer<cl_int>(size);
+		ASSERT_EQ(gpuContext.Device().LiveBuffers(), 2u);
+		ASSERT_EQ(gpuContext.Device().LiveBytes(), 2 * bytes);
+
+		GPU::CL::KernelCL::Range range;
+		range.GlobalSize = cl::NDRange(size);
+
+		cq.WriteBuffer(*a);
+		kernel->Arg(0, *a);
+		cq.Enqueue(*kernel, range);
+		cq.Enqueue(*kernel, range);
+		cq.CopyBuffer(*a, *b);
+		cq.ReadBuffer(*b);
+		cq.Finish();
+
+		const GPU::CL::MetricsCL::Snapshot s = gpuContext.Metrics();
+		ASSERT_EQ(s.ProgramBuilds, 1u);
+		ASSERT_EQ(s.Launches.at("inc"), 2u);
+		ASSERT_EQ(kernel->Launches(), 2u);
+
+		const GPU::CL::QueueCL::Stats& q = s.Devices.at(0).Queues.at(0);
+		ASSERT_EQ(q.BytesUploaded, bytes);
+		ASSERT_EQ(q.BytesDownloaded, bytes);
+		ASSERT_EQ(q.BytesCopied, bytes);
+		ASSERT_EQ(q.Launches, 2u);
+		ASSERT_EQ(q.BlockingSyncs, 3u);
+
+		// Views keep the buffer live.
+		auto view = a->View(0, size / 2);
+		a.reset();
+		b.reset();
+		ASSERT_EQ(gpuContext.Device().LiveBuffers(), 1u);
+		view.reset();
+		ASSERT_EQ(gpuContext.Device().LiveBytes(), 0u);
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}
+
+TEST(CL, TransferPolicy) {
+	try {
+		GPU::CL::ContextCL gpuContext;
+		GPU::CL::QueueCL& cq = gpuContext.Device().Queue();
+		ASSERT_EQ(cq.GetTransferPolicy(), GPU::CL::QueueCL::Blocking);
+
+		const size_t size = 1 << 16;
+		auto a = gpuContext.NewBuffer<cl_int>(size);
+		auto b = gpuContext.NewBuffer<cl_int>(size);
+		std::fill(a->Data(), a->Data() + size, 7);
+		std::fill(b->Data(), b->Data() + size, 0);
+
+		ASSERT_TRUE(cq.WriteBuffer(*b, GPU::CL::QueueCL::Blocking).Empty());
+
+		// The in-order queue chains the three, only the last one is waited for.
+		cq.WriteBuffer(*a, GPU::CL::QueueCL::Async);
+		cq.CopyBuffer(*a, *b, GPU::CL::QueueCL::Async);
+		GPU::CL::FutureCL down = cq.ReadBuffer(*b, GPU::CL::QueueCL::Async);
+		ASSERT_FALSE(down.Empty());
+		down.Wait();
+		ASSERT_EQ(b->Data()[size - 1], 7);
+
+		// Rect transfers only touch their region.
+		std::fill(b->Data(), b->Data() + size, 0);
+		GPU::CL::BufferRectCL<cl_int> rect(256, 1);
+		rect.HostPitch(256);
+		rect.DevicePitch(256);
+		cq.ReadBufferRect(*b, rect, GPU::CL::QueueCL::Async).Wait();
+		ASSERT_EQ(b->Data()[255], 7);
+		ASSERT_EQ(b->Data()[size - 1], 0);
+
+		// Queue policy: plain overloads return before the transfer, none of them counts as a sync point.
+		const size_t syncs = cq.GetStats().BlockingSyncs;
+		cq.SetTransferPolicy(GPU::CL::QueueCL::Async);
+		cq.WriteBuffer(*a);
+		cq.ReadBuffer(*b);
+		ASSERT_EQ(cq.GetStats().BlockingSyncs, syncs);
+		cq.Finish();
+
+		// Fire and forget keeps the storage alive after every reference of ours is gone. The user event
+		// holds the in-order queue, so the write is still pending when the buffer goes.
+		cq.SetTransferPolicy(GPU::CL::QueueCL::FireAndForget);
+		auto c = gpuContext.NewBuffer<cl_int>(size);
+		std::weak_ptr<GPU::CL::Storage<cl_int>> storage = c->Host();
+		cl::UserEvent gate(gpuContext.Get());
+		cq.Marker(GPU::CL::FutureCL(gate));
+		cq.WriteBuffer(*c);
+		c.reset();
+		const bool held = !storage.expired();
+		gate.setStatus(CL_COMPLETE);
+		ASSERT_TRUE(held);
+		cq.Finish();
+		for (int i = 0; i < 1000 && !storage.expired(); i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		ASSERT_TRUE(storage.expired());
+	} catch (const cl::Error& err) {
+		TRACE(err.err(), err.what());
+	}
+}